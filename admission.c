@@ -0,0 +1,303 @@
+/* admission.c
+ * Limits the number of concurrent sessions, globally and per client
+ * address, and the rate of connections, recipients and message data
+ * per client address.
+ *
+ * Notes: Counters are kept in shared memory created before any
+ * process is forked, so the accepting process, forked children and
+ * threads all see the same values. Sessions per address are counted
+ * in a fixed-size table of counters indexed by hashes of the address,
+ * in the style of a count-min sketch: each address increments
+ * ADMISSION_HASHES counters, and its count is the smallest of them.
+ * Addresses sharing a counter can only make the count higher, never
+ * lower, and with two counters per address this is rare. Counters are
+ * updated with atomic operations only, so admission never blocks, and
+ * nothing needs to be removed when an address goes away.
+ *
+ * Rates are limited with token buckets indexed in the same way. Each
+ * bucket is a single 64-bit word (tokens and time of the last refill)
+ * updated with compare-and-swap, so processes never wait for each
+ * other. An address may use a token while any of its buckets has one,
+ * so an address sharing a bucket with an abusive one is not blocked
+ * unless all its buckets are shared.
+ */
+
+#include "admission.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+// Number of per-address counters (power of two)
+#define ADMISSION_TABLE_SIZE 65536
+
+struct admission_table {
+  unsigned int total;
+  unsigned int counts[ADMISSION_TABLE_SIZE];
+  // Tokens in the upper 32 bits, time of the last refill (in
+  // milliseconds, wrapping around) in the lower 32 bits
+  uint64_t buckets[RATE_KINDS][ADMISSION_TABLE_SIZE];
+};
+
+static struct admission_table *table = NULL;
+static unsigned int max_clients = 0, max_per_addr = 0;
+static struct {
+  double rate;          // tokens added per second, 0 for no limit
+  unsigned int burst;   // maximum tokens in a bucket
+} rate_limits[RATE_KINDS];
+// Random start for the hashes, so collisions can't be predicted
+static uint64_t hash_seed;
+
+/** Internal function that computes the hash of a client address
+ *  (64-bit FNV-1a). IPv6 clients usually control a whole /64 prefix,
+ *  so only the prefix is used; IPv4 addresses mapped to IPv6 are
+ *  hashed as IPv4.
+ *
+ *  Returns: 0 if the address has a known family, -1 otherwise.
+ */
+static int address_hash(const struct sockaddr *addr, uint64_t *hash) {
+
+  static const unsigned char v4_mapped[12] = { [10] = 0xff, [11] = 0xff };
+  const unsigned char *key;
+  size_t len, i;
+
+  if (addr->sa_family == AF_INET) {
+    key = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+    len = 4;
+  } else if (addr->sa_family == AF_INET6) {
+    key = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+    len = 8;
+    if (!memcmp(key, v4_mapped, sizeof(v4_mapped))) {
+      key += sizeof(v4_mapped);
+      len = 4;
+    }
+  } else {
+    return -1;
+  }
+
+  *hash = hash_seed;
+  for (i = 0; i < len; i++) {
+    *hash ^= key[i];
+    *hash *= 0x100000001b3ULL;
+  }
+  return 0;
+}
+
+/** Internal function that returns the current time of the monotonic
+ *  clock, in milliseconds. The clock is the same for all processes.
+ */
+static uint32_t now_ms(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/** Sets up the limits. Must be called before any session is admitted,
+ *  and before processes are forked. Rate limits must be set before
+ *  this function is called.
+ *
+ *  Parameters: clients: Maximum number of concurrent sessions, or 0
+ *                       for no limit.
+ *              per_addr: Maximum number of concurrent sessions from
+ *                        the same address (or IPv6 /64 prefix), or 0
+ *                        for no limit.
+ *
+ *  Returns: 0 on success, or -1 if the shared memory could not be
+ *           created.
+ */
+int admission_init(int clients, int per_addr) {
+
+  int i, rates = 0;
+  max_clients = clients > 0 ? clients : 0;
+  max_per_addr = per_addr > 0 ? per_addr : 0;
+  for (i = 0; i < RATE_KINDS; i++)
+    if (rate_limits[i].rate > 0)
+      rates = 1;
+  if (!max_clients && !max_per_addr && !rates)
+    return 0;
+
+  table = mmap(NULL, sizeof(struct admission_table), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED) {
+    perror("mmap");
+    table = NULL;
+    return -1;
+  }
+  hash_seed = 0xcbf29ce484222325ULL ^ ((uint64_t) time(NULL) << 20) ^ getpid();
+  return 0;
+}
+
+/** Checks if a new session from a client address can be started, and
+ *  counts it if so. Also takes a token from the connection rate limit
+ *  of the address. Does not block.
+ *
+ *  Parameters: addr: Address of the client.
+ *              ticket: Filled with the counters taken by the session,
+ *                      to be passed to admission_leave when the
+ *                      session ends.
+ *
+ *  Returns: 0 if the session is admitted, or -1 if it would exceed
+ *           one of the limits.
+ */
+int admission_enter(const struct sockaddr *addr, struct admission_ticket *ticket) {
+
+  int i;
+
+  memset(ticket, 0, sizeof(*ticket));
+  if (!table)
+    return 0;
+  client_key_from_addr(addr, &ticket->key);
+  if (rate_limit_take(&ticket->key, RATE_CONNECTIONS, 1))
+    return -1;
+
+  if (__atomic_add_fetch(&table->total, 1, __ATOMIC_RELAXED) > max_clients && max_clients) {
+    __atomic_sub_fetch(&table->total, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  ticket->admitted = 1;
+
+  if (!max_per_addr || !ticket->key.valid)
+    return 0;
+
+  unsigned int count = ~0U;
+  for (i = 0; i < ADMISSION_HASHES; i++) {
+    unsigned int n = __atomic_add_fetch(&table->counts[ticket->key.slots[i]], 1, __ATOMIC_RELAXED);
+    if (n < count)
+      count = n;
+  }
+  ticket->admitted = 2;
+
+  if (count > max_per_addr) {
+    admission_leave(ticket);
+    return -1;
+  }
+  return 0;
+}
+
+/** Releases the counters taken by an admitted session. Does nothing
+ *  if the session was not admitted, or was already released.
+ *
+ *  Parameters: ticket: Ticket filled by admission_enter.
+ */
+void admission_leave(struct admission_ticket *ticket) {
+
+  int i;
+  if (!table || !ticket->admitted)
+    return;
+  if (ticket->admitted == 2)
+    for (i = 0; i < ADMISSION_HASHES; i++)
+      __atomic_sub_fetch(&table->counts[ticket->key.slots[i]], 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&table->total, 1, __ATOMIC_RELAXED);
+  ticket->admitted = 0;
+}
+
+/** Finds the counters used for a client address.
+ *
+ *  Parameters: addr: Address of the client.
+ *              key: Filled with the counters of the address. If there
+ *                   are no limits, or the address family is unknown,
+ *                   key->valid is set to 0 and limits don't apply.
+ */
+void client_key_from_addr(const struct sockaddr *addr, struct client_key *key) {
+
+  uint64_t hash;
+  int i;
+
+  memset(key, 0, sizeof(*key));
+  if (!table || address_hash(addr, &hash) < 0)
+    return;
+  // Indexes derived from two halves of the hash, as in the user filter
+  uint32_t h1 = (uint32_t) hash, h2 = (uint32_t) (hash >> 32) | 1;
+  for (i = 0; i < ADMISSION_HASHES; i++)
+    key->slots[i] = (h1 + i * h2) % ADMISSION_TABLE_SIZE;
+  key->valid = 1;
+}
+
+/** Finds the counters used for the client connected to a socket.
+ *
+ *  Parameters: fd: Socket connected to the client.
+ *              key: Same as in client_key_from_addr.
+ */
+void client_key_from_socket(int fd, struct client_key *key) {
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+
+  if (getpeername(fd, (struct sockaddr *) &addr, &len) < 0)
+    addr.ss_family = AF_UNSPEC;
+  client_key_from_addr((struct sockaddr *) &addr, key);
+}
+
+/** Limits the rate of an action per client address, with a token
+ *  bucket. Must be called before admission_init.
+ *
+ *  Parameters: kind: One of the RATE_* constants.
+ *              rate: Tokens added to the bucket of each address per
+ *                    second, or 0 for no limit.
+ *              burst: Maximum tokens kept in a bucket, i.e., how much
+ *                     may be used at once after a quiet period.
+ */
+void rate_limit_set(int kind, double rate, unsigned int burst) {
+
+  rate_limits[kind].rate = rate > 0 ? rate : 0;
+  rate_limits[kind].burst = burst > 0 ? burst : 1;
+}
+
+/** Takes tokens from the buckets of a client address, if the address
+ *  is within its rate limit. Does not block.
+ *
+ *  Parameters: key: Counters of the client address.
+ *              kind: One of the RATE_* constants.
+ *              amount: Number of tokens needed (e.g., 1 for a command,
+ *                      or a number of bytes). Amounts larger than the
+ *                      burst are limited to the burst.
+ *
+ *  Returns: 0 if the tokens were taken, or the number of milliseconds
+ *           until they may be available otherwise.
+ */
+long rate_limit_take(const struct client_key *key, int kind, size_t amount) {
+
+  double rate = rate_limits[kind].rate;
+  unsigned int burst = rate_limits[kind].burst, best = 0;
+  int i, taken = 0;
+
+  if (!table || !key->valid || rate <= 0)
+    return 0;
+  if (amount > burst)
+    amount = burst;
+
+  uint32_t now = now_ms();
+  for (i = 0; i < ADMISSION_HASHES; i++) {
+    uint64_t *bucket = &table->buckets[kind][key->slots[i]];
+    uint64_t old = __atomic_load_n(bucket, __ATOMIC_RELAXED), new;
+    unsigned int tokens;
+    do {
+      uint32_t stamp = (uint32_t) old;
+      double earned = (uint32_t) (now - stamp) * rate / 1000;
+      tokens = old >> 32;
+      if (tokens + earned >= burst) {
+	tokens = burst;
+	stamp = now;
+      } else {
+	// Time of a partial token is kept for the next refill
+	tokens += (unsigned int) earned;
+	stamp += (uint32_t) ((unsigned int) earned * 1000 / rate);
+      }
+      new = (uint64_t) (tokens >= amount ? tokens - amount : tokens) << 32 | stamp;
+    } while (!__atomic_compare_exchange_n(bucket, &old, new, 1,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (tokens >= amount)
+      taken = 1;
+    if (tokens > best)
+      best = tokens;
+  }
+
+  if (taken)
+    return 0;
+  return (long) ((amount - best) * 1000 / rate) + 1;
+}
@@ -0,0 +1,44 @@
+/* admission.h
+ * Limits the number of concurrent sessions, globally and per client
+ * address, and the rate of connections, recipients and message data
+ * per client address.
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <sys/socket.h>
+
+// Counters checked for each client address
+#define ADMISSION_HASHES 2
+
+// Rates limited per client address (see rate_limit_set)
+#define RATE_CONNECTIONS 0 // new connections
+#define RATE_RECIPIENTS  1 // RCPT commands
+#define RATE_DATA_BYTES  2 // message data received
+#define RATE_KINDS       3
+
+// Identifies the counters used for a client address
+struct client_key {
+  int valid;                            // 0 if the address has no counters
+  unsigned int slots[ADMISSION_HASHES];
+};
+
+// Counters taken by an admitted session, released when it ends
+struct admission_ticket {
+  int admitted;                         // 0 if not counted, 1 if counted
+                                        // globally, 2 also per address
+  struct client_key key;
+};
+
+int admission_init(int max_clients, int max_per_addr);
+int admission_enter(const struct sockaddr *addr, struct admission_ticket *ticket);
+void admission_leave(struct admission_ticket *ticket);
+
+void client_key_from_addr(const struct sockaddr *addr, struct client_key *key);
+void client_key_from_socket(int fd, struct client_key *key);
+
+void rate_limit_set(int kind, double rate, unsigned int burst);
+long rate_limit_take(const struct client_key *key, int kind, size_t amount);
+
+#endif
@@ -0,0 +1,184 @@
+/* arena.c
+ * Bump allocator for the objects of a session, freed all at once.
+ *
+ * Notes: An arena is a stack of blocks; allocations take the next
+ * bytes of the newest block, and a new block is only added when it is
+ * full (or the object is bigger than a block). Releasing an arena up
+ * to a mark (or resetting it) keeps the blocks no longer used in a
+ * spare list, so a session that repeats the same commands stops
+ * calling malloc after the first ones; only blocks larger than
+ * ARENA_MAX_SPARE_SIZE (e.g., for a large message) are freed right
+ * away. The first block is allocated with the arena itself. Arenas do
+ * no locking: each is used by a single session.
+ */
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Alignment of every object, enough for any type
+#define ARENA_ALIGN 16
+// Largest block kept for reuse once released
+#define ARENA_MAX_SPARE_SIZE (1024 * 1024)
+
+struct arena_block {
+  struct arena_block *prev; // block below in the stack (or spare list)
+  size_t size;              // bytes in data
+  size_t used;
+  char data[0];
+};
+
+struct arena {
+  struct arena_block *current; // newest block
+  struct arena_block *spare;   // released blocks
+  size_t block_size;
+  // Must be the last member, since its data follows the struct
+  struct arena_block first;
+};
+
+/** Internal function that returns the padding needed before the next
+ *  object of a block, so the object is aligned.
+ */
+static size_t padding(const struct arena_block *block) {
+
+  return -(uintptr_t) (block->data + block->used) & (ARENA_ALIGN - 1);
+}
+
+/** Creates an arena.
+ *
+ *  Parameters: block_size: Size of the blocks allocated by the arena,
+ *                          enough for most objects of a session.
+ *
+ *  Returns: An arena_t object to allocate from, or NULL if there is no
+ *           memory.
+ */
+arena_t arena_create(size_t block_size) {
+
+  arena_t arena = malloc(sizeof(struct arena) + block_size);
+  if (!arena)
+    return NULL;
+  arena->current = &arena->first;
+  arena->spare = NULL;
+  arena->block_size = block_size;
+  arena->first.prev = NULL;
+  arena->first.size = block_size;
+  arena->first.used = 0;
+  return arena;
+}
+
+/** Frees an arena, with all objects allocated from it.
+ *
+ *  Parameters: arena: Arena to be freed.
+ */
+void arena_destroy(arena_t arena) {
+
+  arena_reset(arena);
+  while (arena->spare) {
+    struct arena_block *block = arena->spare;
+    arena->spare = block->prev;
+    free(block);
+  }
+  free(arena);
+}
+
+/** Allocates an object from an arena. The object is valid until the
+ *  arena is reset, released to a mark taken before the allocation, or
+ *  destroyed, and is never freed by itself.
+ *
+ *  Parameters: arena: Arena to allocate from.
+ *              size: Size of the object in bytes.
+ *
+ *  Returns: The object, aligned for any type, or NULL if there is no
+ *           memory.
+ */
+void *arena_alloc(arena_t arena, size_t size) {
+
+  struct arena_block *block = arena->current;
+  if (block->size - block->used < size + padding(block)) {
+    // A spare block that fits, or a new one
+    struct arena_block **link = &arena->spare;
+    while (*link && (*link)->size < size + ARENA_ALIGN)
+      link = &(*link)->prev;
+    block = *link;
+    if (block) {
+      *link = block->prev;
+    } else {
+      size_t block_size = size + ARENA_ALIGN > arena->block_size ?
+	size + ARENA_ALIGN : arena->block_size;
+      block = malloc(sizeof(struct arena_block) + block_size);
+      if (!block)
+	return NULL;
+      block->size = block_size;
+    }
+    block->used = 0;
+    block->prev = arena->current;
+    arena->current = block;
+  }
+  block->used += padding(block);
+  void *object = block->data + block->used;
+  block->used += size;
+  return object;
+}
+
+/** Copies a string into an arena.
+ *
+ *  Parameters: arena: Arena to allocate from.
+ *              str: String to be copied.
+ *
+ *  Returns: The copy, or NULL if there is no memory.
+ */
+char *arena_strdup(arena_t arena, const char *str) {
+
+  size_t size = strlen(str) + 1;
+  char *copy = arena_alloc(arena, size);
+  if (copy)
+    memcpy(copy, str, size);
+  return copy;
+}
+
+/** Marks the current position of an arena, so objects allocated
+ *  after this call can be freed together with arena_release.
+ *
+ *  Parameters: arena: Arena to be marked.
+ *
+ *  Returns: The mark.
+ */
+struct arena_mark arena_mark(arena_t arena) {
+
+  struct arena_mark mark = { arena->current, arena->current->used };
+  return mark;
+}
+
+/** Frees all objects allocated from an arena after a mark was taken.
+ *  Marks taken after this one are no longer valid.
+ *
+ *  Parameters: arena: Arena to be released.
+ *              mark: Mark returned by arena_mark.
+ */
+void arena_release(arena_t arena, struct arena_mark mark) {
+
+  while (arena->current != mark.block) {
+    struct arena_block *block = arena->current;
+    arena->current = block->prev;
+    if (block->size > ARENA_MAX_SPARE_SIZE) {
+      free(block);
+    } else {
+      block->prev = arena->spare;
+      arena->spare = block;
+    }
+  }
+  arena->current->used = mark.used;
+}
+
+/** Frees all objects allocated from an arena, keeping the arena to
+ *  allocate more.
+ *
+ *  Parameters: arena: Arena to be reset.
+ */
+void arena_reset(arena_t arena) {
+
+  struct arena_mark mark = { &arena->first, 0 };
+  arena_release(arena, mark);
+}
@@ -0,0 +1,26 @@
+/* arena.h
+ * Bump allocator for the objects of a session, freed all at once.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena *arena_t;
+
+// Position in an arena, to free everything allocated after it
+struct arena_mark {
+  struct arena_block *block;
+  size_t used;
+};
+
+arena_t arena_create(size_t block_size);
+void arena_destroy(arena_t arena);
+void *arena_alloc(arena_t arena, size_t size);
+char *arena_strdup(arena_t arena, const char *str);
+struct arena_mark arena_mark(arena_t arena);
+void arena_release(arena_t arena, struct arena_mark mark);
+void arena_reset(arena_t arena);
+
+#endif
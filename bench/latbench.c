@@ -0,0 +1,192 @@
+/* latbench.c
+ * Measures the latency of each SMTP command against a running server
+ * (e.g., over loopback), and reports percentiles per command.
+ *
+ * Usage: latbench [-n sessions] [-r recipient] [-P] [host] port
+ *
+ * Each session connects, sends EHLO, MAIL, RCPT, DATA, a short
+ * message and QUIT, one command at a time, timing each command from
+ * the moment it is sent until its reply is received. With -P, MAIL,
+ * RCPT and DATA are pipelined (sent in a single write) and timed as a
+ * group, which shows the effect of reply coalescing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_COMMANDS 8
+
+struct command {
+  const char *name;
+  const char *text;     // sent as is, NULL to only read the reply
+  int replies;          // replies expected
+  double *samples;      // latencies in microseconds
+  int count;
+};
+
+static double now_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/** Reads replies until a number of them is complete (the last line of
+ *  a multi-line reply has a space after the code).
+ *
+ *  Returns: 0 if all replies were positive, -1 otherwise.
+ */
+static int read_replies(int fd, int count) {
+
+  char buf[4096];
+  size_t len = 0;
+  int failed = 0;
+
+  while (count > 0) {
+    ssize_t rv = recv(fd, buf + len, sizeof(buf) - len, 0);
+    if (rv <= 0)
+      return -1;
+    len += rv;
+    char *line = buf, *eol;
+    while ((eol = memchr(line, '\n', buf + len - line)) != NULL) {
+      if (eol - line >= 4 && line[3] != '-') {
+	count--;
+	if (line[0] != '2' && line[0] != '3')
+	  failed = 1;
+      }
+      line = eol + 1;
+    }
+    len = buf + len - line;
+    memmove(buf, line, len);
+    if (len == sizeof(buf))
+      return -1;
+  }
+  return failed ? -1 : 0;
+}
+
+static int connect_to(const char *host, const char *port) {
+
+  struct addrinfo hints, *res, *p;
+  int fd = -1, one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0)
+    return -1;
+  for (p = res; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd >= 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/** Returns a percentile of sorted samples, by the nearest-rank method.
+ */
+static double percentile(const double *samples, int count, double p) {
+
+  int rank = (int) (p * count + 0.999999);
+  if (rank < 1)
+    rank = 1;
+  return samples[rank - 1];
+}
+
+int main(int argc, char *argv[]) {
+
+  int sessions = 1000, pipelined = 0, errors = 0, opt, i, s;
+  const char *rcpt = "alice";
+  struct command commands[MAX_COMMANDS];
+  int ncommands = 0;
+  char rcpt_line[256], group[512];
+
+  while ((opt = getopt(argc, argv, "n:r:P")) != -1) {
+    switch (opt) {
+    case 'n': sessions = atoi(optarg); break;
+    case 'r': rcpt = optarg; break;
+    case 'P': pipelined = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-n sessions] [-r recipient] [-P] [host] port\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || sessions < 1) {
+    fprintf(stderr, "Usage: %s [-n sessions] [-r recipient] [-P] [host] port\n", argv[0]);
+    return 1;
+  }
+  const char *host = argc - optind > 1 ? argv[optind] : "127.0.0.1";
+  const char *port = argv[argc - 1];
+
+  snprintf(rcpt_line, sizeof(rcpt_line), "RCPT TO:<%s>\r\n", rcpt);
+  snprintf(group, sizeof(group), "MAIL FROM:<bench@localhost>\r\n%sDATA\r\n", rcpt_line);
+
+  commands[ncommands++] = (struct command) { "connect", NULL, 1 };
+  commands[ncommands++] = (struct command) { "EHLO", "EHLO bench\r\n", 1 };
+  if (pipelined) {
+    commands[ncommands++] = (struct command) { "MAIL+RCPT+DATA", group, 3 };
+  } else {
+    commands[ncommands++] = (struct command) { "MAIL", "MAIL FROM:<bench@localhost>\r\n", 1 };
+    commands[ncommands++] = (struct command) { "RCPT", rcpt_line, 1 };
+    commands[ncommands++] = (struct command) { "DATA", "DATA\r\n", 1 };
+  }
+  commands[ncommands++] = (struct command) { "message",
+    "Subject: latency\r\n\r\nlatency test\r\n.\r\n", 1 };
+  commands[ncommands++] = (struct command) { "QUIT", "QUIT\r\n", 1 };
+  for (i = 0; i < ncommands; i++)
+    commands[i].samples = malloc(sessions * sizeof(double));
+
+  for (s = 0; s < sessions; s++) {
+    double start = now_us();
+    int fd = connect_to(host, port);
+    if (fd < 0) {
+      perror("connect");
+      return 1;
+    }
+    for (i = 0; i < ncommands; i++) {
+      if (i > 0) {
+	start = now_us();
+	if (send(fd, commands[i].text, strlen(commands[i].text), MSG_NOSIGNAL) < 0)
+	  break;
+      }
+      if (read_replies(fd, commands[i].replies) < 0)
+	break;
+      commands[i].samples[commands[i].count++] = now_us() - start;
+    }
+    if (i < ncommands)
+      errors++;
+    close(fd);
+  }
+
+  printf("%-16s %8s %10s %10s %10s %10s\n", "command (us)", "count", "p50", "p99", "p999", "max");
+  for (i = 0; i < ncommands; i++) {
+    struct command *c = &commands[i];
+    if (!c->count)
+      continue;
+    qsort(c->samples, c->count, sizeof(double), compare_doubles);
+    printf("%-16s %8d %10.1f %10.1f %10.1f %10.1f\n", c->name, c->count,
+	   percentile(c->samples, c->count, 0.50), percentile(c->samples, c->count, 0.99),
+	   percentile(c->samples, c->count, 0.999), c->samples[c->count - 1]);
+  }
+  printf("%d sessions, %d failed\n", sessions, errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,596 @@
+/* microbench.c
+ * Measures the cost of individual functions of the server in
+ * isolation: reading lines from a socket (nb_read_line), formatting
+ * replies (send_string), and the storage calls (is_valid_user,
+ * load_user_mail and save_user_mail) at several sizes.
+ *
+ * Usage: microbench [-t seconds] [-f filter] [-m max size]
+ *                   [-o results file] [-l label]
+ *
+ * Notes: Each case is run with a growing number of iterations until
+ * it takes at least the given time (default 0.5s), and reported as
+ * the time per iteration. Sockets are simulated with socketpairs,
+ * with a thread on the other end producing input or discarding
+ * output; the CPU time reported is that of the benchmark thread only.
+ * Storage calls run in a scratch directory (in $TMPDIR or /tmp),
+ * which is removed at the end. Cases whose name does not contain the
+ * filter, or with more users or messages than the max size, are
+ * skipped. With -o, results are also written as JSON, tagged with a
+ * label such as a commit.
+ */
+
+#define _GNU_SOURCE // for mkdtemp and nftw
+
+#include "../netbuffer.h"
+#include "../mailuser.h"
+#include "../server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define MAX_LINE_LENGTH 1024    // same as the servers
+#define LINE_PATTERN_SIZE 65536 // input repeated by the writer thread
+#define MAX_ITERATIONS 1000000000L
+#define SAVE_BATCH 64           // messages saved before mailboxes are emptied
+#define MESSAGE_LINKS 10000     // hard links to each file, in mailboxes loaded
+
+// State of a case while it runs; the timer is started before the run
+// function is called, and may be paused around work not measured
+struct state {
+  long iterations;
+  long arg;
+  unsigned long long bytes;   // processed, for throughput
+  unsigned long long items;   // e.g., messages, if more than one per iteration
+  const char *error;
+  double elapsed, cpu;        // seconds measured so far
+  struct timespec start, cpu_start;
+};
+
+struct benchmark {
+  const char *name;
+  int (*setup)(long arg);     // optional, not measured; non-zero on error
+  void (*run)(struct state *st);
+  void (*teardown)(long arg); // optional
+  long arg;
+  long size;                  // users or messages, compared with -m
+};
+
+// Results are added here, so the work cannot be optimized away
+static volatile unsigned long sink;
+
+static double elapsed_since(struct timespec *start, clockid_t clock) {
+
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void resume_timing(struct state *st) {
+
+  clock_gettime(CLOCK_MONOTONIC, &st->start);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &st->cpu_start);
+}
+
+static void pause_timing(struct state *st) {
+
+  st->cpu += elapsed_since(&st->cpu_start, CLOCK_THREAD_CPUTIME_ID);
+  st->elapsed += elapsed_since(&st->start, CLOCK_MONOTONIC);
+}
+
+/** Internal function that writes an entire buffer to a file, or to
+ *  a socket until the other end is closed.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int write_all(int fd, const char *buf, size_t size) {
+
+  while (size > 0) {
+    ssize_t rv = send(fd, buf, size, MSG_NOSIGNAL);
+    if (rv < 0 && errno == ENOTSOCK)
+      rv = write(fd, buf, size);
+    if (rv <= 0)
+      return -1;
+    buf += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/* nb_read_line */
+
+// Line lengths (including CRLF) of the input, chosen uniformly
+struct line_mix {
+  int min, max;
+};
+
+static const struct line_mix line_mixes[] = {
+  { 6, 40 },                          // commands
+  { 60, 78 },                         // message body
+  { 900, MAX_LINE_LENGTH },           // long lines, up to the limit
+  { 2, MAX_LINE_LENGTH },             // all of the above
+  { MAX_LINE_LENGTH + 1, 4 * MAX_LINE_LENGTH }, // split by nb_read_line
+};
+
+struct writer {
+  int fd;
+  const char *buf;
+  size_t size;
+};
+
+static void *write_forever(void *arg) {
+
+  struct writer *w = arg;
+  while (write_all(w->fd, w->buf, w->size) == 0);
+  return NULL;
+}
+
+static void bench_read_line(struct state *st) {
+
+  const struct line_mix *mix = &line_mixes[st->arg];
+  static char pattern[LINE_PATTERN_SIZE + 4 * MAX_LINE_LENGTH];
+  char out[MAX_LINE_LENGTH + 1];
+  unsigned int seed = 1;
+  size_t size = 0;
+  int fds[2];
+  long n;
+
+  pause_timing(st);
+  // The pattern has whole lines, so it can be repeated
+  while (size < LINE_PATTERN_SIZE) {
+    int len = mix->min + rand_r(&seed) % (mix->max - mix->min + 1);
+    memset(pattern + size, 'a' + len % 26, len - 2);
+    memcpy(pattern + size + len - 2, "\r\n", 2);
+    size += len;
+  }
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    st->error = strerror(errno);
+    return;
+  }
+  struct writer w = { fds[1], pattern, size };
+  pthread_t thread;
+  pthread_create(&thread, NULL, write_forever, &w);
+  net_buffer_t nb = nb_create(fds[0], MAX_LINE_LENGTH);
+  resume_timing(st);
+
+  for (n = 0; n < st->iterations; n++) {
+    int rv = nb_read_line(nb, out);
+    if (rv <= 0) {
+      st->error = "connection closed";
+      break;
+    }
+    st->bytes += rv;
+  }
+
+  pause_timing(st);
+  // The writer stops once its end is closed
+  nb_destroy(nb);
+  close(fds[0]);
+  pthread_join(thread, NULL);
+  close(fds[1]);
+  resume_timing(st);
+}
+
+/* send_string */
+
+static void *discard_input(void *arg) {
+
+  char buf[65536];
+  while (recv(*(int *) arg, buf, sizeof(buf), 0) > 0);
+  return NULL;
+}
+
+static void bench_send_string(struct state *st) {
+
+  static char text[2 * MAX_LINE_LENGTH];
+  int fds[2], rv = 0;
+  long n;
+
+  pause_timing(st);
+  memset(text, 'x', sizeof(text) - 1);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    st->error = strerror(errno);
+    return;
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, discard_input, &fds[1]);
+  resume_timing(st);
+
+  for (n = 0; n < st->iterations; n++) {
+    switch (st->arg) {
+    case 0: rv = send_string(fds[0], "250 OK\r\n"); break;
+    case 1: rv = send_string(fds[0], "+OK %u %zu\r\n", (unsigned) n, (size_t) n * 1021); break;
+    case 2: rv = send_string(fds[0], "250-%s Hello %s\r\n", "mail.example.com", "client.example.org"); break;
+    // Longer than the buffer on the stack
+    default: rv = send_string(fds[0], "500 %s\r\n", text); break;
+    }
+    if (rv <= 0) {
+      st->error = "send failed";
+      break;
+    }
+    st->bytes += rv;
+  }
+
+  pause_timing(st);
+  shutdown(fds[0], SHUT_WR);
+  pthread_join(thread, NULL);
+  close(fds[0]);
+  close(fds[1]);
+  resume_timing(st);
+}
+
+/* Storage */
+
+static const char message[] =
+  "From: bench@example.com\r\n"
+  "To: rcpt@example.com\r\n"
+  "Subject: Micro benchmark\r\n"
+  "\r\n"
+  "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod\r\n"
+  "tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim\r\n"
+  "veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea\r\n"
+  "commodo consequat.\r\n";
+
+static int write_file(const char *name, const char *contents) {
+
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+  int rv = write_all(fd, contents, strlen(contents));
+  close(fd);
+  return rv;
+}
+
+/** Internal function that removes all files in a directory, and
+ *  optionally the directory itself.
+ */
+static void empty_directory(const char *path, int remove) {
+
+  char name[PATH_MAX];
+  struct dirent *entry;
+  DIR *dir = opendir(path);
+  if (!dir)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+    if (entry->d_name[0] != '.') {
+      snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+      unlink(name);
+    }
+  closedir(dir);
+  if (remove)
+    rmdir(path);
+}
+
+// Users are user<N>, with password pw<N>
+static int setup_users(long users) {
+
+  FILE *file = fopen("users.tmp", "w");
+  long i;
+  if (!file)
+    return -1;
+  for (i = 0; i < users; i++)
+    fprintf(file, "user%ld pw%ld\n", i, i);
+  if (fclose(file) < 0)
+    return -1;
+  // A new file (inode) is noticed by the filter even within a second
+  if (rename("users.tmp", "users.txt") < 0)
+    return -1;
+  return refresh_user_filter() == users ? 0 : -1;
+}
+
+static void bench_valid_user(struct state *st) {
+
+  char user[32], password[32];
+  unsigned int seed = 1;
+  long n, users = st->arg;
+
+  for (n = 0; n < st->iterations; n++) {
+    long i = rand_r(&seed) % users;
+    snprintf(user, sizeof(user), "user%ld", i);
+    snprintf(password, sizeof(password), "pw%ld", i);
+    if (!is_valid_user(user, password)) {
+      st->error = "user not found";
+      break;
+    }
+  }
+}
+
+static void bench_invalid_user(struct state *st) {
+
+  char user[32];
+  long n;
+
+  for (n = 0; n < st->iterations; n++) {
+    snprintf(user, sizeof(user), "nobody%ld", n);
+    sink += is_valid_user(user, "pw");
+  }
+}
+
+// Mailboxes are load<N>, with N copies (hard links) of the message;
+// the number of links to a file is limited, so it is written again
+// every MESSAGE_LINKS messages
+static int setup_mailbox(long messages) {
+
+  char name[NAME_MAX + 1];
+  long i;
+
+  mkdir("mail.store", 0777);
+  snprintf(name, sizeof(name), "mail.store/load%ld", messages);
+  if (mkdir(name, 0777) < 0)
+    return -1;
+  for (i = 0; i < messages; i++) {
+    // Truncating the file would also truncate its links
+    if (i % MESSAGE_LINKS == 0) {
+      unlink("message");
+      if (write_file("message", message) < 0)
+	return -1;
+    }
+    snprintf(name, sizeof(name), "mail.store/load%ld/%ld.mail", messages, i);
+    if (link("message", name) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static void teardown_mailbox(long messages) {
+
+  char name[NAME_MAX + 1];
+  snprintf(name, sizeof(name), "mail.store/load%ld", messages);
+  empty_directory(name, 1);
+}
+
+static void bench_load_mail(struct state *st) {
+
+  char user[32];
+  long n;
+
+  snprintf(user, sizeof(user), "load%ld", st->arg);
+  for (n = 0; n < st->iterations; n++) {
+    mail_list_t list = load_user_mail(user);
+    if (get_mail_count(list) != (unsigned int) st->arg) {
+      st->error = "messages missing";
+      destroy_mail_list(list);
+      break;
+    }
+    st->items += st->arg;
+    st->bytes += get_mail_list_size(list);
+    destroy_mail_list(list);
+  }
+}
+
+static void empty_mailboxes(long recipients) {
+
+  char name[NAME_MAX + 1];
+  long i;
+  for (i = 0; i < recipients; i++) {
+    snprintf(name, sizeof(name), "mail.store/rcpt%ld", i);
+    empty_directory(name, 0);
+  }
+}
+
+static void teardown_recipients(long recipients) {
+
+  char name[NAME_MAX + 1];
+  long i;
+  for (i = 0; i < recipients; i++) {
+    snprintf(name, sizeof(name), "mail.store/rcpt%ld", i);
+    empty_directory(name, 1);
+  }
+  unlink("incoming");
+  unlink("incoming.idx");
+}
+
+static void bench_save_mail(struct state *st) {
+
+  user_list_t users = create_user_list();
+  struct mail_index index;
+  char name[32];
+  long i, n;
+
+  pause_timing(st);
+  for (i = 0; i < st->arg; i++) {
+    snprintf(name, sizeof(name), "rcpt%ld", i);
+    add_user_to_list(&users, name);
+  }
+  mail_index_init(&index);
+  mail_index_append(&index, message, strlen(message));
+  mail_index_finish(&index);
+  if (write_file("incoming", message) < 0)
+    st->error = strerror(errno);
+  resume_timing(st);
+
+  for (n = 0; n < st->iterations && !st->error; n++) {
+    // New files are named after the first free number, so mailboxes
+    // are kept small to measure the same work in every iteration
+    if (n && n % SAVE_BATCH == 0) {
+      pause_timing(st);
+      empty_mailboxes(st->arg);
+      resume_timing(st);
+    }
+    save_user_mail("incoming", users, &index);
+    st->items += st->arg;
+    st->bytes += st->arg * strlen(message);
+  }
+
+  pause_timing(st);
+  empty_mailboxes(st->arg);
+  destroy_user_list(users);
+  resume_timing(st);
+}
+
+static const struct benchmark benchmarks[] = {
+  { "nb_read_line/commands", NULL, bench_read_line, NULL, 0, 0 },
+  { "nb_read_line/body", NULL, bench_read_line, NULL, 1, 0 },
+  { "nb_read_line/long", NULL, bench_read_line, NULL, 2, 0 },
+  { "nb_read_line/mixed", NULL, bench_read_line, NULL, 3, 0 },
+  { "nb_read_line/oversized", NULL, bench_read_line, NULL, 4, 0 },
+  { "send_string/literal", NULL, bench_send_string, NULL, 0, 0 },
+  { "send_string/numbers", NULL, bench_send_string, NULL, 1, 0 },
+  { "send_string/strings", NULL, bench_send_string, NULL, 2, 0 },
+  { "send_string/long", NULL, bench_send_string, NULL, 3, 0 },
+  { "is_valid_user/hit/1k", setup_users, bench_valid_user, NULL, 1000, 1000 },
+  { "is_valid_user/miss/1k", setup_users, bench_invalid_user, NULL, 1000, 1000 },
+  { "is_valid_user/hit/100k", setup_users, bench_valid_user, NULL, 100000, 100000 },
+  { "is_valid_user/miss/100k", setup_users, bench_invalid_user, NULL, 100000, 100000 },
+  { "is_valid_user/hit/1M", setup_users, bench_valid_user, NULL, 1000000, 1000000 },
+  { "is_valid_user/miss/1M", setup_users, bench_invalid_user, NULL, 1000000, 1000000 },
+  { "load_user_mail/10", setup_mailbox, bench_load_mail, teardown_mailbox, 10, 10 },
+  { "load_user_mail/10k", setup_mailbox, bench_load_mail, teardown_mailbox, 10000, 10000 },
+  { "load_user_mail/100k", setup_mailbox, bench_load_mail, teardown_mailbox, 100000, 100000 },
+  { "save_user_mail/1", NULL, bench_save_mail, teardown_recipients, 1, 0 },
+  { "save_user_mail/10", NULL, bench_save_mail, teardown_recipients, 10, 0 },
+  { "save_user_mail/100", NULL, bench_save_mail, teardown_recipients, 100, 0 },
+};
+
+#define BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/** Internal function that runs a case with a growing number of
+ *  iterations, until it takes at least min_time seconds.
+ *
+ *  Returns: 0 on success, -1 if the case reported an error.
+ */
+static int run_benchmark(const struct benchmark *b, double min_time, struct state *st) {
+
+  long iterations = 1;
+
+  for (;;) {
+    memset(st, 0, sizeof(*st));
+    st->iterations = iterations;
+    st->arg = b->arg;
+    resume_timing(st);
+    b->run(st);
+    pause_timing(st);
+    if (st->error)
+      return -1;
+    if (st->elapsed >= min_time || iterations >= MAX_ITERATIONS)
+      return 0;
+    // Aims a bit past min_time, so one more run is usually enough
+    double multiplier = st->elapsed > 0 ? min_time * 1.4 / st->elapsed : 10;
+    if (multiplier > 10)
+      multiplier = 10;
+    iterations = iterations * multiplier + 1;
+  }
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-t seconds] [-f filter] [-m max size]\n"
+	  "\t[-o results file] [-l label]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *output = NULL, *label = "", *filter = "";
+  double min_time = 0.5;
+  long max_size = 0;
+  int opt, failures = 0, first = 1;
+  size_t i;
+
+  while ((opt = getopt(argc, argv, "t:f:m:o:l:")) != -1) {
+    switch (opt) {
+    case 't': min_time = atof(optarg); break;
+    case 'f': filter = optarg; break;
+    case 'm': max_size = atol(optarg); break;
+    case 'o': output = optarg; break;
+    case 'l': label = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc || min_time <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *out = NULL;
+  if (output) {
+    out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (!out) {
+      perror(output);
+      return 1;
+    }
+  }
+
+  // Storage calls use the current directory
+  const char *tmp = getenv("TMPDIR");
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/microbench.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir) || chdir(dir) < 0) {
+    perror(dir);
+    return 1;
+  }
+
+  if (out) {
+    fprintf(out, "{\"benchmark\": \"micro\", \"label\": \"");
+    for (; *label; label++)
+      fprintf(out, *label == '"' || *label == '\\' ? "\\%c" : "%c", *label);
+    fprintf(out, "\", \"time\": %ld,\n", (long) time(NULL));
+    fprintf(out, " \"config\": {\"min_time_s\": %.3f, \"max_size\": %ld, \"filter\": \"%s\"},\n"
+	    " \"results\": {", min_time, max_size, filter);
+  }
+
+  printf("%-26s %12s %12s %12s %10s %12s\n", "benchmark", "iterations", "ns/op",
+	 "cpu ns/op", "MB/s", "items/s");
+  for (i = 0; i < BENCHMARKS; i++) {
+    const struct benchmark *b = &benchmarks[i];
+    struct state st;
+
+    if (!strstr(b->name, filter) || (max_size && b->size > max_size))
+      continue;
+    fflush(stdout);
+    if (b->setup && b->setup(b->arg) < 0) {
+      printf("%-26s setup failed: %s\n", b->name, strerror(errno));
+      failures++;
+      continue;
+    }
+    int rv = run_benchmark(b, min_time, &st);
+    if (b->teardown)
+      b->teardown(b->arg);
+    if (rv < 0) {
+      printf("%-26s failed: %s\n", b->name, st.error);
+      failures++;
+      continue;
+    }
+
+    double ns = st.elapsed * 1e9 / st.iterations, cpu_ns = st.cpu * 1e9 / st.iterations;
+    double mbps = st.bytes / st.elapsed / 1e6, items = st.items / st.elapsed;
+    printf("%-26s %12ld %12.1f %12.1f", b->name, st.iterations, ns, cpu_ns);
+    if (st.bytes)
+      printf(" %10.2f", mbps);
+    else
+      printf(" %10s", "-");
+    if (st.items)
+      printf(" %12.0f\n", items);
+    else
+      printf(" %12s\n", "-");
+    if (out) {
+      fprintf(out, "%s\n  \"%s\": {\"iterations\": %ld, \"ns_per_op\": %.1f, "
+	      "\"cpu_ns_per_op\": %.1f, \"bytes_per_s\": %.0f, \"items_per_s\": %.0f}",
+	      first ? "" : ",", b->name, st.iterations, ns, cpu_ns, mbps * 1e6, items);
+      first = 0;
+    }
+  }
+
+  if (out) {
+    fprintf(out, "\n }\n}\n");
+    if (out != stdout)
+      fclose(out);
+  }
+  if (chdir("/") == 0)
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return failures ? 2 : 0;
+}
@@ -0,0 +1,81 @@
+/* pathbench.c
+ * Checks parse_mail_path against a corpus of valid and invalid
+ * paths, then measures the time taken to parse the corpus.
+ *
+ * Usage: pathbench [corpus file] [iterations]
+ */
+
+#include "../mailpath.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_ENTRIES 1024
+#define MAX_LINE_LENGTH 1024
+
+struct entry {
+  char line[MAX_LINE_LENGTH];
+  size_t len;
+  int valid;
+};
+
+static struct entry entries[MAX_ENTRIES];
+
+int main(int argc, char *argv[]) {
+
+  const char *corpus = argc > 1 ? argv[1] : "bench/paths.txt";
+  long iterations = argc > 2 ? atol(argv[2]) : 100000;
+  char buf[MAX_LINE_LENGTH];
+  int count = 0, failures = 0, i;
+  struct mail_path path;
+
+  FILE *file = fopen(corpus, "r");
+  if (!file) {
+    perror(corpus);
+    return 1;
+  }
+
+  while (count < MAX_ENTRIES && fgets(buf, sizeof(buf), file)) {
+    buf[strcspn(buf, "\n")] = '\0';
+    if (buf[0] == '#' || buf[0] == '\0')
+      continue;
+    char *input = strchr(buf, ' ');
+    if (input)
+      *input++ = '\0';
+    else
+      input = "";
+    entries[count].valid = !strcmp(buf, "valid");
+    // Commands are received with CRLF, so the corpus is parsed with it
+    entries[count].len = snprintf(entries[count].line, MAX_LINE_LENGTH, "%s\r\n", input);
+    count++;
+  }
+  fclose(file);
+
+  for (i = 0; i < count; i++) {
+    int rv = parse_mail_path(entries[i].line, entries[i].len, MAIL_PATH_NULL, &path);
+    if ((rv == MAIL_PATH_OK) != entries[i].valid) {
+      printf("FAIL: expected %s, got %d: %.*s\n", entries[i].valid ? "valid" : "invalid",
+	     rv, (int) entries[i].len - 2, entries[i].line);
+      failures++;
+    }
+  }
+  printf("%d paths checked, %d failures\n", count, failures);
+  if (failures || !count)
+    return 1;
+
+  struct timespec start, end;
+  long n;
+  int sink = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (n = 0; n < iterations; n++)
+    for (i = 0; i < count; i++)
+      sink += parse_mail_path(entries[i].line, entries[i].len, MAIL_PATH_NULL, &path);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  printf("%ld parses in %.3f ms: %.1f ns/parse (checksum %d)\n",
+	 iterations * count, ns / 1e6, ns / (iterations * count), sink);
+  return 0;
+}
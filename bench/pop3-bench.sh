@@ -0,0 +1,48 @@
+#!/bin/bash
+# pop3-bench.sh
+# Fills synthetic mailboxes in a scratch directory, starts mypopd on
+# loopback there, runs pop3bench against it, and keeps the results as
+# JSON in bench/results, named after the current commit and the size
+# of the mailboxes, so runs can be compared.
+#
+# Usage: bench/pop3-bench.sh [pop3bench options]  (or make pop3-bench,
+#        with the options in POP3_BENCH_ARGS)
+#
+# Environment: MAILBOXES: mailboxes filled (default 16).
+#              MESSAGES: messages in each mailbox (default 100).
+#              SIZE: distribution of message sizes, as in pop3bench -s
+#                    (default exp4096).
+#              PORT: port of the server (default 2110).
+#              SERVER_OPTIONS: options of mypopd (e.g., "-e 0" for the
+#                              reactor; default: a process per client).
+
+set -e
+cd "$(dirname "$0")/.."
+top=$(pwd)
+port=${PORT:-2110}
+mailboxes=${MAILBOXES:-16}
+messages=${MESSAGES:-100}
+size=${SIZE:-exp4096}
+args=${*:--c 16 -d 10}
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+git diff --quiet HEAD 2>/dev/null || commit="$commit-dirty"
+mkdir -p bench/results
+results="bench/results/pop3-$commit-$mailboxes-$messages-$size.json"
+
+dir=$(mktemp -d)
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null || true; rm -rf "$dir"' EXIT
+for i in $(seq "$mailboxes"); do
+  echo "bench$i password$i"
+done > "$dir/users.txt"
+(cd "$dir" && "$top/bench/pop3bench" -p -u "$mailboxes" -m "$messages" -s "$size")
+
+(cd "$dir" && exec "$top/mypopd" $SERVER_OPTIONS "$port" > server.log 2>&1) &
+server=$!
+for i in $(seq 50); do
+  grep -q "waiting for connections" "$dir/server.log" 2>/dev/null && break
+  kill -0 $server 2>/dev/null || { cat "$dir/server.log"; exit 1; }
+  sleep 0.1
+done
+
+bench/pop3bench -u "$mailboxes" -l "$commit" -o "$results" $args 127.0.0.1 "$port"
+echo "results written to $results"
@@ -0,0 +1,480 @@
+/* pop3bench.c
+ * Load generator for a POP3 server: fills synthetic mailboxes, then
+ * keeps a number of concurrent clients reading them for a while, and
+ * reports the throughput and the latency of each command.
+ *
+ * Usage: pop3bench -p [-u mailboxes] [-m messages] [-s size]
+ *        pop3bench [-c connections] [-d seconds] [-u mailboxes] [-D]
+ *                  [-o results file] [-l label] [host] port
+ *
+ * With -p, mailboxes bench1 to benchN (see -u) are filled with a
+ * number of messages each, in mail.store under the current directory,
+ * through save_user_mail. Message sizes (in bytes, headers included)
+ * follow a distribution: N for a fixed size, MIN-MAX for a uniform
+ * distribution, or expN for an exponential distribution with mean N.
+ * The users file must have user benchK with password passwordK.
+ *
+ * Otherwise, each connection runs in its own thread, and runs
+ * sessions on mailbox benchK (connections are spread over the
+ * mailboxes) until the time is up: USER, PASS, STAT, LIST, RETR of
+ * every message, and QUIT. With -D, every message is also deleted
+ * after it is retrieved, so the mailboxes are drained; clients stop
+ * when their mailbox is empty. Mailboxes should not be shared by
+ * connections with -D, since messages could be deleted twice.
+ *
+ * Results are printed as a table; with -o, they are also written as
+ * JSON (to the standard output with "-"), tagged with the label given
+ * with -l (e.g., a commit). Mailboxes are filled and sessions are run
+ * against a server on loopback by bench/pop3-bench.sh (make
+ * pop3-bench), to compare the cost of load_user_mail, LIST and RETR
+ * for mailboxes of different sizes.
+ */
+
+#include "../mailuser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_MESSAGE_SIZE 10485760
+#define LINE_LENGTH 78 // bytes of each line of the body, CRLF included
+#define BUFFER_SIZE 65536
+
+// Commands of a session
+enum { PHASE_CONNECT, PHASE_USER, PHASE_PASS, PHASE_STAT, PHASE_LIST,
+       PHASE_RETR, PHASE_DELE, PHASE_QUIT, PHASES };
+static const char *phase_names[PHASES] = {
+  "connect", "user", "pass", "stat", "list", "retr", "dele", "quit"
+};
+
+struct samples {
+  double *values;       // latencies in microseconds
+  size_t count, size;
+  unsigned long errors; // negative replies or lost connections
+};
+
+struct worker {
+  pthread_t thread;
+  int mailbox;
+  struct samples phases[PHASES];
+  unsigned long sessions, logins, messages, mailbox_messages;
+  unsigned long long bytes;
+};
+
+// Connection to the server, with its buffered input
+struct connection {
+  int fd;
+  size_t start, end;
+  char buf[BUFFER_SIZE];
+};
+
+static const char *host = "127.0.0.1", *port;
+static int connections = 10, seconds = 10, mailboxes = 10, drain = 0;
+static double deadline;
+
+static double now_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add_sample(struct samples *s, double value) {
+
+  if (s->count == s->size) {
+    s->size = s->size ? s->size * 2 : 1024;
+    s->values = realloc(s->values, s->size * sizeof(double));
+  }
+  s->values[s->count++] = value;
+}
+
+/** Fills the mailboxes, with messages of sizes drawn from a
+ *  distribution (see the usage).
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int populate(int messages, const char *spec) {
+
+  double a, b = 0, size;
+  char *end, user[32], *text;
+  int kind = 0, i, m;
+  unsigned int seed = 1;
+  size_t j;
+
+  if (!strncmp(spec, "exp", 3)) {
+    kind = 2;
+    a = strtod(spec + 3, &end);
+  } else {
+    a = strtod(spec, &end);
+    if (*end == '-') {
+      kind = 1;
+      b = strtod(end + 1, &end);
+    }
+  }
+  if (*end || a < 1 || (kind == 1 && b < a))
+    return -1;
+
+  // Messages are a header and body lines, cut to the size
+  text = malloc(MAX_MESSAGE_SIZE);
+  j = snprintf(text, MAX_MESSAGE_SIZE, "Subject: pop3bench\r\n\r\n");
+  for (; j < MAX_MESSAGE_SIZE; j++)
+    text[j] = j % LINE_LENGTH == LINE_LENGTH - 2 ? '\r' :
+      j % LINE_LENGTH == LINE_LENGTH - 1 ? '\n' : 'a' + j % LINE_LENGTH % 26;
+
+  for (i = 1; i <= mailboxes; i++) {
+    snprintf(user, sizeof(user), "bench%d", i);
+    for (m = 0; m < messages; m++) {
+      double u = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+      size = kind == 1 ? a + u * (b - a + 1) : kind == 2 ? -a * log(u) : a;
+      size_t len = size < 1 ? 1 : size > MAX_MESSAGE_SIZE ? MAX_MESSAGE_SIZE : (size_t) size;
+
+      char file[] = "pop3bench-XXXXXX";
+      int fd = mkstemp(file);
+      if (fd < 0 || write(fd, text, len) != (ssize_t) len) {
+	perror("write");
+	return -1;
+      }
+      close(fd);
+      struct mail_index index;
+      mail_index_init(&index);
+      mail_index_append(&index, text, len);
+      mail_index_finish(&index);
+      user_list_t users = create_user_list();
+      add_user_to_list(&users, user);
+      save_user_mail(file, users, &index);
+      destroy_user_list(users);
+      unlink(file);
+    }
+  }
+  free(text);
+  return 0;
+}
+
+static int connect_to(struct connection *c) {
+
+  struct addrinfo hints, *res, *p;
+  int one = 1;
+
+  c->fd = -1;
+  c->start = c->end = 0;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0)
+    return -1;
+  for (p = res; p; p = p->ai_next) {
+    c->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (c->fd < 0)
+      continue;
+    if (connect(c->fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(c->fd);
+    c->fd = -1;
+  }
+  freeaddrinfo(res);
+  if (c->fd >= 0)
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return c->fd;
+}
+
+/** Reads a line sent by the server, into line (cut if longer than
+ *  size, and NUL-terminated).
+ *
+ *  Returns: the length of the line, CRLF included, or -1 if the
+ *           connection was lost.
+ */
+static ssize_t read_line(struct connection *c, char *line, size_t size) {
+
+  size_t len = 0;
+  while (1) {
+    if (c->start == c->end) {
+      ssize_t rv = recv(c->fd, c->buf, sizeof(c->buf), 0);
+      if (rv <= 0)
+	return -1;
+      c->start = 0;
+      c->end = rv;
+    }
+    char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+    size_t n = eol ? (size_t) (eol - c->buf) + 1 - c->start : c->end - c->start;
+    if (len + 1 < size)
+      memcpy(line + len, c->buf + c->start, n < size - len - 1 ? n : size - len - 1);
+    len += n;
+    c->start += n;
+    if (eol)
+      break;
+  }
+  line[len < size ? len : size - 1] = '\0';
+  return len;
+}
+
+/** Sends a command and reads its reply, and the lines following it up
+ *  to the terminating "." if multiline is set and the reply is
+ *  positive. The time taken is added to a phase.
+ *
+ *  Returns: the bytes of the lines following the reply if it was
+ *           positive, -2 if it was negative, or -1 if the connection
+ *           was lost. The first line of the reply is left in reply.
+ */
+static long command(struct worker *w, int phase, struct connection *c, const char *text,
+		    int multiline, char *reply, size_t size) {
+
+  double start = now_us();
+  long bytes = 0;
+  ssize_t len = strlen(text);
+  char line[1024];
+
+  if (len && send(c->fd, text, len, MSG_NOSIGNAL) != len)
+    len = -1;
+  else
+    len = read_line(c, reply, size);
+  if (len >= 0 && strncmp(reply, "+OK", 3)) {
+    w->phases[phase].errors++;
+    return -2;
+  }
+  while (len >= 0 && multiline) {
+    len = read_line(c, line, sizeof(line));
+    if (len == 3 && !strcmp(line, ".\r\n"))
+      break;
+    bytes += len;
+  }
+  if (len < 0) {
+    w->phases[phase].errors++;
+    return -1;
+  }
+  add_sample(&w->phases[phase], now_us() - start);
+  return bytes;
+}
+
+/** Main function of each worker: runs sessions until the deadline, or
+ *  until the mailbox is drained.
+ */
+static void *worker_main(void *arg) {
+
+  struct worker *w = arg;
+  struct connection *c = malloc(sizeof(struct connection));
+  char text[64], reply[256];
+  int empty = 0;
+
+  while (now_us() < deadline && !empty) {
+    int count = 0, i;
+    long rv;
+    if (connect_to(c) < 0 || command(w, PHASE_CONNECT, c, "", 0, reply, sizeof(reply)) < 0) {
+      if (c->fd >= 0)
+	close(c->fd);
+      else
+	w->phases[PHASE_CONNECT].errors++;
+      usleep(10000);
+      continue;
+    }
+    w->sessions++;
+
+    snprintf(text, sizeof(text), "USER bench%d\r\n", w->mailbox);
+    rv = command(w, PHASE_USER, c, text, 0, reply, sizeof(reply));
+    if (rv >= 0) {
+      snprintf(text, sizeof(text), "PASS password%d\r\n", w->mailbox);
+      rv = command(w, PHASE_PASS, c, text, 0, reply, sizeof(reply));
+    }
+    if (rv >= 0) {
+      w->logins++;
+      rv = command(w, PHASE_STAT, c, "STAT\r\n", 0, reply, sizeof(reply));
+    }
+    if (rv >= 0) {
+      count = atoi(reply + 3);
+      w->mailbox_messages += count;
+      empty = drain && !count;
+      // an empty mailbox is listed in a single line
+      rv = command(w, PHASE_LIST, c, "LIST\r\n", count > 0, reply, sizeof(reply));
+    }
+    for (i = 1; i <= count && rv >= 0 && now_us() < deadline; i++) {
+      snprintf(text, sizeof(text), "RETR %d\r\n", i);
+      rv = command(w, PHASE_RETR, c, text, 1, reply, sizeof(reply));
+      if (rv >= 0) {
+	w->messages++;
+	w->bytes += rv;
+      }
+      if (rv >= 0 && drain) {
+	snprintf(text, sizeof(text), "DELE %d\r\n", i);
+	rv = command(w, PHASE_DELE, c, text, 0, reply, sizeof(reply));
+      }
+    }
+    // deleted messages are only removed when the session is closed
+    if (rv != -1)
+      command(w, PHASE_QUIT, c, "QUIT\r\n", 0, reply, sizeof(reply));
+    close(c->fd);
+  }
+  free(c);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/** Returns a percentile of sorted samples, by the nearest-rank method.
+ */
+static double percentile(const struct samples *s, double p) {
+
+  size_t rank = (size_t) (p * s->count + 0.999999);
+  if (rank < 1)
+    rank = 1;
+  return s->values[rank - 1];
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s -p [-u mailboxes] [-m messages] [-s size | min-max | expmean]\n"
+	  "       %s [-c connections] [-d seconds] [-u mailboxes] [-D]\n"
+	  "\t[-o results file] [-l label] [host] port\n", name, name);
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *output = NULL, *label = "", *size_spec = "4096";
+  int opt, i, p, fill = 0, messages = 100;
+  size_t j;
+
+  while ((opt = getopt(argc, argv, "pu:m:s:c:d:Do:l:")) != -1) {
+    switch (opt) {
+    case 'p': fill = 1; break;
+    case 'u': mailboxes = atoi(optarg); break;
+    case 'm': messages = atoi(optarg); break;
+    case 's': size_spec = optarg; break;
+    case 'c': connections = atoi(optarg); break;
+    case 'd': seconds = atoi(optarg); break;
+    case 'D': drain = 1; break;
+    case 'o': output = optarg; break;
+    case 'l': label = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (mailboxes < 1 || messages < 0 || connections < 1 || seconds < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (fill) {
+    if (populate(messages, size_spec) < 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    printf("%d mailboxes filled with %d messages each\n", mailboxes, messages);
+    return 0;
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (argc - optind > 1)
+    host = argv[optind];
+  port = argv[argc - 1];
+
+  struct worker *workers = calloc(connections, sizeof(struct worker));
+  double start = now_us();
+  deadline = start + seconds * 1e6;
+  for (i = 0; i < connections; i++) {
+    workers[i].mailbox = i % mailboxes + 1;
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  // Results of all workers are merged in the first one
+  struct worker *total = &workers[0];
+  pthread_join(total->thread, NULL);
+  for (i = 1; i < connections; i++) {
+    pthread_join(workers[i].thread, NULL);
+    for (p = 0; p < PHASES; p++) {
+      for (j = 0; j < workers[i].phases[p].count; j++)
+	add_sample(&total->phases[p], workers[i].phases[p].values[j]);
+      total->phases[p].errors += workers[i].phases[p].errors;
+    }
+    total->sessions += workers[i].sessions;
+    total->logins += workers[i].logins;
+    total->messages += workers[i].messages;
+    total->mailbox_messages += workers[i].mailbox_messages;
+    total->bytes += workers[i].bytes;
+  }
+  double elapsed = (now_us() - start) / 1e6;
+  double mailbox_mean = total->logins ? (double) total->mailbox_messages / total->logins : 0;
+  unsigned long errors = 0;
+  for (p = 0; p < PHASES; p++) {
+    qsort(total->phases[p].values, total->phases[p].count, sizeof(double), compare_doubles);
+    errors += total->phases[p].errors;
+  }
+
+  printf("%-12s %7s %7s %10s %10s %10s %10s %10s %10s\n", "command (us)", "count", "errors",
+	 "mean", "p50", "p90", "p99", "p999", "max");
+  for (p = 0; p < PHASES; p++) {
+    struct samples *s = &total->phases[p];
+    double sum = 0;
+    if (!s->count && !s->errors)
+      continue;
+    for (j = 0; j < s->count; j++)
+      sum += s->values[j];
+    if (!s->count) {
+      printf("%-12s %7zu %7lu\n", phase_names[p], s->count, s->errors);
+      continue;
+    }
+    printf("%-12s %7zu %7lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[p],
+	   s->count, s->errors, sum / s->count, percentile(s, 0.5), percentile(s, 0.9),
+	   percentile(s, 0.99), percentile(s, 0.999), s->values[s->count - 1]);
+  }
+  printf("%lu sessions, %lu logins (%.1f/s), %lu messages (%.1f/s), %.2f MB/s, "
+	 "%.1f messages per mailbox, %lu errors\n", total->sessions, total->logins,
+	 total->logins / elapsed, total->messages, total->messages / elapsed,
+	 total->bytes / elapsed / 1e6, mailbox_mean, errors);
+
+  if (output) {
+    FILE *out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (!out) {
+      perror(output);
+      return 1;
+    }
+    fprintf(out, "{\"benchmark\": \"pop3\", \"label\": \"");
+    for (; *label; label++)
+      fprintf(out, *label == '"' || *label == '\\' ? "\\%c" : "%c", *label);
+    fprintf(out, "\", \"time\": %ld,\n", (long) time(NULL));
+    fprintf(out, " \"config\": {\"host\": \"%s\", \"port\": \"%s\", \"connections\": %d, "
+	    "\"seconds\": %d, \"mailboxes\": %d, \"drain\": %s},\n",
+	    host, port, connections, seconds, mailboxes, drain ? "true" : "false");
+    fprintf(out, " \"elapsed_s\": %.3f, \"sessions\": %lu, \"logins\": %lu, "
+	    "\"messages\": %lu, \"bytes\": %llu, \"errors\": %lu, \"mailbox_messages_mean\": %.1f,\n"
+	    " \"logins_per_s\": %.1f, \"messages_per_s\": %.1f, \"bytes_per_s\": %.0f,\n"
+	    " \"phases\": {", elapsed, total->sessions, total->logins, total->messages,
+	    total->bytes, errors, mailbox_mean, total->logins / elapsed,
+	    total->messages / elapsed, total->bytes / elapsed);
+    for (p = 0, i = 0; p < PHASES; p++) {
+      struct samples *s = &total->phases[p];
+      double sum = 0;
+      if (!s->count && !s->errors)
+	continue;
+      for (j = 0; j < s->count; j++)
+	sum += s->values[j];
+      fprintf(out, "%s\n  \"%s\": {\"count\": %zu, \"errors\": %lu", i++ ? "," : "",
+	      phase_names[p], s->count, s->errors);
+      if (s->count)
+	fprintf(out, ", \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+		"\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f", sum / s->count,
+		percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99),
+		percentile(s, 0.999), s->values[s->count - 1]);
+      fprintf(out, "}");
+    }
+    fprintf(out, "\n }\n}\n");
+    if (out != stdout)
+      fclose(out);
+  }
+  return errors ? 2 : 0;
+}
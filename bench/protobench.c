@@ -0,0 +1,278 @@
+/* protobench.c
+ * Runs scripted SMTP or POP3 sessions through the protocol handlers in
+ * a single thread, over an in-memory transport instead of sockets, to
+ * measure (or profile) the CPU cost of the protocol code alone.
+ *
+ * Usage: protobench [-n sessions] [-i script] [-s segment] [-v]
+ *                   [-o results file] [-l label] smtp|pop3
+ *
+ * Each session sends the whole script at once, as a client pipelining
+ * every command, and ends when the script is consumed. With -s, each
+ * receive returns at most that many bytes, to mimic clients sending
+ * small segments. Scripts are text files, one command per line (sent
+ * with CRLF); by default, SMTP sessions run EHLO, MAIL, two RCPT (one
+ * unknown), NOOP, an unknown command and QUIT, and POP3 sessions log
+ * in and run STAT, LIST, RETR, TOP, DELE, RSET, NOOP and QUIT. DATA is
+ * left out of the default script, since every message would be
+ * stored.
+ *
+ * Notes: Sessions run in a scratch directory (in $TMPDIR or /tmp)
+ * with user "bench" (password "password"), whose mailbox has a few
+ * messages for POP3. The replies of the first session are printed
+ * with -v; every other session must send the same number of bytes,
+ * or it is counted as a mismatch. With -o, results are also written
+ * as JSON, tagged with a label such as a commit.
+ */
+
+#define _GNU_SOURCE // for mkdtemp and nftw
+
+#include "../transport.h"
+#include "../mailuser.h"
+#include "../smtp.h"
+#include "../pop3.h"
+#include "../log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#define MAX_SCRIPT_SIZE 1048576
+#define MAILBOX_MESSAGES 5
+
+static const char *smtp_script =
+  "EHLO client.example.org\n"
+  "MAIL FROM:<sender@example.org>\n"
+  "RCPT TO:<bench>\n"
+  "RCPT TO:<nobody>\n"
+  "NOOP\n"
+  "VRFY bench\n"
+  "QUIT\n";
+
+static const char *pop3_script =
+  "USER bench\n"
+  "PASS password\n"
+  "STAT\n"
+  "LIST\n"
+  "RETR 1\n"
+  "TOP 2 3\n"
+  "DELE 3\n"
+  "RSET\n"
+  "NOOP\n"
+  "QUIT\n";
+
+static const char message[] =
+  "From: sender@example.org\r\n"
+  "To: bench@example.com\r\n"
+  "Subject: Protocol benchmark\r\n"
+  "\r\n"
+  "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod\r\n"
+  "tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim\r\n"
+  "veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea\r\n"
+  "commodo consequat.\r\n";
+
+static double now_s(clockid_t clock) {
+
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Internal function that converts a script to the data sent by the
+ *  client: each line ends with CRLF.
+ *
+ *  Returns: size of the data, or -1 if the script is too long.
+ */
+static ssize_t build_input(const char *script, size_t size, char *input) {
+
+  size_t i, len = 0;
+  for (i = 0; i < size; i++) {
+    if (len + 2 > MAX_SCRIPT_SIZE)
+      return -1;
+    if (script[i] == '\n' && (i == 0 || script[i - 1] != '\r'))
+      input[len++] = '\r';
+    input[len++] = script[i];
+  }
+  return len;
+}
+
+/** Internal function that creates the users file and the mailbox of
+ *  the scratch directory.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int setup_storage(void) {
+
+  FILE *file = fopen("users.txt", "w");
+  if (!file)
+    return -1;
+  fprintf(file, "bench password\n");
+  if (fclose(file) < 0)
+    return -1;
+
+  int fd = open("message", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+  ssize_t rv = write(fd, message, sizeof(message) - 1);
+  close(fd);
+  if (rv != sizeof(message) - 1)
+    return -1;
+
+  user_list_t users = create_user_list();
+  struct mail_index index;
+  int i;
+  add_user_to_list(&users, "bench");
+  mail_index_init(&index);
+  mail_index_append(&index, message, sizeof(message) - 1);
+  mail_index_finish(&index);
+  for (i = 0; i < MAILBOX_MESSAGES; i++)
+    save_user_mail("message", users, &index);
+  destroy_user_list(users);
+  return refresh_user_filter() == 1 ? 0 : -1;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-n sessions] [-i script] [-s segment] [-v]\n"
+	  "\t[-o results file] [-l label] smtp|pop3\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *output = NULL, *label = "", *script_file = NULL;
+  long sessions = 100000, segment = 0, n, mismatches = 0;
+  int opt, verbose = 0;
+
+  while ((opt = getopt(argc, argv, "n:i:s:vo:l:")) != -1) {
+    switch (opt) {
+    case 'n': sessions = atol(optarg); break;
+    case 'i': script_file = optarg; break;
+    case 's': segment = atol(optarg); break;
+    case 'v': verbose = 1; break;
+    case 'o': output = optarg; break;
+    case 'l': label = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || sessions <= 0 || segment < 0 ||
+      (strcmp(argv[optind], "smtp") && strcmp(argv[optind], "pop3"))) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *protocol = argv[optind];
+
+  struct server_listener listener = { NULL, NULL, NULL, NULL };
+  if (!strcmp(protocol, "smtp"))
+    smtp_setup(&listener);
+  else
+    pop3_setup(&listener);
+
+  static char script[MAX_SCRIPT_SIZE], input[MAX_SCRIPT_SIZE];
+  size_t script_size;
+  if (script_file) {
+    FILE *file = fopen(script_file, "r");
+    if (!file) {
+      perror(script_file);
+      return 1;
+    }
+    script_size = fread(script, 1, sizeof(script), file);
+    fclose(file);
+  } else {
+    const char *builtin = !strcmp(protocol, "smtp") ? smtp_script : pop3_script;
+    script_size = strlen(builtin);
+    memcpy(script, builtin, script_size);
+  }
+  ssize_t input_size = build_input(script, script_size, input);
+  if (input_size < 0) {
+    fprintf(stderr, "%s: script too long\n", script_file);
+    return 1;
+  }
+
+  FILE *out = NULL;
+  if (output) {
+    out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (!out) {
+      perror(output);
+      return 1;
+    }
+  }
+
+  // Storage calls use the current directory
+  const char *tmp = getenv("TMPDIR");
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/protobench.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir) || chdir(dir) < 0) {
+    perror(dir);
+    return 1;
+  }
+  if (setup_storage() < 0) {
+    perror("setup");
+    return 1;
+  }
+  // Only errors are logged, so the log is not measured
+  log_level = LOG_LEVEL_ERROR;
+
+  memory_transport_t mt = memory_transport_create(verbose);
+  if (!mt) {
+    perror("memory transport");
+    return 1;
+  }
+  int fd = memory_transport_fd(mt);
+  size_t first_size = 0, output_size, total_output = 0;
+
+  double start = now_s(CLOCK_MONOTONIC), cpu_start = now_s(CLOCK_PROCESS_CPUTIME_ID);
+  for (n = 0; n < sessions; n++) {
+    memory_transport_set_input(mt, input, input_size, segment);
+    listener.handler(fd);
+    const char *replies = memory_transport_output(mt, &output_size);
+    if (n == 0) {
+      first_size = output_size;
+      if (verbose && replies)
+	fwrite(replies, 1, output_size, stdout);
+    } else if (output_size != first_size) {
+      mismatches++;
+    }
+    total_output += output_size;
+  }
+  double elapsed = now_s(CLOCK_MONOTONIC) - start;
+  double cpu = now_s(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+  memory_transport_destroy(mt);
+
+  printf("%ld %s sessions in %.3f s: %.0f sessions/s, %.1f us/session (cpu %.1f us)\n",
+	 sessions, protocol, elapsed, sessions / elapsed, elapsed * 1e6 / sessions,
+	 cpu * 1e6 / sessions);
+  printf("%zd bytes in, %.0f bytes out per session, %ld mismatches\n",
+	 input_size, (double) total_output / sessions, mismatches);
+
+  if (out) {
+    fprintf(out, "{\"benchmark\": \"proto\", \"label\": \"");
+    for (; *label; label++)
+      fprintf(out, *label == '"' || *label == '\\' ? "\\%c" : "%c", *label);
+    fprintf(out, "\", \"time\": %ld,\n", (long) time(NULL));
+    fprintf(out, " \"config\": {\"protocol\": \"%s\", \"sessions\": %ld, \"segment\": %ld, "
+	    "\"script\": \"%s\"},\n", protocol, sessions, segment,
+	    script_file ? script_file : "builtin");
+    fprintf(out, " \"elapsed_s\": %.3f, \"cpu_s\": %.3f, \"sessions_per_s\": %.1f, "
+	    "\"us_per_session\": %.2f, \"cpu_us_per_session\": %.2f,\n"
+	    " \"input_bytes\": %zd, \"output_bytes\": %.1f, \"mismatches\": %ld\n}\n",
+	    elapsed, cpu, sessions / elapsed, elapsed * 1e6 / sessions, cpu * 1e6 / sessions,
+	    input_size, (double) total_output / sessions, mismatches);
+    if (out != stdout)
+      fclose(out);
+  }
+
+  if (chdir("/") == 0)
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return mismatches ? 2 : 0;
+}
@@ -0,0 +1,713 @@
+/* replay.c
+ * Replays the sessions of a capture file (see capture.h) against a
+ * server, at the speed they were recorded or as fast as possible, and
+ * reports the throughput and the latency of the replies.
+ *
+ * Usage: replay [-x | -s speed] [-c copies] [-w workers] [-m port=port]...
+ *               [-T timeout] [-U users file] [-o results file] [-l label]
+ *               capture [host]
+ *
+ * Each session connects to the port it was captured on (or the port
+ * it is mapped to with -m), and sends the data of the client with the
+ * same segmentation. A client that got replies before sending a
+ * segment is assumed to have waited for them, so the segment is only
+ * sent once all commands sent so far are answered; this keeps the
+ * order of a session even if the server is slower or faster than the
+ * captured one. Replies are counted by following the protocol
+ * (detected from the greeting): multi-line SMTP replies, DATA and BDAT,
+ * and the POP3 commands answered with a multi-line reply.
+ *
+ * By default, sessions start at the times they were captured, and
+ * each segment is sent at its time within the session (-s 2 replays
+ * twice as fast). With -x, sessions run one after another on a number
+ * of workers (-w), with no delays. Each session is replayed -c times
+ * (at once, in real time). A wait for replies longer than the timeout
+ * (-T, 10 seconds by default) is an error.
+ *
+ * Names in a capture are pseudonyms, and passwords are masked (only
+ * their length is kept), so the server must be given the users of the
+ * capture: -U writes a users file with the USER and PASS pairs, as
+ * masked, and the recipients found (the latter with password
+ * "password"); the host may be omitted to only write the file.
+ * Results are printed, and written as JSON with -o, tagged with the
+ * label given with -l (e.g., a commit).
+ */
+
+#define _GNU_SOURCE // for strcasestr
+
+#include "../capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_PORT_MAPS 16
+#define MULTI_QUEUE_SIZE 1024 // POP3 commands waiting for a reply
+#define LINE_PREFIX 64        // bytes of each line kept for parsing
+
+struct event {
+  int type;             // CAPTURE_CLIENT or CAPTURE_SERVER
+  uint64_t time;        // microseconds since the start of the session
+  size_t len;
+  const char *data;     // client data, in the capture
+};
+
+struct session {
+  uint64_t id;
+  uint64_t start;       // microseconds since the epoch
+  unsigned int port;
+  int ended;
+  struct event *events;
+  int count, size;
+  size_t server_bytes;  // sent by the captured server
+};
+
+// A line being parsed, of which only a prefix is kept
+struct line {
+  char text[LINE_PREFIX + 1];
+  size_t len;
+};
+
+// Replies expected and received in a connection
+struct replies {
+  int pop3;             // protocol, known after the greeting
+  unsigned long expected, received;
+  struct line in, out;  // lines being received and sent
+  int in_multi;         // in a multi-line POP3 reply
+  int in_body;          // sending the contents of a message
+  size_t chunk_left;    // bytes of a BDAT chunk still to be sent
+  unsigned char multi[MULTI_QUEUE_SIZE]; // POP3 commands sent, in order,
+  unsigned long multi_head, multi_tail;  // 1 if the reply may be multi-line
+};
+
+struct samples {
+  double *values;
+  size_t count, size;
+};
+
+static struct session *sessions = NULL;
+static int session_count = 0;
+static struct { unsigned int from, to; } port_maps[MAX_PORT_MAPS];
+static int port_map_count = 0;
+static const char *host;
+static double speed = 1, timeout_ms = 10000;
+static int max_speed = 0, copies = 1, workers = 16;
+
+// Results, updated under the lock
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t results_cond = PTHREAD_COND_INITIALIZER;
+static struct samples session_ms, reply_us;
+static unsigned long runs_done = 0, errors = 0;
+static unsigned long long bytes_sent = 0, bytes_received = 0, recorded_received = 0;
+static int next_run = 0;
+
+static double now_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add_sample(struct samples *s, double value) {
+
+  if (s->count == s->size) {
+    s->size = s->size ? s->size * 2 : 1024;
+    s->values = realloc(s->values, s->size * sizeof(double));
+  }
+  s->values[s->count++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(struct samples *s, double p) {
+
+  if (!s->count)
+    return 0;
+  size_t i = p * s->count;
+  return s->values[i < s->count ? i : s->count - 1];
+}
+
+/* Capture file */
+
+/** Internal function that decodes a varint.
+ *
+ *  Returns: 0 on success, -1 if the data ends before the varint.
+ */
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+
+  int shift = 0;
+  *value = 0;
+  while (*p < end && shift < 64) {
+    unsigned char b = *(*p)++;
+    *value |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+    shift += 7;
+  }
+  return -1;
+}
+
+static struct session *find_session(uint64_t id) {
+
+  int i;
+  // Records are usually of one of the last sessions started
+  for (i = session_count - 1; i >= 0; i--)
+    if (sessions[i].id == id)
+      return &sessions[i];
+  return NULL;
+}
+
+static int compare_sessions(const void *a, const void *b) {
+
+  const struct session *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/** Internal function that reads a capture file, which is kept in
+ *  memory (client data points into it).
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int load_capture(const char *path) {
+
+  FILE *file = fopen(path, "r");
+  struct stat file_stat;
+  int size = 0;
+
+  if (!file || fstat(fileno(file), &file_stat) < 0) {
+    perror(path);
+    return -1;
+  }
+  unsigned char *buf = malloc(file_stat.st_size + 1);
+  if (!buf || fread(buf, 1, file_stat.st_size, file) != (size_t) file_stat.st_size) {
+    perror(path);
+    return -1;
+  }
+  fclose(file);
+
+  const unsigned char *p = buf + CAPTURE_MAGIC_SIZE, *end = buf + file_stat.st_size;
+  if (file_stat.st_size < CAPTURE_MAGIC_SIZE || memcmp(buf, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    return -1;
+  }
+
+  while (p < end) {
+    int type = *p++;
+    uint64_t id, time, value = 0;
+    if (get_varint(&p, end, &id) < 0 || get_varint(&p, end, &time) < 0 ||
+	(type != CAPTURE_END && get_varint(&p, end, &value) < 0))
+      break;
+    if (type == CAPTURE_CLIENT && value > (uint64_t) (end - p))
+      break;
+
+    struct session *s = type == CAPTURE_START ? NULL : find_session(id);
+    switch (type) {
+    case CAPTURE_START:
+      if (session_count == size) {
+	size = size ? size * 2 : 1024;
+	sessions = realloc(sessions, size * sizeof(struct session));
+      }
+      s = &sessions[session_count++];
+      memset(s, 0, sizeof(*s));
+      s->id = id;
+      s->start = time;
+      s->port = value;
+      break;
+    case CAPTURE_CLIENT:
+    case CAPTURE_SERVER:
+      if (!s)
+	break;
+      if (s->count == s->size) {
+	s->size = s->size ? s->size * 2 : 16;
+	s->events = realloc(s->events, s->size * sizeof(struct event));
+      }
+      s->events[s->count++] = (struct event) {
+	type, time, value, type == CAPTURE_CLIENT ? (const char *) p : NULL
+      };
+      if (type == CAPTURE_SERVER)
+	s->server_bytes += value;
+      break;
+    case CAPTURE_END:
+      if (s)
+	s->ended = 1;
+      break;
+    default:
+      fprintf(stderr, "%s: unknown record type %d\n", path, type);
+      return -1;
+    }
+    if (type == CAPTURE_CLIENT)
+      p += value;
+  }
+  if (p < end)
+    fprintf(stderr, "%s: capture truncated, %ld bytes ignored\n", path, (long) (end - p));
+  qsort(sessions, session_count, sizeof(struct session), compare_sessions);
+  return 0;
+}
+
+/** Internal function that writes a users file with the pseudonyms
+ *  found in the capture.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int write_users(const char *path) {
+
+  char **names = NULL, **passwords = NULL, user[LINE_PREFIX + 1] = "";
+  int count = 0, i, j, e;
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+
+  for (i = 0; i < session_count; i++) {
+    struct line line = { "", 0 };
+    for (e = 0; e < sessions[i].count; e++) {
+      const struct event *ev = &sessions[i].events[e];
+      size_t k;
+      for (k = 0; ev->type == CAPTURE_CLIENT && k < ev->len; k++) {
+	if (ev->data[k] != '\n') {
+	  if (line.len < LINE_PREFIX && ev->data[k] != '\r')
+	    line.text[line.len++] = ev->data[k];
+	  continue;
+	}
+	line.text[line.len] = '\0';
+	line.len = 0;
+
+	// Message contents have no letters left, so they never match
+	const char *name = NULL, *password = "password";
+	char *at;
+	if (!strncasecmp(line.text, "USER ", 5)) {
+	  strcpy(user, line.text + 5); // both hold up to LINE_PREFIX bytes
+	  continue;
+	} else if (!strncasecmp(line.text, "PASS ", 5) && user[0]) {
+	  name = user;
+	  password = line.text + 5;
+	} else if (!strncasecmp(line.text, "RCPT TO:<", 9)) {
+	  name = line.text + 9;
+	  if ((at = strpbrk(line.text + 9, "@>")) != NULL)
+	    *at = '\0';
+	}
+	if (!name || !*name)
+	  continue;
+	for (j = 0; j < count && strcmp(names[j], name); j++);
+	if (j == count) {
+	  names = realloc(names, (count + 1) * sizeof(char *));
+	  passwords = realloc(passwords, (count + 1) * sizeof(char *));
+	  names[count] = strdup(name);
+	  passwords[count++] = strdup(password);
+	} else if (name == user) {
+	  // A password given in a session wins over the default
+	  free(passwords[j]);
+	  passwords[j] = strdup(password);
+	}
+      }
+    }
+  }
+
+  for (j = 0; j < count; j++)
+    fprintf(file, "%s %s\n", names[j], passwords[j]);
+  fclose(file);
+  printf("%d users written to %s\n", count, path);
+  return 0;
+}
+
+/* Replies */
+
+/** Internal function that adds a byte to a line, keeping a prefix.
+ *
+ *  Returns: 1 if the line is complete (the byte is a line feed), in
+ *           which case the line is left in text, without CR/LF, and
+ *           reset; 0 otherwise.
+ */
+static int line_add(struct line *line, char c) {
+
+  if (c == '\n') {
+    line->text[line->len] = '\0';
+    line->len = 0;
+    return 1;
+  }
+  if (c != '\r' && line->len < LINE_PREFIX)
+    line->text[line->len++] = c;
+  return 0;
+}
+
+/** Internal function that checks if the reply to a POP3 command may
+ *  be multi-line (if positive).
+ */
+static int pop3_multi(const char *command) {
+
+  return !strcasecmp(command, "LIST") || !strcasecmp(command, "UIDL") ||
+    !strcasecmp(command, "CAPA") || !strncasecmp(command, "RETR ", 5) ||
+    !strncasecmp(command, "TOP ", 4);
+}
+
+/** Internal function that counts the replies expected for data sent
+ *  to the server.
+ */
+static void replies_sent(struct replies *r, const char *data, size_t len) {
+
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (r->chunk_left) {
+      r->chunk_left--;
+      continue;
+    }
+    if (!line_add(&r->out, data[i]))
+      continue;
+    const char *line = r->out.text;
+    if (r->in_body) {
+      // The end of the message is answered
+      if (!strcmp(line, ".")) {
+	r->in_body = 0;
+	r->expected++;
+      }
+      continue;
+    }
+    r->expected++;
+    if (r->pop3 && r->multi_tail - r->multi_head < MULTI_QUEUE_SIZE)
+      r->multi[r->multi_tail++ % MULTI_QUEUE_SIZE] = pop3_multi(line);
+    // The chunk follows the command, and is answered with it
+    if (!r->pop3 && !strncasecmp(line, "BDAT ", 5))
+      r->chunk_left = strtoul(line + 5, NULL, 10);
+  }
+}
+
+/** Internal function that counts the replies received. */
+static void replies_received(struct replies *r, const char *data, size_t len) {
+
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (!line_add(&r->in, data[i]))
+      continue;
+    const char *line = r->in.text;
+    if (r->received == 0 && !r->in_multi)
+      r->pop3 = !strncmp(line, "+OK", 3) || !strncmp(line, "-ERR", 4);
+
+    if (!r->pop3) {
+      // The last line of a reply has a space (or nothing) after the code
+      if (strlen(line) < 4 || line[3] != '-') {
+	r->received++;
+	if (!strncmp(line, "354", 3))
+	  r->in_body = 1;
+      }
+    } else if (r->in_multi) {
+      if (!strcmp(line, ".")) {
+	r->in_multi = 0;
+	r->received++;
+      }
+    } else {
+      int multi = 0;
+      if (r->received > 0 && r->multi_head < r->multi_tail)
+	multi = r->multi[r->multi_head++ % MULTI_QUEUE_SIZE];
+      // LIST of an empty mailbox ends on its first line ("+OK No mail .")
+      size_t len = strlen(line);
+      if (multi && !strncmp(line, "+OK", 3) && !(len >= 2 && !strcmp(line + len - 2, " .")))
+	r->in_multi = 1;
+      else
+	r->received++;
+    }
+  }
+}
+
+/** Internal function that receives replies until all expected are
+ *  complete.
+ *
+ *  Returns: 0 on success, 1 if the server closed the connection, or
+ *           -1 on error or timeout.
+ */
+static int wait_replies(int fd, struct replies *r, unsigned long long *received) {
+
+  char buf[65536];
+  double deadline = now_us() + timeout_ms * 1000;
+
+  while (r->received < r->expected) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int left = (deadline - now_us()) / 1000;
+    if (left <= 0 || poll(&pfd, 1, left) <= 0)
+      return -1;
+    ssize_t rv = recv(fd, buf, sizeof(buf), 0);
+    if (rv < 0)
+      return -1;
+    if (rv == 0)
+      return 1;
+    *received += rv;
+    replies_received(r, buf, rv);
+  }
+  return 0;
+}
+
+/* Sessions */
+
+static int connect_to(unsigned int captured_port) {
+
+  struct addrinfo hints, *res, *p;
+  char port[16];
+  int fd = -1, one = 1, i;
+
+  snprintf(port, sizeof(port), "%u", captured_port);
+  for (i = 0; i < port_map_count; i++)
+    if (port_maps[i].from == captured_port)
+      snprintf(port, sizeof(port), "%u", port_maps[i].to);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0)
+    return -1;
+  for (p = res; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd >= 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t size) {
+
+  while (size > 0) {
+    ssize_t rv = send(fd, buf, size, MSG_NOSIGNAL);
+    if (rv <= 0)
+      return -1;
+    buf += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/** Internal function that replays a session, and adds its results. */
+static void replay_session(const struct session *s) {
+
+  struct replies *r = calloc(1, sizeof(struct replies));
+  struct samples waits = { NULL, 0, 0 };
+  unsigned long long sent = 0, received = 0;
+  double start = now_us(), last_send = start;
+  int fd = connect_to(s->port), failed = fd < 0, closed = 0, answered = 0, e;
+
+  // The greeting
+  r->expected = 1;
+  for (e = 0; e < s->count && !failed && !closed; e++) {
+    const struct event *ev = &s->events[e];
+    if (ev->type == CAPTURE_SERVER) {
+      answered = 1;
+      continue;
+    }
+    // The client got replies, so it waited for them
+    if (answered) {
+      int rv = wait_replies(fd, r, &received);
+      failed = rv < 0;
+      closed = rv > 0;
+      if (rv == 0)
+	add_sample(&waits, now_us() - last_send);
+      answered = 0;
+      if (rv)
+	break;
+    }
+    if (!max_speed) {
+      double delay = start + ev->time / speed - now_us();
+      if (delay > 0)
+	usleep(delay);
+    }
+    last_send = now_us();
+    if (send_all(fd, ev->data, ev->len) < 0) {
+      failed = 1;
+      break;
+    }
+    sent += ev->len;
+    replies_sent(r, ev->data, ev->len);
+  }
+  // Replies to the last commands (e.g., QUIT)
+  if (!failed && !closed && answered) {
+    int rv = wait_replies(fd, r, &received);
+    failed = rv < 0;
+    if (rv == 0)
+      add_sample(&waits, now_us() - last_send);
+  }
+  // Commands not sent because the server closed the connection
+  if (closed && e < s->count)
+    for (; e < s->count && s->events[e].type != CAPTURE_CLIENT; e++);
+  if (closed && e < s->count)
+    failed = 1;
+  if (fd >= 0)
+    close(fd);
+
+  pthread_mutex_lock(&results_lock);
+  size_t i;
+  for (i = 0; i < waits.count; i++)
+    add_sample(&reply_us, waits.values[i]);
+  if (!failed)
+    add_sample(&session_ms, (now_us() - start) / 1000);
+  errors += failed;
+  bytes_sent += sent;
+  bytes_received += received;
+  recorded_received += s->server_bytes;
+  runs_done++;
+  pthread_cond_signal(&results_cond);
+  pthread_mutex_unlock(&results_lock);
+  free(waits.values);
+  free(r);
+}
+
+static void *run_worker(void *arg) {
+
+  int total = session_count * copies;
+  while (1) {
+    int run = __atomic_fetch_add(&next_run, 1, __ATOMIC_RELAXED);
+    if (run >= total)
+      return NULL;
+    replay_session(&sessions[run / copies]);
+  }
+}
+
+static void *run_one(void *arg) {
+
+  replay_session(arg);
+  return NULL;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-x | -s speed] [-c copies] [-w workers] [-m port=port]...\n"
+	  "\t[-T timeout] [-U users file] [-o results file] [-l label] capture [host]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *output = NULL, *label = "", *users = NULL;
+  unsigned long total;
+  int opt, i, c;
+
+  while ((opt = getopt(argc, argv, "xs:c:w:m:T:U:o:l:")) != -1) {
+    switch (opt) {
+    case 'x': max_speed = 1; break;
+    case 's': speed = atof(optarg); break;
+    case 'c': copies = atoi(optarg); break;
+    case 'w': workers = atoi(optarg); break;
+    case 'm':
+      if (port_map_count == MAX_PORT_MAPS ||
+	  sscanf(optarg, "%u=%u", &port_maps[port_map_count].from,
+		 &port_maps[port_map_count].to) != 2) {
+	usage(argv[0]);
+	return 1;
+      }
+      port_map_count++;
+      break;
+    case 'T': timeout_ms = atof(optarg) * 1000; break;
+    case 'U': users = optarg; break;
+    case 'o': output = optarg; break;
+    case 'l': label = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || argc - optind > 2 || (argc - optind == 1 && !users) ||
+      speed <= 0 || copies < 1 || workers < 1 || timeout_ms <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *capture = argv[optind];
+  host = argv[optind + 1];
+
+  if (load_capture(capture) < 0)
+    return 1;
+  printf("%d sessions in %s\n", session_count, capture);
+  if (users && write_users(users) < 0)
+    return 1;
+  if (!host || !session_count)
+    return 0;
+
+  total = (unsigned long) session_count * copies;
+  double start = now_us();
+  if (max_speed) {
+    pthread_t threads[workers];
+    for (i = 0; i < workers; i++)
+      pthread_create(&threads[i], NULL, run_worker, NULL);
+    for (i = 0; i < workers; i++)
+      pthread_join(threads[i], NULL);
+  } else {
+    // Each session in its own thread, started at its time
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < session_count; i++) {
+      double delay = start + (sessions[i].start - sessions[0].start) / speed - now_us();
+      if (delay > 0)
+	usleep(delay);
+      for (c = 0; c < copies; c++) {
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, run_one, &sessions[i]) != 0) {
+	  pthread_mutex_lock(&results_lock);
+	  errors++;
+	  runs_done++;
+	  pthread_mutex_unlock(&results_lock);
+	}
+      }
+    }
+    pthread_mutex_lock(&results_lock);
+    while (runs_done < total)
+      pthread_cond_wait(&results_cond, &results_lock);
+    pthread_mutex_unlock(&results_lock);
+  }
+  double elapsed = (now_us() - start) / 1e6;
+
+  qsort(session_ms.values, session_ms.count, sizeof(double), compare_doubles);
+  qsort(reply_us.values, reply_us.count, sizeof(double), compare_doubles);
+  printf("%lu sessions in %.3f s (%.1f/s), %lu errors, %llu bytes sent, "
+	 "%llu bytes received (%llu captured)\n", total, elapsed, total / elapsed, errors,
+	 bytes_sent, bytes_received, recorded_received);
+  printf("session ms: p50 %.2f p90 %.2f p99 %.2f max %.2f\n", percentile(&session_ms, 0.5),
+	 percentile(&session_ms, 0.9), percentile(&session_ms, 0.99), percentile(&session_ms, 1));
+  printf("reply us:   p50 %.1f p90 %.1f p99 %.1f max %.1f\n", percentile(&reply_us, 0.5),
+	 percentile(&reply_us, 0.9), percentile(&reply_us, 0.99), percentile(&reply_us, 1));
+
+  if (output) {
+    FILE *out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (!out) {
+      perror(output);
+      return 1;
+    }
+    fprintf(out, "{\"benchmark\": \"replay\", \"label\": \"");
+    for (; *label; label++)
+      fprintf(out, *label == '"' || *label == '\\' ? "\\%c" : "%c", *label);
+    fprintf(out, "\", \"time\": %ld,\n", (long) time(NULL));
+    fprintf(out, " \"config\": {\"capture\": \"%s\", \"host\": \"%s\", \"max_speed\": %s, "
+	    "\"speed\": %.2f, \"copies\": %d, \"workers\": %d},\n", capture, host,
+	    max_speed ? "true" : "false", speed, copies, workers);
+    fprintf(out, " \"elapsed_s\": %.3f, \"sessions\": %lu, \"errors\": %lu, "
+	    "\"sessions_per_s\": %.1f,\n \"bytes_sent\": %llu, \"bytes_received\": %llu, "
+	    "\"captured_bytes_received\": %llu,\n", elapsed, total, errors, total / elapsed,
+	    bytes_sent, bytes_received, recorded_received);
+    fprintf(out, " \"session_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+	    percentile(&session_ms, 0.5), percentile(&session_ms, 0.9),
+	    percentile(&session_ms, 0.99), percentile(&session_ms, 1));
+    fprintf(out, " \"reply_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}\n}\n",
+	    percentile(&reply_us, 0.5), percentile(&reply_us, 0.9),
+	    percentile(&reply_us, 0.99), percentile(&reply_us, 1));
+    if (out != stdout)
+      fclose(out);
+  }
+  return errors ? 2 : 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# smtp-bench.sh
+# Starts mysmtpd on loopback in a scratch directory, runs smtpbench
+# against it, and keeps the results as JSON in bench/results, named
+# after the current commit, so runs of different commits can be
+# compared.
+#
+# Usage: bench/smtp-bench.sh [smtpbench options]  (or make smtp-bench,
+#        with the options in SMTP_BENCH_ARGS)
+#
+# Environment: PORT: port of the server (default 2525).
+#              SERVER_OPTIONS: options of mysmtpd (e.g., "-e 0" for the
+#                              reactor; default: a process per client).
+
+set -e
+cd "$(dirname "$0")/.."
+top=$(pwd)
+port=${PORT:-2525}
+args=${*:--c 16 -d 10}
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+git diff --quiet HEAD 2>/dev/null || commit="$commit-dirty"
+mkdir -p bench/results
+results="bench/results/smtp-$commit.json"
+
+dir=$(mktemp -d)
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null || true; rm -rf "$dir"' EXIT
+for i in 1 2 3 4 5 6 7 8; do
+  echo "bench$i password$i"
+done > "$dir/users.txt"
+
+(cd "$dir" && exec "$top/mysmtpd" $SERVER_OPTIONS "$port" > server.log 2>&1) &
+server=$!
+for i in $(seq 50); do
+  grep -q "waiting for connections" "$dir/server.log" 2>/dev/null && break
+  kill -0 $server 2>/dev/null || { cat "$dir/server.log"; exit 1; }
+  sleep 0.1
+done
+
+bench/smtpbench -R bench1,bench2,bench3,bench4,bench5,bench6,bench7,bench8 \
+  -l "$commit" -o "$results" $args 127.0.0.1 "$port"
+echo "results written to $results"
@@ -0,0 +1,475 @@
+/* smtpbench.c
+ * Load generator for an SMTP server: keeps a number of concurrent
+ * connections sending mail for a while, and reports the throughput
+ * and the latency of each phase of the sessions.
+ *
+ * Usage: smtpbench [-c connections] [-d seconds] [-n messages per session]
+ *                  [-r recipients per message] [-R recipient,...]
+ *                  [-s size] [-P] [-H] [-o results file] [-l label]
+ *                  [host] port
+ *
+ * Each connection runs in its own thread, and runs sessions until the
+ * time is up: connect and wait for the greeting, EHLO (or HELO with
+ * -H), a number of messages (MAIL, RCPT for each recipient, DATA and
+ * the message), and QUIT. Recipients are taken in turn from the list
+ * given with -R. With -P, the envelope (MAIL, all RCPTs and DATA) is
+ * pipelined and timed as a single phase.
+ *
+ * Message sizes (in bytes, headers included) follow a distribution:
+ * N for a fixed size, MIN-MAX for a uniform distribution, or expN for
+ * an exponential distribution with mean N.
+ *
+ * Results are printed as a table; with -o, they are also written as
+ * JSON (to the standard output with "-"), tagged with the label given
+ * with -l (e.g., a commit), to compare runs. Sessions are run against
+ * a server on loopback by bench/smtp-bench.sh (make smtp-bench).
+ * Servers limiting recipients per address should be started with -R.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_RECIPIENTS 100
+#define MAX_MESSAGE_SIZE 10485760
+#define LINE_LENGTH 78 // bytes of each line of the body, CRLF included
+
+// Phases of a session
+enum { PHASE_CONNECT, PHASE_HELO, PHASE_MAIL, PHASE_RCPT, PHASE_DATA,
+       PHASE_ENVELOPE, PHASE_MESSAGE, PHASE_QUIT, PHASES };
+static const char *phase_names[PHASES] = {
+  "connect", "helo", "mail", "rcpt", "data", "envelope", "message", "quit"
+};
+
+struct samples {
+  double *values;       // latencies in microseconds
+  size_t count, size;
+  unsigned long errors; // negative replies or lost connections
+};
+
+struct worker {
+  pthread_t thread;
+  unsigned int seed;
+  struct samples phases[PHASES];
+  unsigned long sessions, messages, deliveries;
+  unsigned long long bytes;
+};
+
+// Configuration, shared by all workers
+static const char *host = "127.0.0.1", *port;
+static int connections = 10, seconds = 10, messages_per_session = 1;
+static int recipients_per_message = 1, pipelining = 0, use_helo = 0;
+static char *recipients[MAX_RECIPIENTS];
+static int recipient_count = 0;
+static const char *size_spec = "1024";
+static enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP } size_kind = SIZE_FIXED;
+static double size_a = 1024, size_b = 0;
+static double deadline;
+static char *body;      // text of the largest message, in lines
+
+static double now_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add_sample(struct samples *s, double value) {
+
+  if (s->count == s->size) {
+    s->size = s->size ? s->size * 2 : 1024;
+    s->values = realloc(s->values, s->size * sizeof(double));
+  }
+  s->values[s->count++] = value;
+}
+
+/** Parses the size distribution given with -s.
+ *
+ *  Returns: 0 on success, -1 if the distribution is invalid.
+ */
+static int parse_size(const char *spec) {
+
+  char *end;
+  if (!strncmp(spec, "exp", 3)) {
+    size_kind = SIZE_EXP;
+    size_a = strtod(spec + 3, &end);
+  } else {
+    size_a = strtod(spec, &end);
+    if (*end == '-') {
+      size_kind = SIZE_UNIFORM;
+      size_b = strtod(end + 1, &end);
+      if (size_b < size_a)
+	return -1;
+    }
+  }
+  return *end || size_a < 1 ? -1 : 0;
+}
+
+/** Draws the size of a message from the distribution.
+ */
+static size_t message_size(unsigned int *seed) {
+
+  double size = size_a;
+  double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+  if (size_kind == SIZE_UNIFORM)
+    size = size_a + u * (size_b - size_a + 1);
+  else if (size_kind == SIZE_EXP)
+    size = -size_a * log(u);
+  if (size < 1)
+    size = 1;
+  if (size > MAX_MESSAGE_SIZE)
+    size = MAX_MESSAGE_SIZE;
+  return (size_t) size;
+}
+
+/** Reads replies until a number of them is complete (the last line of
+ *  a multi-line reply has a space after the code).
+ *
+ *  Returns: 0 if all replies were positive, 1 if any was negative, or
+ *           -1 if the connection was lost.
+ */
+static int read_replies(int fd, int count) {
+
+  char buf[4096];
+  size_t len = 0;
+  int failed = 0;
+
+  while (count > 0) {
+    ssize_t rv = recv(fd, buf + len, sizeof(buf) - len, 0);
+    if (rv <= 0)
+      return -1;
+    len += rv;
+    char *line = buf, *eol;
+    while ((eol = memchr(line, '\n', buf + len - line)) != NULL) {
+      if (eol - line >= 4 && line[3] != '-') {
+	count--;
+	if (line[0] != '2' && line[0] != '3')
+	  failed = 1;
+      }
+      line = eol + 1;
+    }
+    len = buf + len - line;
+    memmove(buf, line, len);
+    if (len == sizeof(buf))
+      return -1;
+  }
+  return failed;
+}
+
+static int send_all(int fd, const char *buf, size_t size) {
+
+  while (size > 0) {
+    ssize_t rv = send(fd, buf, size, MSG_NOSIGNAL);
+    if (rv <= 0)
+      return -1;
+    buf += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/** Sends commands and times their replies as a phase.
+ *
+ *  Returns: same as read_replies.
+ */
+static int timed(struct worker *w, int phase, int fd, const char *text, size_t len,
+		 int replies) {
+
+  double start = now_us();
+  int rv = send_all(fd, text, len) < 0 ? -1 : read_replies(fd, replies);
+  if (rv == 0)
+    add_sample(&w->phases[phase], now_us() - start);
+  else
+    w->phases[phase].errors++;
+  return rv;
+}
+
+static int connect_to(void) {
+
+  struct addrinfo hints, *res, *p;
+  int fd = -1, one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0)
+    return -1;
+  for (p = res; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd >= 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+/** Sends a message in a session that already sent EHLO or HELO.
+ *
+ *  Returns: 0 if the message was accepted, 1 if it was refused, or -1
+ *           if the connection was lost.
+ */
+static int send_mail(struct worker *w, int fd, int *next_rcpt) {
+
+  char envelope[MAX_RECIPIENTS * 300 + 64];
+  size_t len = 0, size = message_size(&w->seed);
+  int i, rv;
+
+  // Commands are built in one buffer, and sent one by one unless
+  // pipelined
+  size_t mail_len = snprintf(envelope, sizeof(envelope), "MAIL FROM:<bench@localhost>\r\n");
+  size_t rcpt_start[MAX_RECIPIENTS];
+  for (i = 0, len = mail_len; i < recipients_per_message; i++) {
+    rcpt_start[i] = len;
+    len += snprintf(envelope + len, sizeof(envelope) - len, "RCPT TO:<%s>\r\n",
+		    recipients[(*next_rcpt)++ % recipient_count]);
+  }
+  size_t data_start = len;
+  len += snprintf(envelope + len, sizeof(envelope) - len, "DATA\r\n");
+
+  if (pipelining) {
+    rv = timed(w, PHASE_ENVELOPE, fd, envelope, len, recipients_per_message + 2);
+  } else {
+    rv = timed(w, PHASE_MAIL, fd, envelope, mail_len, 1);
+    for (i = 0; i < recipients_per_message && rv == 0; i++)
+      rv = timed(w, PHASE_RCPT, fd, envelope + rcpt_start[i],
+		 (i + 1 < recipients_per_message ? rcpt_start[i + 1] : data_start) - rcpt_start[i], 1);
+    if (rv == 0)
+      rv = timed(w, PHASE_DATA, fd, envelope + data_start, len - data_start, 1);
+  }
+  if (rv != 0)
+    return rv;
+
+  // The message is a header and body lines, cut to the size; lines
+  // never start with a dot, so nothing needs to be escaped
+  static const char header[] = "Subject: smtpbench\r\n\r\n";
+  double start = now_us();
+  if (send_all(fd, header, size < sizeof(header) - 1 ? size : sizeof(header) - 1) < 0)
+    return -1;
+  if (size > sizeof(header) - 1 &&
+      send_all(fd, body, size - (sizeof(header) - 1)) < 0)
+    return -1;
+  rv = send_all(fd, "\r\n.\r\n", 5) < 0 ? -1 : read_replies(fd, 1);
+  if (rv != 0) {
+    w->phases[PHASE_MESSAGE].errors++;
+    return rv;
+  }
+  add_sample(&w->phases[PHASE_MESSAGE], now_us() - start);
+  w->messages++;
+  w->deliveries += recipients_per_message;
+  w->bytes += size;
+  return 0;
+}
+
+/** Main function of each worker: runs sessions until the deadline.
+ */
+static void *worker_main(void *arg) {
+
+  struct worker *w = arg;
+  int next_rcpt = w->seed, i;
+  const char *helo = use_helo ? "HELO smtpbench\r\n" : "EHLO smtpbench\r\n";
+
+  while (now_us() < deadline) {
+    double start = now_us();
+    int fd = connect_to();
+    if (fd < 0 || read_replies(fd, 1) != 0) {
+      w->phases[PHASE_CONNECT].errors++;
+      if (fd >= 0)
+	close(fd);
+      // the server may be over its limits; don't spin
+      usleep(10000);
+      continue;
+    }
+    add_sample(&w->phases[PHASE_CONNECT], now_us() - start);
+
+    // A refused command ends the session (the server has no RSET)
+    int rv = timed(w, PHASE_HELO, fd, helo, strlen(helo), 1);
+    for (i = 0; i < messages_per_session && rv == 0 && now_us() < deadline; i++)
+      rv = send_mail(w, fd, &next_rcpt);
+    if (rv >= 0)
+      timed(w, PHASE_QUIT, fd, "QUIT\r\n", 6, 1);
+    close(fd);
+    w->sessions++;
+  }
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/** Returns a percentile of sorted samples, by the nearest-rank method.
+ */
+static double percentile(const struct samples *s, double p) {
+
+  size_t rank = (size_t) (p * s->count + 0.999999);
+  if (rank < 1)
+    rank = 1;
+  return s->values[rank - 1];
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-n messages per session]\n"
+	  "\t[-r recipients per message] [-R recipient,...] [-s size | min-max | expmean]\n"
+	  "\t[-P] [-H] [-o results file] [-l label] [host] port\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *output = NULL, *label = "";
+  char *rcpt_list = "alice";
+  int opt, i, p;
+  size_t j;
+
+  while ((opt = getopt(argc, argv, "c:d:n:r:R:s:PHo:l:")) != -1) {
+    switch (opt) {
+    case 'c': connections = atoi(optarg); break;
+    case 'd': seconds = atoi(optarg); break;
+    case 'n': messages_per_session = atoi(optarg); break;
+    case 'r': recipients_per_message = atoi(optarg); break;
+    case 'R': rcpt_list = optarg; break;
+    case 's': size_spec = optarg; break;
+    case 'P': pipelining = 1; break;
+    case 'H': use_helo = 1; break;
+    case 'o': output = optarg; break;
+    case 'l': label = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || connections < 1 || seconds < 1 || messages_per_session < 1 ||
+      recipients_per_message < 1 || recipients_per_message > MAX_RECIPIENTS ||
+      parse_size(size_spec) < 0 || (pipelining && use_helo)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (argc - optind > 1)
+    host = argv[optind];
+  port = argv[argc - 1];
+  for (char *r = strtok(strdup(rcpt_list), ","); r && recipient_count < MAX_RECIPIENTS;
+       r = strtok(NULL, ","))
+    recipients[recipient_count++] = r;
+  if (!recipient_count) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  body = malloc(MAX_MESSAGE_SIZE);
+  for (j = 0; j < MAX_MESSAGE_SIZE; j++)
+    body[j] = j % LINE_LENGTH == LINE_LENGTH - 2 ? '\r' :
+      j % LINE_LENGTH == LINE_LENGTH - 1 ? '\n' : 'a' + j % LINE_LENGTH % 26;
+
+  struct worker *workers = calloc(connections, sizeof(struct worker));
+  double start = now_us();
+  deadline = start + seconds * 1e6;
+  for (i = 0; i < connections; i++) {
+    workers[i].seed = i + 1;
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  // Results of all workers are merged in the first one
+  struct worker *total = &workers[0];
+  pthread_join(total->thread, NULL);
+  for (i = 1; i < connections; i++) {
+    pthread_join(workers[i].thread, NULL);
+    for (p = 0; p < PHASES; p++) {
+      for (j = 0; j < workers[i].phases[p].count; j++)
+	add_sample(&total->phases[p], workers[i].phases[p].values[j]);
+      total->phases[p].errors += workers[i].phases[p].errors;
+    }
+    total->sessions += workers[i].sessions;
+    total->messages += workers[i].messages;
+    total->deliveries += workers[i].deliveries;
+    total->bytes += workers[i].bytes;
+  }
+  double elapsed = (now_us() - start) / 1e6;
+  unsigned long errors = 0;
+  for (p = 0; p < PHASES; p++) {
+    qsort(total->phases[p].values, total->phases[p].count, sizeof(double), compare_doubles);
+    errors += total->phases[p].errors;
+  }
+
+  printf("%-10s %9s %7s %10s %10s %10s %10s %10s %10s\n", "phase (us)", "count", "errors",
+	 "mean", "p50", "p90", "p99", "p999", "max");
+  for (p = 0; p < PHASES; p++) {
+    struct samples *s = &total->phases[p];
+    double sum = 0;
+    if (!s->count && !s->errors)
+      continue;
+    for (j = 0; j < s->count; j++)
+      sum += s->values[j];
+    if (!s->count) {
+      printf("%-10s %9zu %7lu\n", phase_names[p], s->count, s->errors);
+      continue;
+    }
+    printf("%-10s %9zu %7lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[p],
+	   s->count, s->errors, sum / s->count, percentile(s, 0.5), percentile(s, 0.9),
+	   percentile(s, 0.99), percentile(s, 0.999), s->values[s->count - 1]);
+  }
+  printf("%lu sessions, %lu messages (%.1f/s), %lu deliveries (%.1f/s), %.2f MB/s, %lu errors\n",
+	 total->sessions, total->messages, total->messages / elapsed, total->deliveries,
+	 total->deliveries / elapsed, total->bytes / elapsed / 1e6, errors);
+
+  if (output) {
+    FILE *out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (!out) {
+      perror(output);
+      return 1;
+    }
+    fprintf(out, "{\"benchmark\": \"smtp\", \"label\": \"");
+    for (; *label; label++)
+      fprintf(out, *label == '"' || *label == '\\' ? "\\%c" : "%c", *label);
+    fprintf(out, "\", \"time\": %ld,\n", (long) time(NULL));
+    fprintf(out, " \"config\": {\"host\": \"%s\", \"port\": \"%s\", \"connections\": %d, "
+	    "\"seconds\": %d, \"messages_per_session\": %d, \"recipients_per_message\": %d, "
+	    "\"recipients\": %d, \"size\": \"%s\", \"pipelining\": %s, \"helo\": %s},\n",
+	    host, port, connections, seconds, messages_per_session, recipients_per_message,
+	    recipient_count, size_spec, pipelining ? "true" : "false", use_helo ? "true" : "false");
+    fprintf(out, " \"elapsed_s\": %.3f, \"sessions\": %lu, \"messages\": %lu, "
+	    "\"deliveries\": %lu, \"bytes\": %llu, \"errors\": %lu,\n"
+	    " \"messages_per_s\": %.1f, \"deliveries_per_s\": %.1f, \"bytes_per_s\": %.0f,\n"
+	    " \"phases\": {", elapsed, total->sessions, total->messages, total->deliveries,
+	    total->bytes, errors, total->messages / elapsed, total->deliveries / elapsed,
+	    total->bytes / elapsed);
+    for (p = 0, i = 0; p < PHASES; p++) {
+      struct samples *s = &total->phases[p];
+      double sum = 0;
+      if (!s->count && !s->errors)
+	continue;
+      for (j = 0; j < s->count; j++)
+	sum += s->values[j];
+      fprintf(out, "%s\n  \"%s\": {\"count\": %zu, \"errors\": %lu", i++ ? "," : "",
+	      phase_names[p], s->count, s->errors);
+      if (s->count)
+	fprintf(out, ", \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+		"\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f", sum / s->count,
+		percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99),
+		percentile(s, 0.999), s->values[s->count - 1]);
+      fprintf(out, "}");
+    }
+    fprintf(out, "\n }\n}\n");
+    if (out != stdout)
+      fclose(out);
+  }
+  return errors ? 2 : 0;
+}
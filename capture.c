@@ -0,0 +1,386 @@
+/* capture.c
+ * Records client sessions into a capture file, with their timing and
+ * the boundaries of the data received, to be replayed later (see
+ * bench/replay.c).
+ *
+ * Notes: A session is captured by attaching a transport to its socket
+ * (see transport.h), which records each receive and send as it
+ * happens, so the data is kept with the segmentation of the client.
+ * Every record is written with a single call to a file opened for
+ * appending, so processes and threads can share the file. Client data
+ * is anonymized before it is written, keeping its length: message
+ * contents (after a 354 reply, until the line with a single dot, and
+ * BDAT chunks) have all letters and digits replaced with 'x',
+ * passwords (the argument of PASS) have every character replaced with
+ * 'x', and names (addresses between angle brackets, and the arguments
+ * of HELO, EHLO, USER, APOP, VRFY and EXPN) have letters and digits
+ * replaced through a random substitution, chosen when the file is
+ * opened. A substitution keeps the patterns of repeated characters,
+ * which is acceptable for names but not for passwords. Names are
+ * lowercased first, so a user is given the same
+ * pseudonym in every command and session of a server (mymaild, for a
+ * capture of both protocols), and a replay can create the users found
+ * in a capture (see replay -U). Client
+ * addresses are not recorded, and the data sent by the server is
+ * only counted.
+ */
+
+#define _GNU_SOURCE // for sendfile and getrandom
+
+#include "capture.h"
+#include "transport.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#define CAPTURE_HEADER_SIZE 64
+#define CAPTURE_COPY_SIZE 4096 // client data anonymized on the stack
+
+// How the arguments of a command are anonymized
+enum { MASK_NONE, MASK_BRACKETS, MASK_ALL, MASK_SECRET, MASK_BDAT };
+
+struct capture_session {
+  uint64_t id;
+  uint64_t start;         // microseconds (CLOCK_MONOTONIC)
+  // State of the client data, kept across receives
+  int in_body;            // in the contents of a message
+  size_t line_len;        // bytes in the current line, without CR/LF
+  char first;             // first byte of the current line
+  char verb[8];           // command of the current line, so far
+  int verb_done;
+  int mask;               // MASK_* for the arguments of the command
+  int in_brackets;
+  size_t bdat_size;       // size in the arguments of BDAT
+  int bdat_done;          // whole size received
+  size_t chunk_left;      // bytes of a BDAT chunk still to be received
+};
+
+static int capture_fd = -1;
+static char letter_key[26], digit_key[10];
+static unsigned int sessions = 0;
+
+/** Internal function that returns the time in microseconds. */
+static uint64_t now_us(clockid_t clock) {
+
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/** Internal function that encodes a varint (unsigned LEB128).
+ *
+ *  Returns: number of bytes written to out.
+ */
+static size_t put_varint(unsigned char *out, uint64_t value) {
+
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[len++] = value;
+  return len;
+}
+
+/** Internal function that appends a record to the capture file. value
+ *  is the port of CAPTURE_START records, and the length of
+ *  CAPTURE_CLIENT and CAPTURE_SERVER records; data is only written
+ *  for CAPTURE_CLIENT.
+ */
+static void write_record(struct capture_session *session, int type, uint64_t value,
+			 const void *data) {
+
+  unsigned char header[CAPTURE_HEADER_SIZE];
+  size_t len = 0;
+
+  header[len++] = type;
+  len += put_varint(header + len, session->id);
+  if (type == CAPTURE_START)
+    len += put_varint(header + len, now_us(CLOCK_REALTIME));
+  else
+    len += put_varint(header + len, now_us(CLOCK_MONOTONIC) - session->start);
+  if (type != CAPTURE_END)
+    len += put_varint(header + len, value);
+
+  struct iovec iov[2] = {
+    { header, len },
+    { (void *) data, type == CAPTURE_CLIENT ? value : 0 }
+  };
+  // A failed capture never affects the session
+  if (writev(capture_fd, iov, 2) < 0)
+    return;
+}
+
+/** Internal function that replaces a byte of a name with its
+ *  pseudonym.
+ */
+static char pseudonym(char c) {
+
+  if (isalpha((unsigned char) c))
+    return letter_key[tolower((unsigned char) c) - 'a'];
+  if (isdigit((unsigned char) c))
+    return digit_key[c - '0'];
+  return c;
+}
+
+/** Internal function that starts anonymizing the arguments of a
+ *  command, once the command itself was received.
+ */
+static void start_arguments(struct capture_session *session) {
+
+  static const char *names[] = { "HELO", "EHLO", "USER", "APOP", "VRFY", "EXPN" };
+  const char *verb = session->verb;
+  size_t i;
+
+  session->verb_done = 1;
+  session->mask = MASK_NONE;
+  if (!strcasecmp(verb, "MAIL") || !strcasecmp(verb, "RCPT"))
+    session->mask = MASK_BRACKETS;
+  else if (!strcasecmp(verb, "BDAT"))
+    session->mask = MASK_BDAT;
+  else if (!strcasecmp(verb, "PASS"))
+    session->mask = MASK_SECRET;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    if (!strcasecmp(verb, names[i]))
+      session->mask = MASK_ALL;
+}
+
+/** Internal function that anonymizes a byte received from the client,
+ *  and updates the state of the session.
+ */
+static char anonymize(struct capture_session *session, char c) {
+
+  if (session->chunk_left) {
+    session->chunk_left--;
+    return isalnum((unsigned char) c) ? 'x' : c;
+  }
+
+  if (c == '\n') {
+    // The contents of a message end with a line with a single dot
+    if (session->in_body && session->line_len == 1 && session->first == '.')
+      session->in_body = 0;
+    else if (!session->in_body && session->mask == MASK_BDAT)
+      session->chunk_left = session->bdat_size;
+    session->line_len = 0;
+    session->verb[0] = '\0';
+    session->verb_done = 0;
+    session->mask = MASK_NONE;
+    session->in_brackets = 0;
+    session->bdat_size = 0;
+    session->bdat_done = 0;
+    return c;
+  }
+  if (c != '\r') {
+    if (!session->line_len)
+      session->first = c;
+    session->line_len++;
+  }
+
+  if (session->in_body)
+    return isalnum((unsigned char) c) ? 'x' : c;
+
+  if (!session->verb_done) {
+    size_t len = strlen(session->verb);
+    if (c == ' ' || c == '\r')
+      start_arguments(session);
+    else if (len < sizeof(session->verb) - 1) {
+      session->verb[len] = c;
+      session->verb[len + 1] = '\0';
+    }
+    return c;
+  }
+
+  switch (session->mask) {
+  case MASK_BRACKETS:
+    if (c == '<')
+      session->in_brackets = 1;
+    else if (c == '>')
+      session->in_brackets = 0;
+    return session->in_brackets ? pseudonym(c) : c;
+  case MASK_ALL:
+    return pseudonym(c);
+  case MASK_SECRET:
+    return c == '\r' ? c : 'x';
+  case MASK_BDAT:
+    // The size is followed by LAST, or nothing
+    if (isdigit((unsigned char) c) && !session->bdat_done &&
+	session->bdat_size < ((size_t) -1) / 10)
+      session->bdat_size = session->bdat_size * 10 + (c - '0');
+    else if (session->bdat_size)
+      session->bdat_done = 1;
+    return c;
+  }
+  return c;
+}
+
+/** Internal function that records data received from the client. */
+static void record_client(struct capture_session *session, const char *buf, size_t size) {
+
+  char copy[CAPTURE_COPY_SIZE];
+  char *out = size <= sizeof(copy) ? copy : malloc(size);
+  size_t i;
+
+  if (!out)
+    return;
+  for (i = 0; i < size; i++)
+    out[i] = anonymize(session, buf[i]);
+  write_record(session, CAPTURE_CLIENT, size, out);
+  if (out != copy)
+    free(out);
+}
+
+/** Internal function that records data sent to the client. Only the
+ *  start of a message (354 reply) is looked for in the data.
+ */
+static void record_server(struct capture_session *session, const char *buf, size_t size) {
+
+  if (buf && size >= 3 && !memcmp(buf, "354", 3)) {
+    session->in_body = 1;
+    session->line_len = 0;
+  }
+  write_record(session, CAPTURE_SERVER, size, NULL);
+}
+
+static ssize_t capture_recv(int fd, void *ctx, void *buf, size_t size) {
+
+  ssize_t rv = recv(fd, buf, size, 0);
+  if (rv > 0)
+    record_client(ctx, buf, rv);
+  return rv;
+}
+
+static ssize_t capture_send(int fd, void *ctx, const void *buf, size_t size, int flags) {
+
+  ssize_t rv = send(fd, buf, size, flags);
+  if (rv > 0)
+    record_server(ctx, buf, rv);
+  return rv;
+}
+
+static ssize_t capture_writev(int fd, void *ctx, const struct iovec *iov, int count, int flags) {
+
+  struct msghdr msg = { .msg_iov = (struct iovec *) iov, .msg_iovlen = count };
+  ssize_t rv = sendmsg(fd, &msg, flags);
+  if (rv > 0)
+    record_server(ctx, count && iov[0].iov_len >= 3 ? iov[0].iov_base : NULL, rv);
+  return rv;
+}
+
+static ssize_t capture_sendfile(int fd, void *ctx, int file_fd, off_t *offset, size_t size) {
+
+  ssize_t rv = sendfile(fd, file_fd, offset, size);
+  if (rv > 0)
+    record_server(ctx, NULL, rv);
+  return rv;
+}
+
+static const struct transport_ops capture_ops = {
+  capture_recv, capture_send, capture_writev, capture_sendfile
+};
+
+/** Opens the capture file, where all sessions started after this call
+ *  are recorded. The file is created if needed, and records are
+ *  appended to it. Must be called before processes are forked, so the
+ *  file (and the pseudonyms) are shared.
+ *
+ *  Parameters: path: Name of the capture file.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int capture_open(const char *path) {
+
+  unsigned char random[sizeof(letter_key) + sizeof(digit_key)];
+  struct stat file_stat;
+  int i;
+
+  capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (capture_fd < 0 || fstat(capture_fd, &file_stat) < 0) {
+    perror(path);
+    return -1;
+  }
+  if (file_stat.st_size == 0 &&
+      write(capture_fd, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != CAPTURE_MAGIC_SIZE) {
+    perror(path);
+    return -1;
+  }
+
+  // Substitutions are random permutations (Fisher-Yates)
+  if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+    perror("getrandom");
+    return -1;
+  }
+  for (i = 0; i < 26; i++)
+    letter_key[i] = 'a' + i;
+  for (i = 0; i < 10; i++)
+    digit_key[i] = '0' + i;
+  for (i = 25; i > 0; i--) {
+    int j = random[i] % (i + 1);
+    char c = letter_key[i];
+    letter_key[i] = letter_key[j];
+    letter_key[j] = c;
+  }
+  for (i = 9; i > 0; i--) {
+    int j = random[26 + i] % (i + 1);
+    char c = digit_key[i];
+    digit_key[i] = digit_key[j];
+    digit_key[j] = c;
+  }
+  return 0;
+}
+
+/** Starts recording a session, if a capture file is open.
+ *
+ *  Parameters: fd: Socket of the session.
+ */
+void capture_begin(int fd) {
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  unsigned int port = 0;
+
+  if (capture_fd < 0)
+    return;
+  struct capture_session *session = calloc(1, sizeof(struct capture_session));
+  if (!session)
+    return;
+  // IDs are unique among the processes of the server
+  session->id = (uint64_t) getpid() << 32 |
+    __atomic_add_fetch(&sessions, 1, __ATOMIC_RELAXED);
+  session->start = now_us(CLOCK_MONOTONIC);
+  if (getsockname(fd, (struct sockaddr *) &addr, &len) == 0)
+    port = ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &addr)->sin6_port :
+		 ((struct sockaddr_in *) &addr)->sin_port);
+
+  if (transport_attach(fd, &capture_ops, session) < 0) {
+    free(session);
+    return;
+  }
+  write_record(session, CAPTURE_START, port, NULL);
+}
+
+/** Stops recording a session, before its socket is closed.
+ *
+ *  Parameters: fd: Socket of the session.
+ */
+void capture_end(int fd) {
+
+  if (capture_fd < 0)
+    return;
+  struct capture_session *session = transport_detach(fd);
+  if (!session)
+    return;
+  write_record(session, CAPTURE_END, 0, NULL);
+  free(session);
+}
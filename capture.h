@@ -0,0 +1,32 @@
+/* capture.h
+ * Records client sessions into a capture file, with their timing and
+ * the boundaries of the data received, to be replayed later (see
+ * bench/replay.c).
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+// A capture file starts with CAPTURE_MAGIC, followed by records of
+// all sessions, interleaved. Each record is:
+//
+//   type (1 byte), session (varint), time (varint), then
+//   CAPTURE_START:  local port (varint), time is microseconds since
+//                   the epoch
+//   CAPTURE_CLIENT: length (varint) and the data received
+//   CAPTURE_SERVER: length (varint) of the data sent (not kept)
+//   CAPTURE_END:    nothing
+//
+// Times of records other than CAPTURE_START are microseconds since the
+// start of the session. Varints are unsigned LEB128 (7 bits per byte,
+// least significant first, high bit set in all bytes but the last).
+#define CAPTURE_MAGIC "MAILCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+
+enum { CAPTURE_START = 1, CAPTURE_CLIENT, CAPTURE_SERVER, CAPTURE_END };
+
+int capture_open(const char *path);
+void capture_begin(int fd);
+void capture_end(int fd);
+
+#endif
@@ -0,0 +1,490 @@
+/* log.c
+ * Logs messages with levels and session IDs, through a ring buffer
+ * drained by a writer thread.
+ *
+ * Notes: Sessions never format or write log messages themselves. A
+ * message is stored as a binary record: the time, level, session, a
+ * pointer to the format string and the raw values of its arguments
+ * (strings are copied). Records are kept in a ring of fixed-size
+ * slots in shared memory, created before any process is forked, so
+ * sessions in forked processes, pool threads and the reactor all log
+ * to the same ring. Slots are claimed with compare-and-swap, as in
+ * the connection queue of the thread pool, so logging never blocks:
+ * when the ring is full, the record is dropped and counted. A thread
+ * in the main process formats the records and writes them to the log
+ * file. Format strings are valid in that thread because forked
+ * processes run the same binary at the same addresses.
+ *
+ * Strings are written with control characters escaped, so a client
+ * can't forge log lines.
+ */
+
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// Number of slots in the ring (power of two)
+#define LOG_RING_SIZE 4096
+#define LOG_SLOT_SIZE 256
+#define LOG_ARGS_SIZE (LOG_SLOT_SIZE - 32)
+// Time the writer sleeps when the ring is empty, in milliseconds
+#define LOG_WRITER_SLEEP_MS 10
+// Polls of the writer after which a slot claimed but never filled
+// (e.g., by a process that crashed while logging) is skipped
+#define LOG_STALL_POLLS 100
+
+struct log_record {
+  unsigned long seq;            // as in the connection queue
+  uint64_t time_ns;             // CLOCK_REALTIME
+  const char *format;
+  uint32_t session;
+  uint16_t level;
+  uint16_t size;                // bytes used in args
+  unsigned char args[LOG_ARGS_SIZE];
+};
+
+struct log_ring {
+  unsigned long head;           // next slot to be claimed
+  unsigned long dropped;        // records lost because the ring was full,
+                                // or their slot was skipped
+  unsigned int next_session;
+  struct log_record slots[LOG_RING_SIZE];
+};
+
+// Types of format directives
+#define ARG_LITERAL  0          // not a directive, or %%
+#define ARG_SIGNED   1
+#define ARG_UNSIGNED 2
+#define ARG_DOUBLE   3
+#define ARG_STRING   4
+#define ARG_POINTER  5
+
+// Length modifiers of integer directives
+#define MOD_NONE 0
+#define MOD_LONG 1
+#define MOD_LONG_LONG 2
+#define MOD_SIZE 3
+
+struct directive {
+  int type;
+  int mod;
+  char spec[32];                // directive as used by the writer
+};
+
+int log_level = LOG_LEVEL_INFO;
+__thread unsigned int log_session = 0;
+
+static const char *level_names[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+static struct log_ring *ring = NULL;
+static FILE *log_file = NULL;
+// Next slot to be read by the writer
+static unsigned long tail = 0;
+static unsigned int local_sessions = 0;
+
+/** Internal function that parses the format directive starting at a
+ *  '%'. Integers are always passed to the writer as long long, so
+ *  the length modifier of the spec is replaced.
+ *
+ *  Returns: pointer to the first character after the directive.
+ */
+static const char *parse_directive(const char *p, struct directive *d) {
+
+  const char *start = p++;
+  size_t n = 1;
+
+  d->spec[0] = '%';
+  d->mod = MOD_NONE;
+  while (*p && strchr("-+ #0123456789.", *p) && n < sizeof(d->spec) - 4)
+    d->spec[n++] = *p++;
+  if (*p == 'h') {
+    p += p[1] == 'h' ? 2 : 1;
+  } else if (*p == 'l') {
+    d->mod = p[1] == 'l' ? MOD_LONG_LONG : MOD_LONG;
+    p += p[1] == 'l' ? 2 : 1;
+  } else if (*p == 'z') {
+    d->mod = MOD_SIZE;
+    p++;
+  }
+
+  switch (*p) {
+  case 'd': case 'i':
+    d->type = ARG_SIGNED;
+    break;
+  case 'u': case 'x': case 'X': case 'o': case 'c':
+    d->type = *p == 'c' ? ARG_SIGNED : ARG_UNSIGNED;
+    break;
+  case 'e': case 'E': case 'f': case 'g': case 'G':
+    d->type = ARG_DOUBLE;
+    break;
+  case 's':
+    d->type = ARG_STRING;
+    break;
+  case 'p':
+    d->type = ARG_POINTER;
+    break;
+  default:
+    // %% is written as %, unknown directives as they are
+    d->type = ARG_LITERAL;
+    if (*p == '%' && p == start + 1) {
+      strcpy(d->spec, "%");
+    } else {
+      n = p - start + (*p != 0);
+      if (n >= sizeof(d->spec))
+	n = sizeof(d->spec) - 1;
+      memcpy(d->spec, start, n);
+      d->spec[n] = 0;
+    }
+    return *p ? p + 1 : p;
+  }
+  if ((d->type == ARG_SIGNED || d->type == ARG_UNSIGNED) && *p != 'c') {
+    d->spec[n++] = 'l';
+    d->spec[n++] = 'l';
+  }
+  d->spec[n++] = *p;
+  d->spec[n] = 0;
+  return p + 1;
+}
+
+/** Internal function that stores the arguments of a message in a
+ *  record, in the order of the directives in the format. Arguments
+ *  that don't fit are left out.
+ */
+static void encode_args(struct log_record *record, const char *format, va_list args) {
+
+  const char *p = format;
+  struct directive d;
+  size_t size = 0;
+
+  while ((p = strchr(p, '%')) != NULL) {
+    p = parse_directive(p, &d);
+    long long i = 0;
+    double f = 0;
+    void *ptr = NULL;
+    const char *s = NULL;
+
+    switch (d.type) {
+    case ARG_SIGNED:
+      i = d.mod == MOD_LONG ? va_arg(args, long) :
+	d.mod == MOD_LONG_LONG ? va_arg(args, long long) :
+	d.mod == MOD_SIZE ? (long long) va_arg(args, size_t) : va_arg(args, int);
+      break;
+    case ARG_UNSIGNED:
+      i = d.mod == MOD_LONG ? va_arg(args, unsigned long) :
+	d.mod == MOD_LONG_LONG ? va_arg(args, unsigned long long) :
+	d.mod == MOD_SIZE ? va_arg(args, size_t) : va_arg(args, unsigned int);
+      break;
+    case ARG_DOUBLE:
+      f = va_arg(args, double);
+      break;
+    case ARG_STRING:
+      s = va_arg(args, const char *);
+      break;
+    case ARG_POINTER:
+      ptr = va_arg(args, void *);
+      break;
+    default:
+      continue;
+    }
+
+    if (d.type == ARG_STRING) {
+      size_t len = s ? strlen(s) : 6;
+      if (size + sizeof(uint16_t) > LOG_ARGS_SIZE)
+	break;
+      if (len > LOG_ARGS_SIZE - size - sizeof(uint16_t))
+	len = LOG_ARGS_SIZE - size - sizeof(uint16_t);
+      uint16_t len16 = len;
+      memcpy(record->args + size, &len16, sizeof(len16));
+      memcpy(record->args + size + sizeof(len16), s ? s : "(null)", len);
+      size += sizeof(len16) + len;
+    } else {
+      if (size + 8 > LOG_ARGS_SIZE)
+	break;
+      if (d.type == ARG_DOUBLE)
+	memcpy(record->args + size, &f, 8);
+      else if (d.type == ARG_POINTER)
+	memcpy(record->args + size, &ptr, sizeof(ptr));
+      else
+	memcpy(record->args + size, &i, 8);
+      size += 8;
+    }
+  }
+  record->size = size;
+}
+
+/** Internal function that copies a string, escaping control
+ *  characters.
+ */
+static void escape_string(char *out, size_t out_size, const unsigned char *in, size_t len) {
+
+  size_t n = 0, i;
+  for (i = 0; i < len && n + 5 < out_size; i++) {
+    if (in[i] == '\r') {
+      out[n++] = '\\'; out[n++] = 'r';
+    } else if (in[i] == '\n') {
+      out[n++] = '\\'; out[n++] = 'n';
+    } else if (in[i] < 0x20 || in[i] == 0x7f || in[i] == '\\') {
+      n += sprintf(out + n, in[i] == '\\' ? "\\\\" : "\\x%02x", in[i]);
+    } else {
+      out[n++] = in[i];
+    }
+  }
+  out[n] = 0;
+}
+
+/** Internal function that formats a record as a line of the log.
+ */
+static void write_record(FILE *file, const struct log_record *record) {
+
+  char line[1024], text[LOG_ARGS_SIZE * 4 + 1];
+  const char *p = record->format;
+  size_t n = 0, size = 0;
+  struct directive d;
+
+  while (*p && n < sizeof(line) - 1) {
+    if (*p != '%') {
+      line[n++] = *p++;
+      continue;
+    }
+    p = parse_directive(p, &d);
+    int rv = 0;
+    size_t room = sizeof(line) - n;
+
+    if (d.type == ARG_LITERAL) {
+      rv = snprintf(line + n, room, "%s", d.spec);
+    } else if (d.type == ARG_STRING) {
+      uint16_t len;
+      if (size + sizeof(len) > record->size)
+	break;
+      memcpy(&len, record->args + size, sizeof(len));
+      escape_string(text, sizeof(text), record->args + size + sizeof(len), len);
+      size += sizeof(len) + len;
+      rv = snprintf(line + n, room, d.spec, text);
+    } else {
+      long long i;
+      double f;
+      void *ptr;
+      if (size + 8 > record->size)
+	break;
+      if (d.type == ARG_DOUBLE) {
+	memcpy(&f, record->args + size, 8);
+	rv = snprintf(line + n, room, d.spec, f);
+      } else if (d.type == ARG_POINTER) {
+	memcpy(&ptr, record->args + size, sizeof(ptr));
+	rv = snprintf(line + n, room, d.spec, ptr);
+      } else {
+	memcpy(&i, record->args + size, 8);
+	if (d.spec[strlen(d.spec) - 1] == 'c')
+	  rv = snprintf(line + n, room, d.spec, (int) i);
+	else
+	  rv = snprintf(line + n, room, d.spec, i);
+      }
+      size += 8;
+    }
+    if (rv > 0)
+      n += (size_t) rv < room ? (size_t) rv : room - 1;
+  }
+  if (*p)
+    n += snprintf(line + n, sizeof(line) - n, "...");
+  if (n >= sizeof(line))
+    n = sizeof(line) - 1;
+  line[n] = 0;
+
+  char stamp[32];
+  struct tm tm;
+  time_t secs = record->time_ns / 1000000000;
+  gmtime_r(&secs, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  if (record->session)
+    fprintf(file, "%s.%06luZ %-7s [%u] %s\n", stamp,
+	    (unsigned long) (record->time_ns % 1000000000) / 1000,
+	    level_names[record->level], record->session, line);
+  else
+    fprintf(file, "%s.%06luZ %-7s [-] %s\n", stamp,
+	    (unsigned long) (record->time_ns % 1000000000) / 1000,
+	    level_names[record->level], line);
+}
+
+/** Main function of the thread writing the records to the log file.
+ */
+static void *writer_main(void *arg) {
+
+  struct timespec pause = { 0, LOG_WRITER_SLEEP_MS * 1000000L };
+  unsigned long reported = 0;
+  int written = 0, stalled = 0;
+
+  while (1) {
+    struct log_record *record = &ring->slots[tail % LOG_RING_SIZE];
+    unsigned long seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+
+    if (seq == tail + 1) {
+      write_record(log_file, record);
+      __atomic_store_n(&record->seq, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+      __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+      written = 1;
+      stalled = 0;
+      continue;
+    }
+
+    // Claimed, but not filled for a long time: the process logging it
+    // is gone, or stopped. The slot is freed with compare-and-swap
+    // from the claimed value, so a process that publishes the record
+    // meanwhile keeps it, and one that publishes later finds the slot
+    // taken (see log_write)
+    if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) != tail &&
+	++stalled > LOG_STALL_POLLS) {
+      unsigned long claimed = tail;
+      stalled = 0;
+      if (__atomic_compare_exchange_n(&record->seq, &claimed, tail + LOG_RING_SIZE, 0,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+      fprintf(log_file, "log: %lu records dropped\n", dropped - reported);
+      reported = dropped;
+      written = 1;
+    }
+    if (written) {
+      fflush(log_file);
+      written = 0;
+    }
+    nanosleep(&pause, NULL);
+  }
+  return NULL;
+}
+
+/** Starts the logging subsystem: creates the ring and the thread
+ *  writing it to the log file. Must be called before processes are
+ *  forked. Messages logged before this are written directly to the
+ *  standard output.
+ *
+ *  Parameters: file: Name of the log file (appended to), or NULL for
+ *                    the standard output.
+ *              level: Most verbose level to be logged (LOG_LEVEL_*).
+ *
+ *  Returns: 0 on success, or -1 if the file, ring or thread could not
+ *           be created.
+ */
+int log_init(const char *file, int level) {
+
+  pthread_t thread;
+  unsigned long i;
+
+  log_level = level;
+  log_file = file ? fopen(file, "a") : stdout;
+  if (!log_file) {
+    perror(file);
+    return -1;
+  }
+
+  ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    perror("mmap");
+    ring = NULL;
+    return -1;
+  }
+  for (i = 0; i < LOG_RING_SIZE; i++)
+    ring->slots[i].seq = i;
+  ring->next_session = local_sessions;
+
+  if (pthread_create(&thread, NULL, writer_main, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/** Logs a message. Should be called through the log_error,
+ *  log_warning, log_info and log_debug macros, which skip disabled
+ *  levels without evaluating the arguments. Does not block; if the
+ *  ring is full, the message is lost.
+ *
+ *  Parameters: level: Level of the message (LOG_LEVEL_*).
+ *              format: printf-like format; must be a string literal
+ *                      (see log.h for the directives supported).
+ *              additional parameters based on the format.
+ */
+void log_write(int level, const char *format, ...) {
+
+  struct timespec ts;
+  struct log_record local, *record = &local;
+  unsigned long pos = 0;
+  va_list args;
+
+  if (ring) {
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while (1) {
+      record = &ring->slots[pos % LOG_RING_SIZE];
+      long diff = (long) (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - pos);
+      if (diff == 0) {
+	if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	  break;
+      } else if (diff < 0) {
+	__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+	return;
+      } else {
+	pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  record->format = format;
+  record->session = log_session;
+  record->level = level < LOG_LEVEL_ERROR ? LOG_LEVEL_ERROR :
+    level > LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level;
+  va_start(args, format);
+  encode_args(record, format, args);
+  va_end(args);
+
+  // The slot may have been skipped by the writer if this took too long
+  // (e.g., the process was stopped); the record is then lost
+  if (ring) {
+    unsigned long claimed = pos;
+    if (!__atomic_compare_exchange_n(&record->seq, &claimed, pos + 1, 0,
+				     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+  } else {
+    write_record(stdout, record);
+  }
+}
+
+/** Starts a new session in the current thread or coroutine, giving it
+ *  an ID unique among all processes sharing the ring.
+ */
+void log_session_begin(void) {
+
+  unsigned int *counter = ring ? &ring->next_session : &local_sessions;
+  log_session = __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/** Waits until the writer thread has written all records logged so
+ *  far (or a second passes). Should be called before the main process
+ *  exits.
+ */
+void log_flush(void) {
+
+  struct timespec pause = { 0, 1000000L };
+  int i;
+  if (!ring) {
+    fflush(stdout);
+    return;
+  }
+  unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  for (i = 0; i < 1000 && (long) (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) - head) < 0; i++)
+    nanosleep(&pause, NULL);
+  fflush(log_file);
+}
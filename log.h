@@ -0,0 +1,39 @@
+/* log.h
+ * Logs messages with levels and session IDs, through a ring buffer
+ * drained by a writer thread.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+// Levels, from most to least important (names differ from syslog.h)
+#define LOG_LEVEL_ERROR   0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO    2
+#define LOG_LEVEL_DEBUG   3
+
+// Most verbose level logged; messages above it cost a single compare
+extern int log_level;
+// Session of the current thread or coroutine, 0 outside sessions
+extern __thread unsigned int log_session;
+
+// The format must be a string literal: only a pointer to it is kept
+// in the record. Supported directives: d i u x X o c (with h, l, ll,
+// z), s, p, e f g, and %%; width and precision are allowed, but not *.
+#define log_message(level, ...)					\
+  do {								\
+    if ((level) <= log_level)					\
+      log_write((level), __VA_ARGS__);				\
+  } while (0)
+#define log_error(...)   log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...)    log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...)   log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+int log_init(const char *file, int level);
+void log_write(int level, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+void log_session_begin(void);
+void log_flush(void);
+
+#endif
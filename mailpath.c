@@ -0,0 +1,255 @@
+/* mailpath.c
+ * Parses the path and parameters of MAIL FROM and RCPT TO commands.
+ *
+ * Notes: The grammar follows RFC 5321, sections 4.1.2 and 4.5.3.1.
+ * The line is processed in a single pass, and the result only points
+ * into the line, so no memory is allocated and the line is not
+ * modified.
+ */
+
+#include "mailpath.h"
+
+#include <strings.h>
+
+#define MAX_PATH_LENGTH   256
+#define MAX_LOCAL_LENGTH  64
+#define MAX_DOMAIN_LENGTH 255
+
+// Character classes, combined as bits in char_class
+#define C_ATEXT    0x01 // allowed in an atom of a dot-string
+#define C_LETDIG   0x02 // letter or digit
+#define C_LDH      0x04 // letter, digit or hyphen
+#define C_QTEXT    0x08 // allowed unescaped in a quoted string
+#define C_DCONTENT 0x10 // allowed in an address literal
+#define C_VALUE    0x20 // allowed in a parameter value
+
+#define CLASS(c) (char_class[(unsigned char) (c)])
+
+static const unsigned char char_class[256] = {
+  [' ']             = C_QTEXT,
+  ['!']             = C_ATEXT | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['"']             = C_DCONTENT | C_VALUE,
+  ['#' ... '\'']    = C_ATEXT | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['(' ... ')']     = C_QTEXT | C_DCONTENT | C_VALUE,
+  ['*' ... '+']     = C_ATEXT | C_QTEXT | C_DCONTENT | C_VALUE,
+  [',']             = C_QTEXT | C_DCONTENT | C_VALUE,
+  ['-']             = C_ATEXT | C_LDH | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['.']             = C_QTEXT | C_DCONTENT | C_VALUE,
+  ['/']             = C_ATEXT | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['0' ... '9']     = C_ATEXT | C_LETDIG | C_LDH | C_QTEXT | C_DCONTENT | C_VALUE,
+  [':' ... '<']     = C_QTEXT | C_DCONTENT | C_VALUE,
+  ['=']             = C_ATEXT | C_QTEXT | C_DCONTENT,
+  ['>']             = C_QTEXT | C_DCONTENT | C_VALUE,
+  ['?']             = C_ATEXT | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['@']             = C_QTEXT | C_DCONTENT | C_VALUE,
+  ['A' ... 'Z']     = C_ATEXT | C_LETDIG | C_LDH | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['[']             = C_QTEXT | C_VALUE,
+  ['\\']            = C_VALUE,
+  [']']             = C_QTEXT | C_VALUE,
+  ['^' ... '`']     = C_ATEXT | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['a' ... 'z']     = C_ATEXT | C_LETDIG | C_LDH | C_QTEXT | C_DCONTENT | C_VALUE,
+  ['{' ... '~']     = C_ATEXT | C_QTEXT | C_DCONTENT | C_VALUE,
+};
+
+/** Internal function that skips a domain name (sub-domains made of
+ *  letters, digits and hyphens, separated by dots).
+ *
+ *  Returns: pointer to the first character after the domain, or NULL
+ *           if the domain is malformed.
+ */
+static const char *skip_domain(const char *p, const char *end) {
+
+  while (1) {
+    // A sub-domain starts with a letter or digit...
+    if (p >= end || !(CLASS(*p) & C_LETDIG))
+      return NULL;
+    while (p < end && (CLASS(*p) & C_LDH))
+      p++;
+    // ... and doesn't end with a hyphen
+    if (p[-1] == '-')
+      return NULL;
+    if (p < end && *p == '.') {
+      p++;
+      continue;
+    }
+    return p;
+  }
+}
+
+/** Internal function that parses the ESMTP parameters following a
+ *  path, each preceded by one or more spaces.
+ *
+ *  Returns: MAIL_PATH_OK on success, or an error code otherwise.
+ */
+static int parse_params(const char *p, const char *end, struct mail_path *path) {
+
+  path->param_count = 0;
+
+  while (p < end) {
+
+    if (*p != ' ')
+      return path->param_count ? MAIL_PATH_BAD_PARAM : MAIL_PATH_SYNTAX;
+    while (p < end && *p == ' ')
+      p++;
+    if (p == end)
+      break;
+
+    if (path->param_count == MAX_PATH_PARAMS)
+      return MAIL_PATH_MANY_PARAMS;
+    struct mail_path_param *param = &path->params[path->param_count++];
+
+    // esmtp-keyword = (ALPHA / DIGIT) *(ALPHA / DIGIT / "-")
+    if (!(CLASS(*p) & C_LETDIG))
+      return MAIL_PATH_BAD_PARAM;
+    param->key.start = p;
+    while (p < end && (CLASS(*p) & C_LDH))
+      p++;
+    param->key.len = p - param->key.start;
+
+    // esmtp-value = 1*(%d33-60 / %d62-126)
+    param->value.start = p;
+    param->value.len = 0;
+    if (p < end && *p == '=') {
+      param->value.start = ++p;
+      while (p < end && (CLASS(*p) & C_VALUE))
+	p++;
+      param->value.len = p - param->value.start;
+      if (!param->value.len)
+	return MAIL_PATH_BAD_PARAM;
+    }
+  }
+
+  return MAIL_PATH_OK;
+}
+
+/** Parses the argument of a MAIL FROM or RCPT TO command: a path in
+ *  angle brackets, optionally with a source route and followed by
+ *  ESMTP parameters. The parts found are returned as spans pointing
+ *  into the line; the line itself is not modified, and does not need
+ *  to be null-terminated. A trailing CRLF is ignored.
+ *
+ *  Parameters: line: Text following "MAIL FROM:" or "RCPT TO:".
+ *              len: Number of bytes in line.
+ *              flags: MAIL_PATH_NULL to accept "<>", and/or
+ *                     MAIL_PATH_LOCAL to accept mailboxes without a
+ *                     domain. Without MAIL_PATH_LOCAL, only
+ *                     "<Postmaster>" may omit the domain.
+ *              path: Object where the parts of the path are stored.
+ *
+ *  Returns: MAIL_PATH_OK if the path is well-formed, or one of the
+ *           MAIL_PATH_* error codes otherwise.
+ */
+int parse_mail_path(const char *line, size_t len, int flags, struct mail_path *path) {
+
+  const char *p = line, *end = line + len;
+
+  path->route.start = path->mailbox.start = path->local.start = path->domain.start = line;
+  path->route.len = path->mailbox.len = path->local.len = path->domain.len = 0;
+  path->param_count = 0;
+
+  if (end > p && end[-1] == '\n') end--;
+  if (end > p && end[-1] == '\r') end--;
+
+  if (p >= end || *p++ != '<')
+    return MAIL_PATH_SYNTAX;
+
+  // Null path, used as reverse-path for notifications
+  if (p < end && *p == '>') {
+    if (!(flags & MAIL_PATH_NULL))
+      return MAIL_PATH_SYNTAX;
+    return parse_params(p + 1, end, path);
+  }
+
+  // Source route: "@" Domain *( "," "@" Domain ) ":"
+  if (p < end && *p == '@') {
+    path->route.start = p;
+    while (1) {
+      if (p >= end || *p != '@' || !(p = skip_domain(p + 1, end)))
+	return MAIL_PATH_SYNTAX;
+      if (p < end && *p == ',') {
+	p++;
+	continue;
+      }
+      break;
+    }
+    path->route.len = p - path->route.start;
+    if (p >= end || *p++ != ':')
+      return MAIL_PATH_SYNTAX;
+  }
+
+  // Local part: a quoted string or atoms separated by dots
+  path->mailbox.start = path->local.start = p;
+  if (p < end && *p == '"') {
+    p++;
+    while (p < end && *p != '"') {
+      if (*p == '\\') {
+	p++;
+	if (p >= end || (unsigned char) *p < 32 || (unsigned char) *p > 126)
+	  return MAIL_PATH_SYNTAX;
+	p++;
+      } else if (CLASS(*p) & C_QTEXT) {
+	p++;
+      } else {
+	return MAIL_PATH_SYNTAX;
+      }
+    }
+    if (p++ >= end)
+      return MAIL_PATH_SYNTAX;
+  } else {
+    while (1) {
+      const char *atom = p;
+      while (p < end && (CLASS(*p) & C_ATEXT))
+	p++;
+      if (p == atom)
+	return MAIL_PATH_SYNTAX;
+      if (p < end && *p == '.') {
+	p++;
+	continue;
+      }
+      break;
+    }
+  }
+  path->local.len = p - path->local.start;
+  if (path->local.len > MAX_LOCAL_LENGTH)
+    return MAIL_PATH_TOO_LONG;
+
+  // Domain: a domain name or an address literal in brackets
+  if (p < end && *p == '@') {
+    path->domain.start = ++p;
+    if (p < end && *p == '[') {
+      p++;
+      while (p < end && (CLASS(*p) & C_DCONTENT))
+	p++;
+      if (p >= end || *p != ']' || p[-1] == '[')
+	return MAIL_PATH_SYNTAX;
+      p++;
+    } else if (!(p = skip_domain(p, end))) {
+      return MAIL_PATH_SYNTAX;
+    }
+    path->domain.len = p - path->domain.start;
+    if (path->domain.len > MAX_DOMAIN_LENGTH)
+      return MAIL_PATH_TOO_LONG;
+  } else if (!(flags & MAIL_PATH_LOCAL) && !span_equals(path->local, "postmaster")) {
+    return MAIL_PATH_SYNTAX;
+  }
+  path->mailbox.len = p - path->mailbox.start;
+
+  if (p >= end || *p++ != '>')
+    return MAIL_PATH_SYNTAX;
+  if (p - line > MAX_PATH_LENGTH)
+    return MAIL_PATH_TOO_LONG;
+
+  return parse_params(p, end, path);
+}
+
+/** Compares a span with a string, ignoring case.
+ *
+ *  Parameters: span: Span to be compared.
+ *              str: Null-terminated string to be compared.
+ *
+ *  Returns: a non-zero value if the span and the string are equal,
+ *           or zero otherwise.
+ */
+int span_equals(struct span span, const char *str) {
+  return strlen(str) == span.len && !strncasecmp(span.start, str, span.len);
+}
@@ -0,0 +1,47 @@
+/* mailpath.h
+ * Parses the path and parameters of MAIL FROM and RCPT TO commands.
+ */
+
+#ifndef _MAIL_PATH_H_
+#define _MAIL_PATH_H_
+
+#include <string.h>
+
+// Maximum number of ESMTP parameters after a path
+#define MAX_PATH_PARAMS 8
+
+// Flags for parse_mail_path
+#define MAIL_PATH_NULL  0x1 // accept the null path "<>" (reverse-path)
+#define MAIL_PATH_LOCAL 0x2 // accept a mailbox without a domain ("<user>")
+
+// Results of parse_mail_path
+#define MAIL_PATH_OK          0
+#define MAIL_PATH_SYNTAX      1 // path is malformed
+#define MAIL_PATH_TOO_LONG    2 // path or one of its parts is too long
+#define MAIL_PATH_BAD_PARAM   3 // parameter list is malformed
+#define MAIL_PATH_MANY_PARAMS 4 // more than MAX_PATH_PARAMS parameters
+
+// A sequence of bytes inside the parsed line (not null-terminated)
+struct span {
+  const char *start;
+  size_t len;
+};
+
+struct mail_path_param {
+  struct span key;
+  struct span value;   // empty if the parameter has no "=value"
+};
+
+struct mail_path {
+  struct span route;   // source route ("@a,@b"), empty if not present
+  struct span mailbox; // local part, "@" and domain; empty for "<>"
+  struct span local;   // local part, including quotes if quoted
+  struct span domain;  // domain or address literal, may be empty
+  unsigned int param_count;
+  struct mail_path_param params[MAX_PATH_PARAMS];
+};
+
+int parse_mail_path(const char *line, size_t len, int flags, struct mail_path *path);
+int span_equals(struct span span, const char *str);
+
+#endif
@@ -5,6 +5,9 @@
  */
 
 #include "mailuser.h"
+#include "metrics.h"
+#include "probes.h"
+#include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,10 +19,19 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #define USER_FILE_NAME "users.txt"
 #define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_INDEX_SUFFIX ".idx"
+
+#define USER_FILTER_BITS_PER_USER 10
+#define USER_FILTER_HASHES 7
 
 struct user_list {
   char *user;
@@ -37,33 +49,210 @@ struct mail_list {
   struct mail_list *next;
 };
 
+// Bloom filter with the names of all users in the users file, used
+// to reject unknown users without reading the file. The filter may
+// report false positives, but never false negatives.
+struct user_filter {
+  uint64_t *bits;
+  size_t mask;       // number of bits in the filter, minus one
+  int users;         // number of users added to the filter
+  // users file the filter was built from
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+};
+
+// Current filter; replaced (under the write lock) when the users file changes
+static struct user_filter *user_filter = NULL;
+static pthread_rwlock_t user_filter_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Last time the users file was checked for changes
+static time_t user_filter_checked = 0;
+// Incremented every time the users file changes
+static unsigned int user_file_generation = 0;
+
+// Users file, kept open between lookups by each thread
+static __thread FILE *user_file = NULL;
+static __thread unsigned int user_file_opened_generation = 0;
+
 /** Internal function that opens the users file list. If file has been
- *  opened before, rewinds the pointer to beginning of the file.
+ *  opened before, rewinds the pointer to beginning of the file. Each
+ *  thread has its own file pointer, which is reopened if the users
+ *  file changed since it was opened.
  * 
  *  Returns: file pointer for users file, or NULL if file cannot be opened.
  */
 static FILE *user_file_list(void) {
 
-  static FILE *file_ptr = NULL;
-  if (!file_ptr)
-    file_ptr = fopen(USER_FILE_NAME, "r+");
-  if (file_ptr)
-    rewind(file_ptr);
-  return file_ptr;
+  unsigned int generation = __atomic_load_n(&user_file_generation, __ATOMIC_ACQUIRE);
+  if (user_file && user_file_opened_generation != generation) {
+    fclose(user_file);
+    user_file = NULL;
+  }
+  if (!user_file) {
+    user_file = fopen(USER_FILE_NAME, "r+");
+    user_file_opened_generation = generation;
+  }
+  if (user_file)
+    rewind(user_file);
+  return user_file;
 }
 
-/** Checks if the user name is valid. If password is informed, also
- *  checks if the password matches the user name.
- *  
- *  Parameters: username: Non-NULL name of the user to check.
- *              password: Unencrypted password to check. If NULL, will
- *                        check only the user name.
+/** Internal function that computes the hash of a user name used by
+ *  the user filter (64-bit FNV-1a). User names are compared without
+ *  regard to case, so the hash is computed on the lowercase name.
+ */
+static uint64_t user_hash(const char *username) {
+  
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  while (*username) {
+    hash ^= (unsigned char) tolower((unsigned char) *username++);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/** Internal function that adds a user name to a user filter, or
+ *  checks if it is in the filter. Bit positions are derived from two
+ *  halves of a single hash (Kirsch-Mitzenmacher double hashing).
  *
- *  Returns: a non-zero value if the user name is valid and the
- *           password matches the user name, if provided; or zero
- *           otherwise.
+ *  Returns: If add is zero, returns zero if the user is definitely
+ *           not in the filter, or a non-zero value otherwise.
  */
-int is_valid_user(const char *username, const char *password) {
+static int user_filter_probe(struct user_filter *filter, const char *username, int add) {
+  
+  uint64_t hash = user_hash(username);
+  uint32_t h1 = (uint32_t) hash, h2 = (uint32_t) (hash >> 32) | 1;
+  int i;
+  
+  for (i = 0; i < USER_FILTER_HASHES; i++) {
+    size_t bit = (h1 + (size_t) i * h2) & filter->mask;
+    if (add)
+      filter->bits[bit / 64] |= 1ULL << (bit % 64);
+    else if (!(filter->bits[bit / 64] & (1ULL << (bit % 64))))
+      return 0;
+  }
+  return 1;
+}
+
+/** Internal function that does the work of refresh_user_filter, which only
+ *  adds timing.
+ */
+static int build_user_filter(void) {
+  
+  struct stat file_stat;
+  struct user_filter *filter, *old;
+  char user_file_name[MAX_USERNAME_SIZE+1];
+  char pw_file[MAX_PASSWORD_SIZE+1];
+  size_t bits = 64;
+  int users = 0, unchanged = 0;
+  
+  __atomic_store_n(&user_filter_checked, time(NULL), __ATOMIC_RELAXED);
+  if (stat(USER_FILE_NAME, &file_stat) < 0)
+    return -1;
+  
+  pthread_rwlock_rdlock(&user_filter_lock);
+  if (user_filter && file_stat.st_ino == user_filter->ino &&
+      file_stat.st_size == user_filter->size && file_stat.st_mtime == user_filter->mtime) {
+    unchanged = 1;
+    users = user_filter->users;
+  }
+  pthread_rwlock_unlock(&user_filter_lock);
+  if (unchanged)
+    return users;
+  
+  // The new filter is built from a private file pointer, without
+  // holding the lock, so lookups are not blocked meanwhile
+  FILE *file_ptr = fopen(USER_FILE_NAME, "r");
+  if (!file_ptr) return -1;
+  
+  while (fscanf(file_ptr, "%s%s", user_file_name, pw_file) == 2)
+    users++;
+  while (bits < (size_t) users * USER_FILTER_BITS_PER_USER)
+    bits *= 2;
+  
+  filter = malloc(sizeof(struct user_filter));
+  if (filter) {
+    filter->bits = calloc(bits / 64, sizeof(uint64_t));
+    if (!filter->bits) {
+      free(filter);
+      filter = NULL;
+    }
+  }
+  // Without memory for the new filter, the old one can't be kept,
+  // since it would reject users added since; lookups read the file
+  // until the filter is rebuilt, on a later refresh
+  if (!filter) {
+    fclose(file_ptr);
+    pthread_rwlock_wrlock(&user_filter_lock);
+    old = user_filter;
+    user_filter = NULL;
+    __atomic_add_fetch(&user_file_generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&user_filter_lock);
+    if (old) {
+      free(old->bits);
+      free(old);
+    }
+    return users;
+  }
+  filter->mask = bits - 1;
+  filter->users = users;
+  filter->ino = file_stat.st_ino;
+  filter->size = file_stat.st_size;
+  filter->mtime = file_stat.st_mtime;
+  
+  rewind(file_ptr);
+  while (fscanf(file_ptr, "%s%s", user_file_name, pw_file) == 2)
+    user_filter_probe(filter, user_file_name, 1);
+  fclose(file_ptr);
+  
+  pthread_rwlock_wrlock(&user_filter_lock);
+  old = user_filter;
+  user_filter = filter;
+  // File changed, so open file pointers may no longer be the current one
+  __atomic_add_fetch(&user_file_generation, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&user_filter_lock);
+  
+  if (old) {
+    free(old->bits);
+    free(old);
+  }
+  return users;
+}
+
+/** Builds the filter used to quickly reject unknown user names, if it
+ *  was not built yet or if the users file changed since it was
+ *  built. The filter is also checked automatically (at most once per
+ *  second) by is_valid_user, but calling this function at startup
+ *  avoids the cost of building it in the first lookup. The filter is
+ *  shared by all threads, and may be rebuilt while other threads are
+ *  using it.
+ *
+ *  Returns: number of users in the filter, or -1 if the users file
+ *           cannot be read.
+ */
+int refresh_user_filter(void) {
+  
+  struct metrics_timer timer = {-1, 0};
+  metrics_start(&timer, METRIC_STORAGE_REFRESH);
+  int rv = build_user_filter();
+  metrics_stop(&timer);
+  return rv;
+}
+
+/** Internal function that does the work of is_valid_user, which only
+ *  adds timing.
+ */
+static int lookup_user(const char *username, const char *password) {
+  
+  if (time(NULL) != __atomic_load_n(&user_filter_checked, __ATOMIC_RELAXED))
+    refresh_user_filter();
+  
+  // Unknown users are rejected without reading the users file
+  pthread_rwlock_rdlock(&user_filter_lock);
+  int maybe_valid = !user_filter || user_filter_probe(user_filter, username, 0);
+  pthread_rwlock_unlock(&user_filter_lock);
+  if (!maybe_valid)
+    return 0;
   
   FILE *file_ptr = user_file_list();
   if (!file_ptr) return 0;
@@ -79,6 +268,26 @@ int is_valid_user(const char *username, const char *password) {
   return 0;
 }
 
+/** Checks if the user name is valid. If password is informed, also
+ *  checks if the password matches the user name.
+ *  
+ *  Parameters: username: Non-NULL name of the user to check.
+ *              password: Unencrypted password to check. If NULL, will
+ *                        check only the user name.
+ *
+ *  Returns: a non-zero value if the user name is valid and the
+ *           password matches the user name, if provided; or zero
+ *           otherwise.
+ */
+int is_valid_user(const char *username, const char *password) {
+  
+  struct metrics_timer timer = {-1, 0};
+  metrics_start(&timer, METRIC_STORAGE_LOOKUP);
+  int rv = lookup_user(username, password);
+  metrics_stop(&timer);
+  return rv;
+}
+
 /** Creates a new, empty, list of users.
  * 
  *  Returns: A user_list_t object with no users.
@@ -102,6 +311,29 @@ void add_user_to_list(user_list_t *list, const char *username) {
   *list = new_list;
 }
 
+/** Adds a user name to a list of users, allocating the list item and
+ *  the copy of the name from an arena. Such a list is freed with the
+ *  arena, and must not be passed to destroy_user_list.
+ *  
+ *  Parameters: list: address of the list of users to be modified.
+ *              username: Name of the user to be added (copied).
+ *              arena: Arena where the item and the name are allocated.
+ *
+ *  Returns: 0 on success, or -1 if there is no memory (the list is
+ *           not changed).
+ */
+int add_user_to_arena_list(user_list_t *list, const char *username, arena_t arena) {
+  user_list_t new_list = arena_alloc(arena, sizeof(struct user_list));
+  if (!new_list)
+    return -1;
+  new_list->user = arena_strdup(arena, username);
+  if (!new_list->user)
+    return -1;
+  new_list->next = *list;
+  *list = new_list;
+  return 0;
+}
+
 /** Frees all memory used by a list of users.
  *
  * Parameters: list: list of users to be freed.
@@ -115,6 +347,73 @@ void destroy_user_list(user_list_t list) {
   }
 }
 
+/** Prepares an empty mail index, to be filled by mail_index_append
+ *  as the message contents are received.
+ *
+ *  Parameters: index: Index object to be initialized.
+ */
+void mail_index_init(struct mail_index *index) {
+  memset(index, 0, sizeof(*index));
+}
+
+/** Updates a mail index with a block of the message contents. Blocks
+ *  must be provided in the same order they are stored in the message
+ *  file, but do not need to be aligned to line boundaries.
+ *
+ *  Parameters: index: Index object to be updated.
+ *              buf: Message contents following the data already
+ *                   added to the index.
+ *              len: Number of bytes in buf.
+ */
+void mail_index_append(struct mail_index *index, const char *buf, size_t len) {
+  
+  const char *end = buf + len;
+  
+  while (buf < end) {
+    
+    const char *eol = memchr(buf, '\n', end - buf);
+    size_t seg = eol ? (size_t) (eol - buf + 1) : (size_t) (end - buf);
+    
+    // Only header lines need to be checked for the blank separator line
+    if (!index->header_end && !index->line_has_text) {
+      const char *c;
+      for (c = buf; c < buf + seg; c++)
+	if (*c != '\r' && *c != '\n') {
+	  index->line_has_text = 1;
+	  break;
+	}
+    }
+    
+    index->size += seg;
+    buf += seg;
+    if (!eol) break;
+    
+    if (!index->header_end) {
+      if (!index->line_has_text)
+	index->header_end = index->size;
+    } else if (index->line_count < MAIL_INDEX_LINES) {
+      index->line_end[index->line_count++] = index->size;
+    }
+    index->line_has_text = 0;
+  }
+}
+
+/** Completes a mail index once the entire message has been
+ *  appended. A message with no blank line is treated as consisting
+ *  only of headers.
+ *
+ *  Parameters: index: Index object to be completed.
+ */
+void mail_index_finish(struct mail_index *index) {
+  if (!index->header_end)
+    index->header_end = index->size;
+  // A last body line without a line feed still counts as a line
+  if (index->line_has_text && index->line_count < MAIL_INDEX_LINES &&
+      index->size > index->header_end)
+    index->line_end[index->line_count++] = index->size;
+  index->line_has_text = 0;
+}
+
 /** Saves a new email message into the mail storage for a list of
  *  users. This function uses hard links to create the files based on
  *  an existing temporary file. It assumes the temporary file is in
@@ -122,17 +421,37 @@ void destroy_user_list(user_list_t list) {
  *  the temporary file in a local directory (where the executable is
  *  running) is enough for this to work.
  *
+ *  If an index is provided, it is stored next to each message file
+ *  (with the same name plus an index suffix), so that it can be used
+ *  later by get_mail_item_top_size.
+ *
  *  Parameters: basefile: Name of a temporary file containing the
  *                        contents of the email message.
  *              users: List of recipient users to the message.
+ *              index: Index of the message contents, or NULL if not
+ *                     available.
  */
-void save_user_mail(const char *basefile, user_list_t users) {
+void save_user_mail(const char *basefile, user_list_t users, const struct mail_index *index) {
   
+  struct metrics_timer timer = {-1, 0};
+  metrics_start(&timer, METRIC_STORAGE_SAVE);
   char mail_file[NAME_MAX + 1];
+  char index_base[NAME_MAX + sizeof(MAIL_INDEX_SUFFIX)];
+  char index_file[NAME_MAX + sizeof(MAIL_INDEX_SUFFIX)];
+  int has_index = 0, recipients = 0;
   
   // Create base directory if it doesn't exist yet (error ignored)
   mkdir(MAIL_BASE_DIRECTORY, 0777);
   
+  if (index) {
+    snprintf(index_base, sizeof(index_base), "%s" MAIL_INDEX_SUFFIX, basefile);
+    int index_fd = open(index_base, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (index_fd >= 0) {
+      has_index = write(index_fd, index, sizeof(*index)) == sizeof(*index);
+      close(index_fd);
+    }
+  }
+  
   for (; users; users = users->next) {
     
     // Create recipient directory if it doesn't exist yet (error ignored)
@@ -144,22 +463,31 @@ void save_user_mail(const char *basefile, user_list_t users) {
     do {
       sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s/%d" MAIL_FILE_SUFFIX, users->user, i++);
     } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+    metrics_add(COUNTER_MESSAGES_STORED, 1);
+    recipients++;
+    
+    // Index is optional, so errors are ignored; a stale index left
+    // by a previously deleted message is replaced.
+    if (has_index) {
+      snprintf(index_file, sizeof(index_file), "%s" MAIL_INDEX_SUFFIX, mail_file);
+      unlink(index_file);
+      link(index_base, index_file);
+    }
   }
+  
+  if (index) {
+    unlink(index_base);
+    metrics_add(COUNTER_BYTES_STORED, index->size);
+  }
+  PROBE4(deliver, log_session, recipients, index ? index->size : 0,
+	 metrics_now() - timer.start);
+  metrics_stop(&timer);
 }
 
-/** Creates a list of email messages for a username, based on existing
- *  email files created using save_user_mail (or equivalent). These
- *  messages only load the file names and sizes, the messages
- *  themselves are not kept in memory. If the user does not exist or
- *  does not have any messages, an empty list is returned.
- *
- *  Parameters: username: Name of the user whose email messages should
- *                        be retrieved.
- *
- *  Returns: A mail_list_t object containing a list of email messages
- *           available for the provided username.
+/** Internal function that does the work of load_user_mail, which only
+ *  adds timing.
  */
-mail_list_t load_user_mail(const char *username) {
+static mail_list_t read_user_mail(const char *username) {
   
   char filename[NAME_MAX + 1];
   sprintf(filename, MAIL_BASE_DIRECTORY "/%s", username);
@@ -197,20 +525,55 @@ mail_list_t load_user_mail(const char *username) {
   return list;
 }
 
+/** Creates a list of email messages for a username, based on existing
+ *  email files created using save_user_mail (or equivalent). These
+ *  messages only load the file names and sizes, the messages
+ *  themselves are not kept in memory. If the user does not exist or
+ *  does not have any messages, an empty list is returned.
+ *
+ *  Parameters: username: Name of the user whose email messages should
+ *                        be retrieved.
+ *
+ *  Returns: A mail_list_t object containing a list of email messages
+ *           available for the provided username.
+ */
+mail_list_t load_user_mail(const char *username) {
+  
+  struct metrics_timer timer = {-1, 0};
+  metrics_start(&timer, METRIC_STORAGE_LOAD);
+  mail_list_t rv = read_user_mail(username);
+  PROBE5(mailbox_load, log_session, username, get_mail_count(rv),
+	 get_mail_list_size(rv), metrics_now() - timer.start);
+  metrics_stop(&timer);
+  return rv;
+}
+
 /** Frees all memory used by a list of emails. Also deletes any files
  *  marked to be deleted.
  *
  *  Parameters: list: List of emails to be deleted.
  */
 void destroy_mail_list(mail_list_t list) {
+  
+  unsigned int deleted = 0;
+  size_t deleted_size = 0;
   while (list) {
     
-    if (list->item.deleted) unlink(list->item.file_name);
+    if (list->item.deleted) {
+      deleted++;
+      deleted_size += list->item.file_size;
+      char index_file[NAME_MAX + sizeof(MAIL_INDEX_SUFFIX)];
+      snprintf(index_file, sizeof(index_file), "%s" MAIL_INDEX_SUFFIX, list->item.file_name);
+      unlink(list->item.file_name);
+      unlink(index_file);
+    }
     
     mail_list_t next = list->next;
     free(list);
     list = next;
   }
+  if (deleted)
+    PROBE3(expunge, log_session, deleted, deleted_size);
 }
 
 /** Returns the number of email messages available in a list of
@@ -298,6 +661,114 @@ const char *get_mail_item_filename(mail_item_t item) {
   return item->file_name;
 }
 
+/** Internal function that finds the end of a number of lines in a
+ *  file, starting at a specific offset.
+ *
+ *  Returns: offset just past the last requested line, or the file
+ *           size if the file has fewer lines than requested.
+ */
+static size_t skip_lines(int file_fd, off_t offset, unsigned int lines, size_t file_size) {
+  
+  char buf[4096];
+  ssize_t rv;
+  
+  while (lines > 0 && (rv = pread(file_fd, buf, sizeof(buf), offset)) > 0) {
+    char *c = buf, *end = buf + rv;
+    while (lines > 0 && (c = memchr(c, '\n', end - c)) != NULL) {
+      lines--;
+      c++;
+    }
+    if (!lines)
+      return offset + (c - buf);
+    offset += rv;
+  }
+  return file_size;
+}
+
+/** Internal function that does the work of get_mail_item_top_size, which only
+ *  adds timing.
+ */
+static size_t find_top_size(mail_item_t item, unsigned int lines) {
+  
+  char index_file[NAME_MAX + sizeof(MAIL_INDEX_SUFFIX)];
+  struct mail_index index;
+  int index_fd, file_fd, valid = 0;
+  size_t rv;
+  
+  snprintf(index_file, sizeof(index_file), "%s" MAIL_INDEX_SUFFIX, item->file_name);
+  index_fd = open(index_file, O_RDONLY);
+  if (index_fd >= 0) {
+    valid = read(index_fd, &index, sizeof(index)) == sizeof(index) &&
+      index.size == item->file_size;
+    close(index_fd);
+  }
+  
+  if (valid) {
+    if (lines == 0)
+      return index.header_end;
+    if (lines <= index.line_count)
+      return index.line_end[lines - 1];
+    // All body lines fit in the index, so the whole message is needed
+    if (index.line_count < MAIL_INDEX_LINES)
+      return index.size;
+  }
+  
+  file_fd = open(item->file_name, O_RDONLY);
+  if (file_fd < 0)
+    return 0;
+  
+  // Index is not usable, so rebuild the indexed part from the file
+  if (!valid) {
+    char buf[4096];
+    ssize_t len;
+    mail_index_init(&index);
+    while ((len = read(file_fd, buf, sizeof(buf))) > 0) {
+      mail_index_append(&index, buf, len);
+      if (index.header_end &&
+	  (index.line_count >= lines || index.line_count == MAIL_INDEX_LINES))
+	break;
+    }
+    // Trailing partial line only counts if the whole file was read
+    if (len <= 0)
+      mail_index_finish(&index);
+  }
+  
+  if (lines == 0)
+    rv = index.header_end;
+  else if (lines <= index.line_count)
+    rv = index.line_end[lines - 1];
+  else if (index.line_count < MAIL_INDEX_LINES)
+    rv = item->file_size;
+  else
+    rv = skip_lines(file_fd, index.line_end[MAIL_INDEX_LINES - 1],
+		    lines - MAIL_INDEX_LINES, item->file_size);
+  
+  close(file_fd);
+  return rv;
+}
+
+/** Returns the number of bytes at the start of an email message that
+ *  make up its headers, the blank line separating headers from body,
+ *  and the first lines of the body, as used by the POP3 TOP
+ *  command. Uses the index saved at delivery time if available; falls
+ *  back to scanning the message otherwise (e.g., if the index is
+ *  missing or more lines are requested than were indexed).
+ *
+ *  Parameters: item: Email message to be assessed.
+ *              lines: Number of body lines to include.
+ *
+ *  Returns: Number of bytes, from the start of the message file, to
+ *           be sent to the client.
+ */
+size_t get_mail_item_top_size(mail_item_t item, unsigned int lines) {
+  
+  struct metrics_timer timer = {-1, 0};
+  metrics_start(&timer, METRIC_STORAGE_TOP);
+  size_t rv = find_top_size(item, lines);
+  metrics_stop(&timer);
+  return rv;
+}
+
 /** Marks a message as deleted in the internal email list. Does not
  *  actually delete the email contents, as a reset call may still
  *  recover the email message. The message is only deleted when the
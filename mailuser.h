@@ -7,22 +7,45 @@
 #ifndef _MAILUSER_H_
 #define _MAILUSER_H_
 
+#include "arena.h"
+
 #include <stdio.h>
 
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
 
+// Number of body lines whose offsets are recorded in a mail index
+#define MAIL_INDEX_LINES 64
+
 typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
 
+/* Byte offsets into a stored message, captured while the message is
+ * being received so that partial retrievals (e.g., POP3 TOP) can be
+ * served without scanning the message again.
+ */
+struct mail_index {
+  size_t size;                        // bytes seen so far
+  size_t header_end;                  // offset just past the blank line ending the headers
+  unsigned int line_count;            // number of entries in line_end
+  size_t line_end[MAIL_INDEX_LINES];  // offset just past each of the first body lines
+  unsigned int line_has_text:1;       // current line has something other than CR/LF
+};
+
+int refresh_user_filter(void);
 int is_valid_user(const char *username, const char *password);
 
 user_list_t create_user_list(void);
 void add_user_to_list(user_list_t *list, const char *username);
+int add_user_to_arena_list(user_list_t *list, const char *username, arena_t arena);
 void destroy_user_list(user_list_t list);
 
-void save_user_mail(const char *basefile, user_list_t users);
+void mail_index_init(struct mail_index *index);
+void mail_index_append(struct mail_index *index, const char *buf, size_t len);
+void mail_index_finish(struct mail_index *index);
+
+void save_user_mail(const char *basefile, user_list_t users, const struct mail_index *index);
 mail_list_t load_user_mail(const char *username);
 
 void destroy_mail_list(mail_list_t list);
@@ -33,6 +56,7 @@ unsigned int reset_mail_list_deleted_flag(mail_list_t list);
 
 size_t get_mail_item_size(mail_item_t item);
 const char *get_mail_item_filename(mail_item_t item);
+size_t get_mail_item_top_size(mail_item_t item, unsigned int lines);
 void mark_mail_item_deleted(mail_item_t item);
 
 #endif
@@ -0,0 +1,526 @@
+/* metrics.c
+ * Keeps latency histograms and counters of the server, shared by all
+ * its processes, and exports them in the Prometheus text format.
+ *
+ * Notes: Histograms are bucketed as in HdrHistogram: values (in
+ * microseconds) below 2^HDR_SUB_BITS have a bucket each, and each
+ * power of two above is split into 2^HDR_SUB_BITS buckets of equal
+ * width, so any value is known within 1/2^HDR_SUB_BITS (6.25%) from
+ * a microsecond to hours, with a few hundred counters. Histograms and
+ * counters are kept in shared memory created before any process is
+ * forked, and only updated with atomic adds, so sessions in forked
+ * processes, pool threads and the reactor record to the same
+ * histograms without ever waiting for each other. Nothing is kept
+ * unless the metrics are exported, so timing costs a single compare
+ * otherwise, unless the probes of probes.h are built in: timers then
+ * always read the clock, for the latency passed to the probes.
+ *
+ * A thread in the main process serves the metrics on the admin
+ * socket: a Unix socket, or a TCP port on the loopback address.
+ * Clients sending an HTTP request (e.g., Prometheus) get an HTTP
+ * reply, others (e.g., nc) just get the text. Histograms are exported
+ * with fixed bucket bounds, so rates can be aggregated by Prometheus,
+ * along with quantiles since the start of the server computed from
+ * the full histograms.
+ */
+
+#define _GNU_SOURCE // for accept4 and open_memstream
+
+#include "metrics.h"
+#include "log.h"
+#include "probes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define HDR_SUB_BITS 4
+#define HDR_SUB_BUCKETS (1 << HDR_SUB_BITS)
+// Values of 2^(HDR_MAX_SHIFT + HDR_SUB_BITS + 1) microseconds (about
+// 19 hours) or more are counted in the last bucket
+#define HDR_MAX_SHIFT 32
+#define HDR_BUCKETS ((HDR_MAX_SHIFT + 2) * HDR_SUB_BUCKETS)
+// Time the admin thread waits for a request, in milliseconds
+#define ADMIN_REQUEST_TIMEOUT_MS 1000
+// Time between checks for metrics_stop_serving, in milliseconds
+#define ADMIN_POLL_MS 200
+
+struct histogram {
+  uint64_t sum;                 // microseconds
+  uint64_t buckets[HDR_BUCKETS];
+};
+
+struct metrics_table {
+  struct histogram histograms[METRIC_HISTOGRAMS];
+  uint64_t counters[METRIC_COUNTERS];
+};
+
+// Families of histograms in the export
+#define FAMILY_COMMAND 0
+#define FAMILY_STORAGE 1
+
+static const struct {
+  int family;
+  int protocol;                 // for commands
+  const char *name;             // command or storage call
+} histogram_info[METRIC_HISTOGRAMS] = {
+  [METRIC_SMTP_GREETING]   = { FAMILY_COMMAND, METRICS_SMTP, "greeting" },
+  [METRIC_SMTP_HELO]       = { FAMILY_COMMAND, METRICS_SMTP, "helo" },
+  [METRIC_SMTP_EHLO]       = { FAMILY_COMMAND, METRICS_SMTP, "ehlo" },
+  [METRIC_SMTP_MAIL]       = { FAMILY_COMMAND, METRICS_SMTP, "mail" },
+  [METRIC_SMTP_RCPT]       = { FAMILY_COMMAND, METRICS_SMTP, "rcpt" },
+  [METRIC_SMTP_DATA]       = { FAMILY_COMMAND, METRICS_SMTP, "data" },
+  [METRIC_SMTP_BDAT]       = { FAMILY_COMMAND, METRICS_SMTP, "bdat" },
+  [METRIC_SMTP_NOOP]       = { FAMILY_COMMAND, METRICS_SMTP, "noop" },
+  [METRIC_SMTP_QUIT]       = { FAMILY_COMMAND, METRICS_SMTP, "quit" },
+  [METRIC_SMTP_OTHER]      = { FAMILY_COMMAND, METRICS_SMTP, "other" },
+  [METRIC_POP3_GREETING]   = { FAMILY_COMMAND, METRICS_POP3, "greeting" },
+  [METRIC_POP3_USER]       = { FAMILY_COMMAND, METRICS_POP3, "user" },
+  [METRIC_POP3_PASS]       = { FAMILY_COMMAND, METRICS_POP3, "pass" },
+  [METRIC_POP3_STAT]       = { FAMILY_COMMAND, METRICS_POP3, "stat" },
+  [METRIC_POP3_LIST]       = { FAMILY_COMMAND, METRICS_POP3, "list" },
+  [METRIC_POP3_RETR]       = { FAMILY_COMMAND, METRICS_POP3, "retr" },
+  [METRIC_POP3_TOP]        = { FAMILY_COMMAND, METRICS_POP3, "top" },
+  [METRIC_POP3_DELE]       = { FAMILY_COMMAND, METRICS_POP3, "dele" },
+  [METRIC_POP3_RSET]       = { FAMILY_COMMAND, METRICS_POP3, "rset" },
+  [METRIC_POP3_NOOP]       = { FAMILY_COMMAND, METRICS_POP3, "noop" },
+  [METRIC_POP3_QUIT]       = { FAMILY_COMMAND, METRICS_POP3, "quit" },
+  [METRIC_POP3_OTHER]      = { FAMILY_COMMAND, METRICS_POP3, "other" },
+  [METRIC_STORAGE_LOOKUP]  = { FAMILY_STORAGE, 0, "is_valid_user" },
+  [METRIC_STORAGE_REFRESH] = { FAMILY_STORAGE, 0, "refresh_user_filter" },
+  [METRIC_STORAGE_SAVE]    = { FAMILY_STORAGE, 0, "save_user_mail" },
+  [METRIC_STORAGE_LOAD]    = { FAMILY_STORAGE, 0, "load_user_mail" },
+  [METRIC_STORAGE_TOP]     = { FAMILY_STORAGE, 0, "get_mail_item_top_size" },
+};
+
+static const char *protocol_names[] = { "smtp", "pop3" };
+
+static const struct {
+  const char *name;
+  const char *help;
+} counter_info[METRIC_COUNTERS] = {
+  [COUNTER_REFUSED] = { "mail_connections_refused_total",
+			"Connections refused for exceeding the limits." },
+  [COUNTER_MESSAGES_STORED] = { "mail_messages_stored_total",
+				"Messages stored, once per recipient." },
+  [COUNTER_BYTES_STORED] = { "mail_stored_bytes_total",
+			     "Bytes of messages stored, once per message." },
+  [COUNTER_BYTES_RETRIEVED] = { "mail_retrieved_bytes_total",
+				"Bytes of messages sent by RETR." },
+};
+
+// Bucket bounds of the export, in microseconds
+static const uint64_t export_bounds[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+  250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+#define EXPORT_BOUNDS (sizeof(export_bounds) / sizeof(export_bounds[0]))
+
+static const double export_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define EXPORT_QUANTILES (sizeof(export_quantiles) / sizeof(export_quantiles[0]))
+
+static struct metrics_table *table = NULL;
+static const char *admin_address = NULL;
+static pthread_t admin_thread;
+static volatile int admin_stopping = 0;
+
+/** Internal function that finds the bucket of a value.
+ */
+static unsigned int bucket_of(uint64_t value) {
+
+  if (value < HDR_SUB_BUCKETS)
+    return value;
+  unsigned int shift = 63 - __builtin_clzll(value) - HDR_SUB_BITS;
+  if (shift > HDR_MAX_SHIFT)
+    return HDR_BUCKETS - 1;
+  return (shift + 1) * HDR_SUB_BUCKETS + (value >> shift) - HDR_SUB_BUCKETS;
+}
+
+/** Internal function that returns the largest value counted in a
+ *  bucket.
+ */
+static uint64_t bucket_limit(unsigned int bucket) {
+
+  unsigned int group = bucket / HDR_SUB_BUCKETS, sub = bucket % HDR_SUB_BUCKETS;
+  if (group == 0)
+    return sub;
+  return ((uint64_t) (HDR_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+/** Sets up the shared memory where metrics are kept. Must be called
+ *  before processes are forked, and only if the metrics are to be
+ *  served; otherwise, nothing is recorded.
+ *
+ *  Returns: 0 on success, or -1 if the shared memory could not be
+ *           created.
+ */
+int metrics_init(void) {
+
+  table = mmap(NULL, sizeof(struct metrics_table), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED) {
+    perror("mmap");
+    table = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/** Returns the current time of the monotonic clock, in microseconds.
+ *  The clock is the same for all processes.
+ */
+uint64_t metrics_now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/** Records a value in a histogram. Does not block.
+ *
+ *  Parameters: metric: One of the METRIC_* constants.
+ *              usecs: Time taken, in microseconds.
+ */
+void metrics_observe(int metric, uint64_t usecs) {
+
+  if (!table || metric < 0)
+    return;
+  struct histogram *h = &table->histograms[metric];
+  __atomic_add_fetch(&h->buckets[bucket_of(usecs)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, usecs, __ATOMIC_RELAXED);
+}
+
+/** Adds to a counter. Does not block.
+ *
+ *  Parameters: counter: One of the COUNTER_* constants.
+ *              amount: Amount added.
+ */
+void metrics_add(int counter, uint64_t amount) {
+
+  if (table)
+    __atomic_add_fetch(&table->counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+/** Finds the histogram of a command.
+ *
+ *  Parameters: protocol: METRICS_SMTP or METRICS_POP3.
+ *              command: Name of the command, in any case.
+ *
+ *  Returns: One of the METRIC_* constants of the protocol; commands
+ *           not recognized have the last one.
+ */
+int metrics_command(int protocol, const char *command) {
+
+  int i, other = protocol == METRICS_SMTP ? METRIC_SMTP_OTHER : METRIC_POP3_OTHER;
+  // greetings are not commands
+  for (i = protocol == METRICS_SMTP ? METRIC_SMTP_HELO : METRIC_POP3_USER; i < other; i++)
+    if (!strcasecmp(histogram_info[i].name, command))
+      return i;
+  return other;
+}
+
+/** Starts timing a command or call, ending the one being timed, if
+ *  any.
+ *
+ *  Parameters: timer: Timer of the session or call.
+ *              metric: One of the METRIC_* constants.
+ */
+void metrics_start(struct metrics_timer *timer, int metric) {
+
+  metrics_stop(timer);
+  if (!table && !PROBES_ENABLED)
+    return;
+  timer->metric = metric;
+  timer->start = metrics_now();
+  if (histogram_info[metric].family == FAMILY_COMMAND)
+    PROBE3(command_start, log_session,
+	   protocol_names[histogram_info[metric].protocol], histogram_info[metric].name);
+}
+
+/** Ends timing, recording the time since metrics_start. Does nothing
+ *  if nothing is being timed.
+ *
+ *  Parameters: timer: Timer of the session or call.
+ */
+void metrics_stop(struct metrics_timer *timer) {
+
+  int metric = timer->metric;
+  if (metric < 0)
+    return;
+  uint64_t usecs = metrics_now() - timer->start;
+  metrics_observe(metric, usecs);
+  if (histogram_info[metric].family == FAMILY_COMMAND)
+    PROBE4(command_done, log_session, protocol_names[histogram_info[metric].protocol],
+	   histogram_info[metric].name, usecs);
+  else
+    PROBE3(storage_done, log_session, histogram_info[metric].name, usecs);
+  timer->metric = -1;
+}
+
+/** Internal function that writes the labels identifying a histogram,
+ *  followed by an extra label if given.
+ */
+static void write_labels(FILE *out, int metric, const char *extra) {
+
+  if (histogram_info[metric].family == FAMILY_COMMAND)
+    fprintf(out, "{protocol=\"%s\",command=\"%s\"%s%s}",
+	    protocol_names[histogram_info[metric].protocol], histogram_info[metric].name,
+	    extra ? "," : "", extra ? extra : "");
+  else
+    fprintf(out, "{call=\"%s\"%s%s}", histogram_info[metric].name,
+	    extra ? "," : "", extra ? extra : "");
+}
+
+/** Internal function that copies the buckets of a histogram. Buckets
+ *  may change while they are read, so the count is taken from the
+ *  copy, for the export to be consistent.
+ *
+ *  Returns: the number of values in the copy.
+ */
+static uint64_t read_histogram(int metric, uint64_t *buckets) {
+
+  uint64_t count = 0;
+  unsigned int b;
+
+  for (b = 0; b < HDR_BUCKETS; b++) {
+    buckets[b] = __atomic_load_n(&table->histograms[metric].buckets[b], __ATOMIC_RELAXED);
+    count += buckets[b];
+  }
+  return count;
+}
+
+/** Internal function that writes the histograms of a family, then
+ *  their quantiles, as a family of gauges.
+ */
+static void write_family(FILE *out, int family, const char *name, const char *help) {
+
+  uint64_t buckets[HDR_BUCKETS], count, seen;
+  char label[32];
+  unsigned int i, b, q;
+  int m;
+
+  fprintf(out, "# HELP %s_seconds %s\n# TYPE %s_seconds histogram\n", name, help, name);
+  for (m = 0; m < METRIC_HISTOGRAMS; m++) {
+    if (histogram_info[m].family != family)
+      continue;
+    count = read_histogram(m, buckets);
+    uint64_t sum = __atomic_load_n(&table->histograms[m].sum, __ATOMIC_RELAXED);
+    for (i = b = 0, seen = 0; i < EXPORT_BOUNDS; i++) {
+      for (; b < HDR_BUCKETS && bucket_limit(b) <= export_bounds[i]; b++)
+	seen += buckets[b];
+      snprintf(label, sizeof(label), "le=\"%g\"", export_bounds[i] / 1e6);
+      fprintf(out, "%s_seconds_bucket", name);
+      write_labels(out, m, label);
+      fprintf(out, " %llu\n", (unsigned long long) seen);
+    }
+    fprintf(out, "%s_seconds_bucket", name);
+    write_labels(out, m, "le=\"+Inf\"");
+    fprintf(out, " %llu\n%s_seconds_sum", (unsigned long long) count, name);
+    write_labels(out, m, NULL);
+    fprintf(out, " %.6f\n%s_seconds_count", sum / 1e6, name);
+    write_labels(out, m, NULL);
+    fprintf(out, " %llu\n", (unsigned long long) count);
+  }
+
+  fprintf(out, "# HELP %s_quantile_seconds Quantiles of %s_seconds since the server "
+	  "started, within 6.25%%.\n# TYPE %s_quantile_seconds gauge\n", name, name, name);
+  for (m = 0; m < METRIC_HISTOGRAMS; m++) {
+    if (histogram_info[m].family != family)
+      continue;
+    count = read_histogram(m, buckets);
+    // Nearest-rank method, as the largest value of the bucket reached
+    for (q = 0; q < EXPORT_QUANTILES; q++) {
+      uint64_t rank = (uint64_t) (export_quantiles[q] * count + 0.999999);
+      for (b = 0, seen = 0; b < HDR_BUCKETS - 1; b++)
+	if ((seen += buckets[b]) >= rank && rank)
+	  break;
+      snprintf(label, sizeof(label), "quantile=\"%g\"", export_quantiles[q]);
+      fprintf(out, "%s_quantile_seconds", name);
+      write_labels(out, m, label);
+      if (count)
+	fprintf(out, " %.6f\n", bucket_limit(b) / 1e6);
+      else
+	fprintf(out, " NaN\n");
+    }
+  }
+}
+
+/** Internal function that writes all metrics in the Prometheus text
+ *  format.
+ */
+static void write_metrics(FILE *out) {
+
+  int c;
+
+  write_family(out, FAMILY_COMMAND, "mail_command_duration",
+	       "Time to handle a command, from reading it to sending the reply.");
+  write_family(out, FAMILY_STORAGE, "mail_storage_duration",
+	       "Time spent in calls to the mail storage.");
+  for (c = 0; c < METRIC_COUNTERS; c++)
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+	    counter_info[c].name, counter_info[c].help, counter_info[c].name,
+	    counter_info[c].name,
+	    (unsigned long long) __atomic_load_n(&table->counters[c], __ATOMIC_RELAXED));
+}
+
+/** Internal function that answers a client of the admin socket.
+ */
+static void serve_client(int fd) {
+
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  struct timeval timeout = { ADMIN_REQUEST_TIMEOUT_MS / 1000, 0 };
+  char request[1024], *text = NULL, header[128];
+  size_t size = 0, sent;
+  ssize_t rv = 0;
+  int header_len = 0;
+
+  // A slow client must not stop the export
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (poll(&pfd, 1, ADMIN_REQUEST_TIMEOUT_MS) > 0)
+    rv = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+
+  FILE *out = open_memstream(&text, &size);
+  if (!out)
+    return;
+  write_metrics(out);
+  fclose(out);
+
+  if (rv >= 4 && !strncmp(request, "GET ", 4))
+    header_len = snprintf(header, sizeof(header),
+			  "HTTP/1.0 200 OK\r\n"
+			  "Content-Type: text/plain; version=0.0.4\r\n"
+			  "Content-Length: %zu\r\n\r\n", size);
+  if (header_len > 0)
+    send(fd, header, header_len, MSG_NOSIGNAL | MSG_MORE);
+  for (sent = 0; sent < size; sent += rv) {
+    rv = send(fd, text + sent, size - sent, MSG_NOSIGNAL);
+    if (rv <= 0)
+      break;
+  }
+  free(text);
+}
+
+/** Internal function that opens the admin socket.
+ *
+ *  Returns: the listening socket, or -1 on error.
+ */
+static int open_admin(void) {
+
+  int fd, yes = 1;
+
+  if (strchr(admin_address, '/')) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(admin_address) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(addr.sun_path, admin_address);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+    // The socket of a previous server is taken over
+    unlink(admin_address);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", admin_address, &hints, &res) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+  if (fd >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 16) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+/** Internal function run by the admin thread.
+ */
+static void *admin_main(void *arg) {
+
+  int fd = -1, warned = 0;
+
+  while (!admin_stopping) {
+    // During a restart, the port is only released by the previous
+    // server once this one is ready, so opening is retried
+    if (fd < 0) {
+      fd = open_admin();
+      if (fd < 0) {
+	if (!warned++)
+	  log_warning("metrics: can't open admin socket %s: %s, retrying",
+		      admin_address, strerror(errno));
+	poll(NULL, 0, ADMIN_POLL_MS);
+	continue;
+      }
+      log_info("metrics: serving on %s", admin_address);
+    }
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, ADMIN_POLL_MS) <= 0)
+      continue;
+    int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0)
+      continue;
+    serve_client(client);
+    close(client);
+  }
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+/** Serves the metrics on an admin socket, from a thread of the
+ *  calling process. metrics_init must have been called.
+ *
+ *  Parameters: admin: Path of a Unix socket (anything with a '/'), or
+ *                     a TCP port, bound to the loopback address only.
+ *
+ *  Returns: 0 on success, or -1 if the thread could not be created.
+ */
+int metrics_serve(const char *admin) {
+
+  admin_address = admin;
+  admin_stopping = 0;
+  if (pthread_create(&admin_thread, NULL, admin_main, NULL) != 0) {
+    perror("pthread_create");
+    admin_address = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/** Closes the admin socket (e.g., so a new server can open it), and
+ *  waits for the thread serving it to end. Metrics are still recorded.
+ */
+void metrics_stop_serving(void) {
+
+  if (!admin_address)
+    return;
+  admin_stopping = 1;
+  pthread_join(admin_thread, NULL);
+  admin_address = NULL;
+}
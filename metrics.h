@@ -0,0 +1,57 @@
+/* metrics.h
+ * Keeps latency histograms and counters of the server, shared by all
+ * its processes, and exports them in the Prometheus text format.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+// Protocols, for metrics_command
+#define METRICS_SMTP 0
+#define METRICS_POP3 1
+
+// Histograms of the time spent handling each command, from the moment
+// it is read until the reply is sent (the last of each protocol counts
+// commands not recognized), and of the time spent in storage calls
+enum {
+  METRIC_SMTP_GREETING, METRIC_SMTP_HELO, METRIC_SMTP_EHLO,
+  METRIC_SMTP_MAIL, METRIC_SMTP_RCPT, METRIC_SMTP_DATA, METRIC_SMTP_BDAT,
+  METRIC_SMTP_NOOP, METRIC_SMTP_QUIT, METRIC_SMTP_OTHER,
+  METRIC_POP3_GREETING, METRIC_POP3_USER, METRIC_POP3_PASS,
+  METRIC_POP3_STAT, METRIC_POP3_LIST, METRIC_POP3_RETR, METRIC_POP3_TOP,
+  METRIC_POP3_DELE, METRIC_POP3_RSET, METRIC_POP3_NOOP, METRIC_POP3_QUIT,
+  METRIC_POP3_OTHER,
+  METRIC_STORAGE_LOOKUP, METRIC_STORAGE_REFRESH, METRIC_STORAGE_SAVE,
+  METRIC_STORAGE_LOAD, METRIC_STORAGE_TOP,
+  METRIC_HISTOGRAMS
+};
+
+// Counters
+enum {
+  COUNTER_REFUSED,          // connections over the limits
+  COUNTER_MESSAGES_STORED,  // messages saved, once per recipient
+  COUNTER_BYTES_STORED,     // bytes of messages saved
+  COUNTER_BYTES_RETRIEVED,  // bytes of messages sent by RETR
+  METRIC_COUNTERS
+};
+
+// A command or call being timed; metric is -1 when nothing is
+struct metrics_timer {
+  int metric;
+  uint64_t start;
+};
+
+int metrics_init(void);
+int metrics_serve(const char *admin);
+void metrics_stop_serving(void);
+
+uint64_t metrics_now(void);
+void metrics_observe(int metric, uint64_t usecs);
+void metrics_add(int counter, uint64_t amount);
+int metrics_command(int protocol, const char *command);
+void metrics_start(struct metrics_timer *timer, int metric);
+void metrics_stop(struct metrics_timer *timer);
+
+#endif
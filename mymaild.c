@@ -0,0 +1,107 @@
+/* mymaild.c
+ * Serves SMTP and POP3 from a single process, on any number of
+ * addresses and ports.
+ *
+ * Notes: All listeners share the server options, so the limits on
+ * clients apply to both protocols together, and the threads of the
+ * pool or the reactor serve sessions of either protocol. The filter
+ * of known users is built once, for both protocols. Sessions share no
+ * mailbox state in memory: SMTP writes an index file next to each
+ * message it delivers, which POP3 sessions read from disk (e.g., for
+ * TOP).
+ */
+
+#include "smtp.h"
+#include "pop3.h"
+#include "mailuser.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LISTENERS 16
+
+#define LISTENER_USAGE "protocol:[address:]port..."
+
+// Protocols that can be served, and how a listener is set up for each
+static const struct {
+  const char *name;
+  void (*setup)(struct server_listener *listener);
+} protocols[] = {
+  { "smtp", smtp_setup },
+  { "pop3", pop3_setup },
+};
+
+// Parses a listener given in the command line, as protocol:port or
+// protocol:address:port (e.g., smtp:25, pop3:[::1]:110). IPv6
+// addresses are written in brackets. Without an address, or with "*"
+// as the address, all IPv4 and IPv6 addresses are used.
+// The argument is left intact, since it is parsed again by the new
+// server on a restart. Returns 0 if the listener is valid, -1 otherwise.
+static int parse_listener(const char *text, struct server_listener *listener) {
+  
+  char *address = NULL, *port = NULL;
+  size_t i;
+  
+  // the listener keeps pointers into the copy while the server runs
+  char *arg = strdup(text);
+  char *colon = arg ? strchr(arg, ':') : NULL;
+  if (colon) {
+    *colon = 0;
+    port = strrchr(colon + 1, ':');
+    if (port) {
+      address = colon + 1;
+      *port++ = 0;
+      size_t len = strlen(address);
+      if (len >= 2 && address[0] == '[' && address[len - 1] == ']') {
+	address[len - 1] = 0;
+	address++;
+      }
+      if (!*address || !strcmp(address, "*"))
+	address = NULL;
+    } else {
+      port = colon + 1;
+    }
+  }
+  
+  if (port && *port)
+    for (i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++)
+      if (!strcmp(arg, protocols[i].name)) {
+	protocols[i].setup(listener);
+	listener->address = address;
+	listener->port = port;
+	return 0;
+      }
+  free(arg);
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  
+  struct server_options opts;
+  struct server_listener listeners[MAX_LISTENERS];
+  int count = 0;
+  
+  int argi = parse_server_options(argc, argv, &opts);
+  if (argi < 0 || argi == argc || argc - argi > MAX_LISTENERS) {
+    fprintf(stderr, "Invalid arguments. Expected: %s " SERVER_OPTIONS_USAGE
+            " " LISTENER_USAGE "\n", argv[0]);
+    return 1;
+  }
+  
+  for (; argi < argc; argi++) {
+    if (parse_listener(argv[argi], &listeners[count]) < 0) {
+      fprintf(stderr, "Invalid listener: %s. Expected: " LISTENER_USAGE
+              " (protocol is smtp or pop3)\n", argv[argi]);
+      return 1;
+    }
+    count++;
+  }
+  
+  // build the user filter once, for all protocols
+  refresh_user_filter();
+  run_servers(listeners, count, &opts);
+  
+  return 0;
+}
@@ -4,23 +4,49 @@
  * Modified: Nov 5, 2017
  */
 
+#define _GNU_SOURCE // for splice
+
 #include "netbuffer.h"
+#include "reactor.h"
+#include "transport.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 
 struct net_buffer {
   int    fd;
   size_t max_bytes;
   size_t avail_data;
+  // Pipe used to splice data from the socket to a file, created on
+  // first use
+  int    pipe_fd[2];
   // Buffer set as size zero, but since it's the last member of the
   // struct, any additional memory allocated after this struct can be
   // used as part of the buffer.
   char   buf[0];
 };
 
+// Time to spin reading a socket with no data, before waiting for it
+static long busy_poll_usecs = 0;
+
+/** Makes nb_read_line spin for some time, receiving from the socket,
+ *  when a command has not arrived yet, instead of waiting right away.
+ *  This trades processor time for latency with clients that send the
+ *  next command quickly (e.g., with SO_BUSY_POLL on the socket).
+ *
+ *  Parameters: usecs: Time to spin, in microseconds, or 0 to disable.
+ */
+void nb_set_busy_poll(long usecs) {
+  busy_poll_usecs = usecs > 0 ? usecs : 0;
+}
+
 /** Creates a new buffer for handling data read from a socket.
  *
  *  Note: The maximum buffer size passed as parameter will also
@@ -42,6 +68,8 @@ net_buffer_t nb_create(int fd, size_t max_buffer_size) {
   nb->fd          = fd;
   nb->max_bytes   = max_buffer_size;
   nb->avail_data  = 0;
+  nb->pipe_fd[0]  = -1;
+  nb->pipe_fd[1]  = -1;
   return nb;
 }
 
@@ -50,9 +78,41 @@ net_buffer_t nb_create(int fd, size_t max_buffer_size) {
  *  Parameters: nb: buffer object to be freed.
  */
 void nb_destroy(net_buffer_t nb) {
+  reactor_set_input_pending(nb->fd, 0);
+  if (nb->pipe_fd[0] >= 0) {
+    close(nb->pipe_fd[0]);
+    close(nb->pipe_fd[1]);
+  }
   free(nb);
 }
 
+/** Internal function that receives data into the free space of a
+ *  buffer. If no data is available, and busy polling is enabled,
+ *  keeps trying for busy_poll_usecs before giving up.
+ *
+ *  Returns: same as recv.
+ */
+static ssize_t spin_recv(net_buffer_t nb, size_t size) {
+
+  struct timespec start, now;
+  ssize_t rv = transport_recv(nb->fd, nb->buf + nb->avail_data, size);
+  if (rv >= 0 || errno != EAGAIN || !busy_poll_usecs)
+    return rv;
+
+  // The client may be waiting for replies before sending more
+  reactor_flush_output(nb->fd);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    rv = transport_recv(nb->fd, nb->buf + nb->avail_data, size);
+    if (rv >= 0 || errno != EAGAIN)
+      return rv;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000L +
+	   (now.tv_nsec - start.tv_nsec) / 1000 < busy_poll_usecs);
+  errno = EAGAIN;
+  return -1;
+}
+
 /** Reads a single line from the socket/buffer. If the socket returns
  *  more than one line in a single call to recv, returns a single line
  *  and caches the remaining data for the next call. The returned
@@ -85,7 +145,13 @@ int nb_read_line(net_buffer_t nb, char out[]) {
   while ((eos = memchr(nb->buf, '\n', nb->avail_data)) == NULL) {
     
     if (nb->avail_data < nb->max_bytes) {
-      rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+      rv = spin_recv(nb, nb->max_bytes - nb->avail_data);
+      // Non-blocking socket (e.g., session in the reactor) with no data yet
+      if (rv < 0 && errno == EAGAIN) {
+	if (reactor_wait(nb->fd, POLLIN) < 0)
+	  return -1;
+	continue;
+      }
       if (rv < 0)
 	return rv;
       if (rv == 0) {
@@ -105,5 +171,126 @@ int nb_read_line(net_buffer_t nb, char out[]) {
   nb->avail_data -= rv;
   if (nb->avail_data)
     memmove(nb->buf, eos + 1, nb->avail_data);
+  // Data left means the client sent more commands without waiting
+  // for this reply, so replies may be coalesced
+  reactor_set_input_pending(nb->fd, nb->avail_data > 0);
   return rv;
 }
+
+/** Internal function that writes an entire buffer to a file
+ *  descriptor, or discards it if the descriptor is negative.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int write_all(int out_fd, const char *buf, size_t size) {
+  
+  while (out_fd >= 0 && size > 0) {
+    ssize_t rv = write(out_fd, buf, size);
+    if (rv < 0)
+      return -1;
+    buf += rv;
+    size -= rv;
+  }
+  return 0;
+}
+
+/** Internal function that moves data from the socket to a file
+ *  through a pipe, using splice, so that the data is never copied to
+ *  user space.
+ *
+ *  Returns: number of bytes moved, 0 if the connection was closed, or
+ *           -1 on error. If splice is not supported for the file
+ *           descriptors involved, returns -1 and sets errno to EINVAL.
+ */
+static ssize_t splice_to_fd(net_buffer_t nb, int out_fd, size_t size) {
+  
+  if (nb->pipe_fd[0] < 0 && pipe(nb->pipe_fd) < 0)
+    return -1;
+  
+  ssize_t in;
+  while ((in = splice(nb->fd, NULL, nb->pipe_fd[1], NULL, size,
+		      SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK)) < 0 && errno == EAGAIN) {
+    // Pipe is empty at this point, so only the socket can be not ready
+    if (reactor_wait(nb->fd, POLLIN) < 0)
+      return -1;
+  }
+  if (in <= 0)
+    return in;
+  
+  ssize_t rem = in;
+  while (rem > 0) {
+    ssize_t out = splice(nb->pipe_fd[0], NULL, out_fd, NULL, rem, SPLICE_F_MOVE);
+    if (out <= 0) {
+      // Data left in the pipe can't be recovered, so get rid of the pipe
+      close(nb->pipe_fd[0]);
+      close(nb->pipe_fd[1]);
+      nb->pipe_fd[0] = nb->pipe_fd[1] = -1;
+      return -1;
+    }
+    rem -= out;
+  }
+  return in;
+}
+
+/** Reads an exact number of bytes from the socket/buffer and writes
+ *  them to another file descriptor, without checking for line
+ *  endings. Data already cached in the buffer is written first; the
+ *  remaining data is moved directly from the socket to the file
+ *  using splice, if supported, or copied through the buffer
+ *  otherwise. Data following the requested bytes remains available
+ *  for subsequent calls to nb_read_line.
+ *
+ *  Parameters: nb: buffer object where socket and cache data are stored.
+ *              out_fd: file descriptor where data will be written. If
+ *                      negative, data is read and discarded.
+ *              size: number of bytes to be read.
+ *
+ *  Returns: If all bytes were read, returns size. If the connection
+ *           was terminated before that, returns the number of bytes
+ *           read. If an error is found, returns -1.
+ */
+ssize_t nb_read_to_fd(net_buffer_t nb, int out_fd, size_t size) {
+  
+  size_t done = nb->avail_data < size ? nb->avail_data : size;
+  // Only sockets can be spliced
+  int use_splice = out_fd >= 0 && transport_is_socket(nb->fd);
+  ssize_t rv;
+  
+  if (done) {
+    if (write_all(out_fd, nb->buf, done) < 0)
+      return -1;
+    nb->avail_data -= done;
+    if (nb->avail_data)
+      memmove(nb->buf, nb->buf + done, nb->avail_data);
+  }
+  
+  while (done < size) {
+    size_t rem = size - done;
+    
+    if (use_splice) {
+      rv = splice_to_fd(nb, out_fd, rem);
+      if (rv < 0 && errno == EINVAL) {
+	use_splice = 0;
+	continue;
+      }
+    } else {
+      // Buffer is empty at this point, so it can be used for copying
+      rv = transport_recv(nb->fd, nb->buf, rem < nb->max_bytes ? rem : nb->max_bytes);
+      if (rv < 0 && errno == EAGAIN) {
+	if (reactor_wait(nb->fd, POLLIN) < 0)
+	  return -1;
+	continue;
+      }
+      if (rv > 0 && write_all(out_fd, nb->buf, rv) < 0)
+	return -1;
+    }
+    
+    if (rv < 0)
+      return rv;
+    if (rv == 0)
+      break;
+    done += rv;
+  }
+  reactor_set_input_pending(nb->fd, nb->avail_data > 0);
+  return done;
+}
@@ -8,11 +8,14 @@
 #define _NET_BUFFER_H_
 
 #include <string.h>
+#include <sys/types.h>
 
 typedef struct net_buffer *net_buffer_t;
 
+void nb_set_busy_poll(long usecs);
 net_buffer_t nb_create(int fd, size_t max_buffer_size);
 void nb_destroy(net_buffer_t nb);
 int nb_read_line(net_buffer_t nb, char out[]);
+ssize_t nb_read_to_fd(net_buffer_t nb, int out_fd, size_t size);
 
 #endif
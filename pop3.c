@@ -0,0 +1,459 @@
+#include "pop3.h"
+#include "netbuffer.h"
+#include "arena.h"
+#include "reply.h"
+#include "mailuser.h"
+#include "server.h"
+#include "reactor.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define MAX_LINE_LENGTH 1024
+//Size of the blocks of the session arena, enough for the replies to
+//most commands
+#define SESSION_ARENA_SIZE 4096
+//Timeouts in seconds; RFC 1939 requires the autologout timer to be
+//at least 10 minutes
+#define AUTOLOGOUT_TIMEOUT 600
+#define SESSION_TIMEOUT 3600
+
+static void handle_client(int fd);
+void quitProcessPre(int fd);
+void quitProcessPost(int fd, mail_list_t list);
+void sendGreet(int fd);
+int getArgStartIndex(char* line);
+int discardLine(net_buffer_t buffer, char* line);
+int sendMail(int fd, mail_item_t item);
+int sendMailTop(int fd, mail_item_t item, unsigned int lines);
+void sendMailEnd(int fd, int file, size_t size);
+
+//Sets up a listener to serve POP3. Must be called before the server
+//is started
+void pop3_setup(struct server_listener* listener) {
+  //Replies with the host name are built once, for all sessions
+  reply_init();
+  listener->handler = handle_client;
+  listener->busy_reply = "-ERR too many connections, try again later\r\n";
+}
+
+void handle_client(int fd) {
+  //Server states, kept per session so that sessions can run in threads
+  int isTransaction = 0;
+  int isAuthorization = 0;
+
+  //Sessions that time out are closed without entering the UPDATE
+  //state, so messages marked as deleted are kept
+  reactor_set_session_timeout(fd, SESSION_TIMEOUT, reply_string(REPLY_POP3_TIMEOUT));
+
+  //Each command is timed until the next one is read
+  struct metrics_timer timer = {-1, 0};
+  metrics_start(&timer, METRIC_POP3_GREETING);
+
+  sendGreet(fd);//Sends opening message to client and enters authorization state
+  isAuthorization = 1;
+
+  //data
+  char username[MAX_USERNAME_SIZE];
+  char password[MAX_PASSWORD_SIZE];
+  mail_list_t mail = NULL;
+
+  //Local indicators
+  int userNameEntered = 0;
+
+  //The buffer is kept for the whole session, so commands sent
+  //together (pipelined) are not lost
+  net_buffer_t buffer = nb_create(fd, MAX_LINE_LENGTH);
+  //Replies are built in the session arena, which is reset before each
+  //command
+  arena_t arena = arena_create(SESSION_ARENA_SIZE);
+  if(arena == NULL){
+    send_string(fd, "-ERR Not enough memory\r\n");
+    nb_destroy(buffer);
+    return;
+  }
+
+  while(1) {
+    char line[MAX_LINE_LENGTH+1];
+    arena_reset(arena);
+    reactor_set_timeout(fd, AUTOLOGOUT_TIMEOUT);
+    metrics_stop(&timer);
+    int result = nb_read_line(buffer, line);
+    if(result <= 0){
+      //handle abrupt termination
+      if(mail != NULL){
+        reset_mail_list_deleted_flag(mail);
+        destroy_mail_list(mail);
+        break;
+      }
+      else{
+        break;
+      }
+    }
+
+    //The reply gets its own time limit, so a long RETR can be sent
+    //after the client was idle
+    reactor_set_timeout(fd, AUTOLOGOUT_TIMEOUT);
+
+    //A line that doesn't fit is dropped up to its end, so its tail is
+    //not taken as the next command
+    if(line[result - 1] != '\n'){
+      if(discardLine(buffer, line) <= 0){
+        if(mail != NULL){
+          reset_mail_list_deleted_flag(mail);
+          destroy_mail_list(mail);
+        }
+        break;
+      }
+      send_string(fd, "-ERR Command is too long\r\n");
+      continue;
+    }
+
+    //Extract command and argument (if it exists)
+    char command[MAX_LINE_LENGTH+1];
+    strcpy(command, line);
+    char args[MAX_LINE_LENGTH+1];
+    args[0] = '\0';
+    if(strlen(command) < 6){
+      send_string(fd, "-ERR Wrong command\r\n");
+      continue;
+    }
+    int containsargs = 0;
+    char* space = strchr(command, ' ');
+    if(space == NULL) {
+      command[strlen(command) - 2] = '\0';
+    }
+    else {
+      if(strlen(command) > 7) {
+        containsargs = 1;
+        int startIndex = getArgStartIndex(line);
+        strcpy(args, line+startIndex);
+        args[strlen(args)-2] = '\0';
+      }
+      *space = '\0';
+    }
+
+    //Command comparison
+    int isUSER = strcasecmp(command, "USER");
+    int isPASS = strcasecmp(command, "PASS");
+    int isQUIT = strcasecmp(command, "QUIT");
+    int isSTAT = strcasecmp(command, "STAT");
+    int isLIST = strcasecmp(command, "LIST");
+    int isRETR = strcasecmp(command, "RETR");
+    int isDELE = strcasecmp(command, "DELE");
+    int isRSET = strcasecmp(command, "RSET");
+    int isNOOP = strcasecmp(command, "NOOP");
+    int isTOP = strcasecmp(command, "TOP");
+    metrics_start(&timer, metrics_command(METRICS_POP3, command));
+    command[0] = '\0';
+    line[0] = '\0';
+
+    //Command processing
+    if (isQUIT == 0 && isTransaction == 0 && containsargs == 0) {
+      quitProcessPre(fd);
+      isAuthorization = 0;
+      break;
+    }
+
+    if (isQUIT == 0 && isTransaction == 1 && containsargs == 0) {
+      quitProcessPost(fd, mail);
+      break;
+    }
+
+    if (isUSER == 0 && isAuthorization == 1 && containsargs == 1 && userNameEntered == 0) {
+      //A name that doesn't fit can't be a valid user
+      if(strlen(args) >= sizeof(username)) {
+        send_string(fd, "-ERR No such user, enter again\r\n");
+        continue;
+      }
+      strcpy(username, args);
+      args[0] = '\0';
+
+      //Check if username exists in users.txt
+      if(is_valid_user(username, NULL) == 0) {
+        send_string(fd, "-ERR No such user, enter again\r\n");
+        username[0] = '\0';
+        continue;
+      }
+
+      userNameEntered = 1;
+      send_string(fd, "+OK User matched! Now enter password\r\n");
+      continue;
+    }
+
+    if (isPASS == 0 && isAuthorization == 1 && userNameEntered == 1 && containsargs == 1) {
+      if(strlen(args) >= sizeof(password)) {
+        userNameEntered = 0;
+        username[0] = '\0';
+        send_string(fd, "-ERR Invalid password, enter username and password again\r\n");
+        continue;
+      }
+      strcpy(password, args);
+      args[0] = '\0';
+
+      //Check if password matches username
+      if (!(is_valid_user(username, password)) == 0) {
+        send_string(fd, "+OK Password matched! Enter desired command\r\n");
+        mail = load_user_mail(username);
+        isAuthorization = 0;    //exit autorization state
+        isTransaction = 1;      //enter transaction state
+      }
+      else{
+        userNameEntered = 0;    //reset username previously entered
+        username[0] = '\0';
+        password[0] = '\0';     //reset invalid password
+        send_string(fd, "-ERR Invalid password, enter username and password again\r\n");
+      }
+
+      continue;
+    }
+
+    if (isSTAT == 0 && isTransaction == 1 && containsargs == 0) {
+      char resp1[MAX_LINE_LENGTH];
+      char* end = REPLY_PUT_STRING(resp1, "+OK ");
+      end = reply_put_uint(end, get_mail_count(mail));
+      end = REPLY_PUT_STRING(end, " ");
+      end = reply_put_uint(end, get_mail_list_size(mail));
+      end = REPLY_PUT_STRING(end, "\r\n");
+      send_all(fd, resp1, end - resp1);
+      continue;
+    }
+
+    if (isLIST == 0 && isTransaction == 1) {
+      int mail_count = get_mail_count(mail);
+
+      //Check if mail is available to list
+      if (mail_count == 0) {
+        send_string(fd, "+OK No mail .\r\n");
+      }
+      else {
+        //Check if any argument was provided
+        if (strlen(args) > 0) {
+          unsigned int message_number = (unsigned int) atoi(args);
+          if (message_number <= get_mail_count(mail)) {
+            mail_item_t mail_item = get_mail_item(mail, message_number-1);
+
+            //Selected mail was not found
+            if (mail_item == NULL) {
+              send_string(fd, "-ERR No such mail exists\r\n");
+            }
+            else {//found selected mail
+              char respx[MAX_LINE_LENGTH + 32];
+              char* end = REPLY_PUT_STRING(respx, "+OK ");
+              end = reply_put(end, args, strlen(args));
+              end = REPLY_PUT_STRING(end, " ");
+              end = reply_put_uint(end, get_mail_item_size(mail_item));
+              end = REPLY_PUT_STRING(end, "\r\n");
+              send_all(fd, respx, end - respx);
+              args[0] = '\0';
+            }
+          }
+          else {
+            send_string(fd, "-ERR No such mail exists\r\n");
+            args[0] = '\0';
+          }
+        }
+        else {  //Case where no arguments are present
+          unsigned int i = 0;
+          //Each line has up to two numbers of 20 digits
+          size_t size_x = (size_t) (mail_count+2)*48;
+          char *resp2 = arena_alloc(arena, size_x);
+          if (resp2 == NULL) {
+            send_string(fd, "-ERR Not enough memory\r\n");
+            continue;
+          }
+          char *end = REPLY_PUT_STRING(resp2, "+OK ");
+          end = reply_put_uint(end, mail_count);
+          end = REPLY_PUT_STRING(end, " messages (");
+          end = reply_put_uint(end, get_mail_list_size(mail));
+          end = REPLY_PUT_STRING(end, " octets)\r\n");
+          int temp_i = 0;
+          while (temp_i < mail_count) { //loop to get all valid (not deleted) email's info
+            mail_item_t temp = get_mail_item(mail, i);
+            if (temp != NULL) {
+              end = reply_put_uint(end, i+1);
+              end = REPLY_PUT_STRING(end, " ");
+              end = reply_put_uint(end, get_mail_item_size(temp));
+              end = REPLY_PUT_STRING(end, "\r\n");
+              temp_i++;
+            }
+            i++;
+          }
+          end = REPLY_PUT_STRING(end, ".\r\n");
+          send_all(fd, resp2, end - resp2);
+        }
+      }
+      continue;
+    }
+
+    if (isRETR == 0 && isTransaction == 1 && containsargs == 1) {
+      unsigned int mail_del = (unsigned int) atoi(args);
+      args[0] = '\0';
+      mail_item_t temp = get_mail_item(mail, mail_del - 1);
+      if (temp == NULL) {   //selected mail does not exist
+        send_string(fd, "-ERR Mail does not exist\r\n");
+      } else if (sendMail(fd, temp) < 0) {
+        //The client can't tell the mail was cut short
+        reset_mail_list_deleted_flag(mail);
+        destroy_mail_list(mail);
+        break;
+      }
+      continue;
+    }
+
+    if (isTOP == 0 && isTransaction == 1 && containsargs == 1) {
+      char* end;
+      unsigned long mail_top = strtoul(args, &end, 10);
+      char* linesArg = end;
+      while(*linesArg == ' '){
+        linesArg++;
+      }
+      unsigned long lines = strtoul(linesArg, &end, 10);
+      args[0] = '\0';
+      //Both message number and line count are required, and strtoul
+      //would take a negative count as a very large one
+      if (end == linesArg || *end != '\0' || *linesArg == '-') {
+        send_string(fd, "-ERR Syntax: TOP msg n\r\n");
+        continue;
+      }
+      mail_item_t temp = get_mail_item(mail, mail_top - 1);
+      if (mail_top == 0 || temp == NULL) {
+        send_string(fd, "-ERR Mail does not exist\r\n");
+      } else if (sendMailTop(fd, temp, lines) < 0) {
+        reset_mail_list_deleted_flag(mail);
+        destroy_mail_list(mail);
+        break;
+      }
+      continue;
+    }
+
+    if (isDELE == 0 && isTransaction == 1 && containsargs == 1) {
+      unsigned int mail_del = (unsigned int) atoi(args);    //Get index of mail to be deleted
+      args[0] = '\0';
+      mail_item_t temp = get_mail_item(mail, mail_del - 1);
+      if (temp == NULL) {
+        send_string(fd, "-ERR Mail does not exist\r\n");
+      } else {
+        mark_mail_item_deleted(temp);
+        send_string(fd, "+OK Mail marked as deleted\r\n");
+      }
+      continue;
+    }
+
+    if (isRSET == 0 && isTransaction == 1 && containsargs == 0) {
+      reset_mail_list_deleted_flag(mail);   //reset all delete flags in mail list
+      send_string(fd, "+OK Successfully reset deleted mail\r\n");
+      continue;
+    }
+
+    if (isNOOP == 0 && isTransaction == 1 && containsargs == 0) {
+      send_string(fd, "+OK\r\n");
+      continue;
+    }
+
+    send_string(fd, "-ERR Error, Check your command\r\n");
+  }
+  arena_destroy(arena);
+  nb_destroy(buffer);
+  metrics_stop(&timer);
+}
+
+///Helpers:
+
+//Method sends initial POP greeting
+void sendGreet(int fd){
+  send_reply(fd, REPLY_POP3_GREETING);
+}
+
+//Method processes QUIT post authorization
+void quitProcessPost(int fd, mail_list_t list){
+  send_reply(fd, REPLY_POP3_QUIT);
+  destroy_mail_list(list);  //update state: deletes marked mail
+}
+
+//Method processes QUIT pre authorization
+void quitProcessPre(int fd){
+  send_reply(fd, REPLY_POP3_QUIT);
+}
+
+//Method sends a whole mail, from its file, after the line with its
+//size. Returns -1 if the mail was cut short, in which case the
+//terminating dot is not sent and the session must end
+int sendMail(int fd, mail_item_t item){
+  struct stat st;
+  int file = open(get_mail_item_filename(item), O_RDONLY);
+  if(file < 0 || fstat(file, &st) < 0){
+    if(file >= 0){
+      close(file);
+    }
+    send_string(fd, "-ERR Mail could not be read\r\n");
+    return 0;
+  }
+  char header[64];
+  char* end = REPLY_PUT_STRING(header, "+OK ");
+  end = reply_put_uint(end, get_mail_item_size(item));
+  end = REPLY_PUT_STRING(end, " octets\r\n");
+  if(send_all(fd, header, end - header) < 0 || send_file(fd, file, 0, st.st_size) < 0){
+    close(file);
+    return -1;
+  }
+  sendMailEnd(fd, file, st.st_size);
+  close(file);
+  metrics_add(COUNTER_BYTES_RETRIEVED, st.st_size);
+  return 0;
+}
+
+//Method sends the headers and first lines of the body of a mail,
+//using the offsets stored when the mail was delivered. Returns -1 if
+//the mail was cut short, as sendMail
+int sendMailTop(int fd, mail_item_t item, unsigned int lines){
+  size_t size = get_mail_item_top_size(item, lines);
+  int file = open(get_mail_item_filename(item), O_RDONLY);
+  if(file < 0){
+    send_string(fd, "-ERR Mail could not be read\r\n");
+    return 0;
+  }
+  if(send_string(fd, "+OK Top of message follows\r\n") < 0 ||
+     send_file(fd, file, 0, size) < 0){
+    close(file);
+    return -1;
+  }
+  sendMailEnd(fd, file, size);
+  close(file);
+  return 0;
+}
+
+//Method sends the terminating dot after the first size bytes of a
+//mail, making sure it is on a line of its own
+void sendMailEnd(int fd, int file, size_t size){
+  char last = '\n';
+  if(size > 0 && pread(file, &last, 1, size - 1) != 1){
+    last = '\n';
+  }
+  send_string(fd, last == '\n' ? ".\r\n" : "\r\n.\r\n");
+}
+
+//Reads and drops the rest of a line that didn't fit in the line
+//buffer. Returns the result of the last read, which is 0 or less if
+//the session ended before the end of the line
+int discardLine(net_buffer_t buffer, char* line){
+  int result;
+  do {
+    result = nb_read_line(buffer, line);
+  } while((result > 0) && (line[result - 1] != '\n'));
+  return result;
+}
+
+//Gets starting index of argument (first character after the command)
+int getArgStartIndex(char* line){
+  char* space = strchr(line, ' ');
+  if(space == NULL){
+    return 0;
+  }
+  return space - line + 1;
+}
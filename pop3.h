@@ -0,0 +1,12 @@
+/* pop3.h
+ * Serves POP3 sessions, giving users access to their mailboxes.
+ */
+
+#ifndef _POP3_H_
+#define _POP3_H_
+
+#include "server.h"
+
+void pop3_setup(struct server_listener *listener);
+
+#endif
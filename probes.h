@@ -0,0 +1,55 @@
+/* probes.h
+ * Static tracepoints (USDT probes) of the server, for tracing a
+ * running server with bpftrace, perf or SystemTap (see trace/).
+ *
+ * Notes: Probes use sys/sdt.h, and are compiled out if it is missing
+ * (e.g., systemtap-sdt-dev is not installed) or NO_PROBES is
+ * defined. A probe that is not being traced is a single nop, and its
+ * arguments are only computed into registers. Probes of provider
+ * "mail", with their arguments:
+ *
+ *   session_accept  session, fd
+ *   session_close   session, fd, duration (us)
+ *   command_start   session, protocol, command
+ *   command_done    session, protocol, command, latency (us)
+ *   storage_done    session, call, latency (us)
+ *   deliver         session, recipients, bytes, latency (us)
+ *   mailbox_load    session, user, messages, bytes, latency (us)
+ *   expunge         session, messages, bytes
+ *
+ * Strings (protocol, command, call, user) are pointers, read with
+ * str() in bpftrace. Commands are lowercase, as in the metrics
+ * (e.g., "rcpt", or "other" for commands not recognized). Sessions
+ * are the IDs in the log, 0 outside sessions.
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBES_ENABLED 1
+#define PROBE2(name, a, b) DTRACE_PROBE2(mail, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(mail, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(mail, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(mail, name, a, b, c, d, e)
+#else
+// Arguments are never computed, but still count as used
+#define PROBES_ENABLED 0
+#define PROBE2(name, a, b) \
+  do { if (0) { (void) (a); (void) (b); } } while (0)
+#define PROBE3(name, a, b, c) \
+  do { if (0) { (void) (a); (void) (b); (void) (c); } } while (0)
+#define PROBE4(name, a, b, c, d) \
+  do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); } } while (0)
+#define PROBE5(name, a, b, c, d, e) \
+  do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); (void) (e); } } while (0)
+#endif
+
+#endif
@@ -0,0 +1,811 @@
+/* reactor.c
+ * Runs client sessions as coroutines on event-driven schedulers.
+ *
+ * Notes: Each scheduler is a thread with its own epoll instance. All
+ * schedulers wait on the listening sockets (with EPOLLEXCLUSIVE, so a
+ * new connection wakes up a single one), and a connection stays in
+ * the scheduler that accepted it until it is closed. Each session
+ * runs the regular handler function on its own stack (a coroutine,
+ * using ucontext). Sockets are non-blocking; when the handler would
+ * block reading or writing, the I/O functions in netbuffer.c and
+ * server.c call reactor_wait, which switches back to the scheduler
+ * until the socket is ready. This way handlers are written as plain
+ * blocking code, but a single thread can serve many idle sessions.
+ *
+ * Sessions may also set timeouts, which are enforced whenever they
+ * wait for the socket. In the reactor, each scheduler keeps the
+ * deadlines of its sessions in a timer wheel; sessions in forked
+ * processes or pool threads keep them in thread-local storage and
+ * wait in poll() with the time left.
+ *
+ * Schedulers may be pinned to processors, one per processor allowed
+ * for the process. Each scheduler then allocates its own structures,
+ * coroutines and stacks only after pinning itself, so on NUMA hosts
+ * the memory is placed on the node of its processor (first touch).
+ * Listening sockets may also belong to a single scheduler (e.g., one
+ * SO_REUSEPORT socket per scheduler, with connections steered by the
+ * kernel to the scheduler on the processor that received them).
+ */
+
+#define _GNU_SOURCE // for accept4, CPU affinity
+
+#include "reactor.h"
+#include "timerwheel.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Virtual size of each coroutine stack; memory is only used for
+// pages actually touched by the handler
+#define STACK_SIZE (128 * 1024)
+#define MAX_EVENTS 64
+#define MAX_LISTENERS 1024
+// Resolution of session timeouts in the reactor, in milliseconds
+#define TIMER_TICK_MS 100
+
+struct coroutine;
+
+struct listener {
+  int fd;
+  int scheduler;                 // scheduler accepting, or -1 for all
+  void (*handler)(int fd, void *arg);
+  void *arg;
+};
+
+// State of a session: its timeouts, as times of the monotonic clock
+// in milliseconds (0 if not set), and whether replies are coalesced
+struct session_state {
+  int fd;
+  long long state_deadline;      // for the current state of the session
+  long long session_deadline;    // for the whole session
+  const char *reply;             // sent to the client when expired
+  int expired;
+  int input_pending;             // next command already received
+  int output_held;               // replies sent with MSG_MORE
+};
+
+// Counters of each scheduler, reported with reactor_init's
+// stats_interval. Only written by the scheduler thread.
+struct scheduler_stats {
+  unsigned long sessions;        // connections accepted
+  unsigned long wakeups;         // sessions resumed by socket events
+  unsigned long cross_core;      // ... with the packets received by
+                                 // another processor (SO_INCOMING_CPU)
+  unsigned long migrations;      // scheduler found on a new processor
+};
+
+struct scheduler {
+  int index;
+  int cpu;                       // processor it is pinned to, or -1
+  int last_cpu;                  // processor it last ran on
+  int epfd;
+  int draining;                  // stopped accepting connections
+  ucontext_t main_ctx;           // context of the scheduler loop
+  struct coroutine *current;     // coroutine running, if any
+  struct epoll_event events[MAX_EVENTS];
+  int next_event, num_events;    // events not yet processed
+  struct timer_wheel wheel;      // deadlines of the sessions
+  struct scheduler_stats stats;
+};
+
+struct coroutine {
+  ucontext_t ctx;
+  char *stack;
+  int fd;
+  int waiting;                   // waiting for an event in fd
+  int done;                      // handler has returned
+  struct scheduler *sched;
+  struct listener *listener;     // where the connection was accepted
+  struct session_state timeouts;
+  struct timer timer;            // armed for the earliest deadline
+  struct timer sleep_timer;      // armed while sleeping
+  unsigned int log_session;      // log session ID, while not running
+};
+
+// Listening sockets, added before the schedulers are started
+static struct listener listeners[MAX_LISTENERS];
+static int listener_count = 0;
+// Scheduler running in the current thread, NULL outside the reactor
+static __thread struct scheduler *thread_sched = NULL;
+// Signalled by reactor_drain to make all schedulers stop accepting
+static int drain_fd = -1;
+// Number of schedulers, schedulers that stopped accepting, and
+// sessions not finished yet
+static int scheduler_count, drained_schedulers, live_sessions;
+// Schedulers, once started
+static struct scheduler **schedulers;
+// Processors the schedulers are pinned to, if pinned
+static int *scheduler_cpus;
+// Seconds between reports of the scheduler counters, or 0
+static int stats_seconds;
+// State of the session handled by the current thread, when not
+// running in the reactor
+static __thread struct session_state thread_session = { .fd = -1 };
+
+/** Internal function that returns the current time of the monotonic
+ *  clock, in milliseconds.
+ */
+static long long now_ms(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/** Internal function that increments a scheduler counter. Counters
+ *  are only written by their scheduler, but read by the thread
+ *  reporting them.
+ */
+static void stat_inc(unsigned long *counter) {
+
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1,
+		   __ATOMIC_RELAXED);
+}
+
+/** Internal function that counts the socket events handled by a
+ *  scheduler, and if statistics are reported, whether the socket
+ *  received its last packets in another processor.
+ */
+static void count_wakeup(struct scheduler *sched, int fd, unsigned long *counter) {
+
+  int cpu = sched_getcpu();
+  stat_inc(counter);
+  if (cpu != sched->last_cpu) {
+    if (sched->last_cpu >= 0)
+      stat_inc(&sched->stats.migrations);
+    sched->last_cpu = cpu;
+  }
+  if (stats_seconds) {
+    int incoming;
+    socklen_t len = sizeof(incoming);
+    if (!getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) &&
+	incoming >= 0 && incoming != cpu)
+      stat_inc(&sched->stats.cross_core);
+  }
+}
+
+/** Internal function that returns the earliest deadline of a session,
+ *  or 0 if it has no timeouts.
+ */
+static long long next_deadline(struct session_state *timeouts) {
+
+  long long state = timeouts->state_deadline, session = timeouts->session_deadline;
+  if (!state || (session && session < state))
+    return session;
+  return state;
+}
+
+/** Internal function that handles an expired timeout: the reply is
+ *  sent to the client, if there is space for it in the socket buffer,
+ *  and the connection is shut down, so any further reads or writes in
+ *  the handler fail and the session ends.
+ *
+ *  Returns: -1, with errno set to ETIMEDOUT.
+ */
+static int session_expired(struct session_state *timeouts) {
+
+  if (!timeouts->expired) {
+    timeouts->expired = 1;
+    if (timeouts->reply)
+      send(timeouts->fd, timeouts->reply, strlen(timeouts->reply),
+	   MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(timeouts->fd, SHUT_RDWR);
+  }
+  errno = ETIMEDOUT;
+  return -1;
+}
+
+/** Internal function that returns the state of the session using a
+ *  socket in the current thread, or NULL if the socket doesn't belong
+ *  to a session started with reactor_set_session_timeout.
+ */
+static struct session_state *find_session(int fd) {
+
+  struct coroutine *co = thread_sched ? thread_sched->current : NULL;
+  if (co && co->fd == fd)
+    return &co->timeouts;
+  if (!co && thread_session.fd == fd)
+    return &thread_session;
+  return NULL;
+}
+
+/** Internal function that arms the timer of the current coroutine for
+ *  its earliest deadline.
+ */
+static void coroutine_arm_timer(struct coroutine *co) {
+
+  long long deadline = next_deadline(&co->timeouts);
+  if (deadline)
+    timer_add(&co->sched->wheel, &co->timer, (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+  else
+    timer_cancel(&co->sched->wheel, &co->timer);
+}
+
+/** Internal function that runs the handler for a coroutine, as the
+ *  entry point of its context.
+ */
+static void coroutine_main(void) {
+
+  struct coroutine *co = thread_sched->current;
+  co->listener->handler(co->fd, co->listener->arg);
+  close(co->fd);
+  co->done = 1;
+  // Returning resumes the scheduler, through uc_link
+}
+
+/** Internal function that frees a finished coroutine. Events already
+ *  received for it, and not yet processed, are discarded.
+ */
+static void coroutine_destroy(struct coroutine *co) {
+
+  struct scheduler *sched = co->sched;
+  int i;
+  for (i = sched->next_event; i < sched->num_events; i++)
+    if (sched->events[i].data.ptr == co)
+      sched->events[i].data.ptr = NULL;
+  timer_cancel(&sched->wheel, &co->timer);
+  timer_cancel(&sched->wheel, &co->sleep_timer);
+  munmap(co->stack, STACK_SIZE);
+  free(co);
+  __atomic_sub_fetch(&live_sessions, 1, __ATOMIC_RELAXED);
+}
+
+/** Internal function that switches to a coroutine until it waits for
+ *  an event or finishes.
+ */
+static void coroutine_resume(struct coroutine *co) {
+
+  struct scheduler *sched = co->sched;
+  sched->current = co;
+  log_session = co->log_session;
+  swapcontext(&sched->main_ctx, &co->ctx);
+  co->log_session = log_session;
+  log_session = 0;
+  sched->current = NULL;
+  if (co->done)
+    coroutine_destroy(co);
+}
+
+/** Internal function called when the deadline of a coroutine expires.
+ *  The coroutine is resumed, and finds the timeout in reactor_wait.
+ */
+static void coroutine_timeout(struct timer *timer) {
+
+  struct coroutine *co =
+    (struct coroutine *) ((char *) timer - offsetof(struct coroutine, timer));
+  if (co->waiting) {
+    co->waiting = 0;
+    coroutine_resume(co);
+  }
+}
+
+/** Internal function called when a coroutine finishes sleeping.
+ */
+static void coroutine_wakeup(struct timer *timer) {
+
+  coroutine_resume((struct coroutine *)
+		   ((char *) timer - offsetof(struct coroutine, sleep_timer)));
+}
+
+/** Internal function that creates a coroutine for a new connection
+ *  and runs it until it first needs to wait.
+ */
+static void coroutine_start(struct scheduler *sched, struct listener *listener, int fd) {
+
+  struct coroutine *co = calloc(1, sizeof(struct coroutine));
+  struct epoll_event ev;
+
+  if (!co) {
+    perror("calloc");
+    close(fd);
+    return;
+  }
+  co->stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (co->stack == MAP_FAILED) {
+    perror("mmap");
+    free(co);
+    close(fd);
+    return;
+  }
+  // Lowest page is a guard page, so that stack overflows crash
+  // instead of corrupting memory
+  mprotect(co->stack, 4096, PROT_NONE);
+
+  __atomic_add_fetch(&live_sessions, 1, __ATOMIC_RELAXED);
+  co->fd = fd;
+  co->sched = sched;
+  co->listener = listener;
+  co->timeouts.fd = fd;
+  co->timer.callback = coroutine_timeout;
+  co->sleep_timer.callback = coroutine_wakeup;
+  getcontext(&co->ctx);
+  co->ctx.uc_stack.ss_sp = co->stack;
+  co->ctx.uc_stack.ss_size = STACK_SIZE;
+  co->ctx.uc_link = &sched->main_ctx;
+  makecontext(&co->ctx, coroutine_main, 0);
+
+  // Edge-triggered: an event is only received for a change in
+  // readiness after the socket returned EAGAIN
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = co;
+  if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    close(fd);
+    coroutine_destroy(co);
+    return;
+  }
+
+  coroutine_resume(co);
+}
+
+/** Internal function that accepts all pending connections in a
+ *  listening socket.
+ */
+static void accept_clients(struct scheduler *sched, struct listener *listener) {
+
+  while (1) {
+    int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+	log_error("accept: %s", strerror(errno));
+      if (errno != EINTR && errno != ECONNABORTED)
+	return;
+      continue;
+    }
+    count_wakeup(sched, fd, &sched->stats.sessions);
+    coroutine_start(sched, listener, fd);
+  }
+}
+
+/** Main function of each scheduler thread.
+ */
+static void *scheduler_main(void *arg) {
+
+  int index = (int) (intptr_t) arg;
+  struct scheduler *sched;
+  struct epoll_event ev;
+  int i;
+
+  // Pinned before anything is allocated, so memory is local to the
+  // processor
+  if (scheduler_cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(scheduler_cpus[index], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      fprintf(stderr, "reactor: could not pin scheduler %d to processor %d\n",
+	      index, scheduler_cpus[index]);
+  }
+
+  sched = calloc(1, sizeof(struct scheduler));
+  sched->index = index;
+  sched->cpu = scheduler_cpus ? scheduler_cpus[index] : -1;
+  sched->last_cpu = -1;
+  sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (sched->epfd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  thread_sched = sched;
+  for (i = 0; i < listener_count; i++) {
+    if (listeners[i].scheduler >= 0 && listeners[i].scheduler != index)
+      continue;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listeners[i];
+    if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, listeners[i].fd, &ev) < 0) {
+      perror("epoll_ctl");
+      exit(1);
+    }
+  }
+  // Level-triggered and never read, so every scheduler sees it
+  ev.events = EPOLLIN;
+  ev.data.ptr = &drain_fd;
+  if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, drain_fd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+
+  timer_wheel_init(&sched->wheel, now_ms() / TIMER_TICK_MS);
+  __atomic_store_n(&schedulers[index], sched, __ATOMIC_RELEASE);
+
+  while (1) {
+    // Sleep at most until the next timer may expire
+    int timeout = -1;
+    long ticks = timer_wheel_next(&sched->wheel);
+    if (ticks >= 0) {
+      long long wait = (sched->wheel.now + ticks) * TIMER_TICK_MS - now_ms();
+      timeout = wait > 0 ? wait : 0;
+    }
+    sched->num_events = epoll_wait(sched->epfd, sched->events, MAX_EVENTS, timeout);
+    for (sched->next_event = 0; sched->next_event < sched->num_events; ) {
+      void *ptr = sched->events[sched->next_event++].data.ptr;
+      if (ptr >= (void *) listeners && ptr < (void *) (listeners + listener_count)) {
+	if (!sched->draining)
+	  accept_clients(sched, ptr);
+      } else if (ptr == &drain_fd) {
+	sched->draining = 1;
+	for (i = 0; i < listener_count; i++)
+	  epoll_ctl(sched->epfd, EPOLL_CTL_DEL, listeners[i].fd, NULL);
+	epoll_ctl(sched->epfd, EPOLL_CTL_DEL, drain_fd, NULL);
+	__atomic_add_fetch(&drained_schedulers, 1, __ATOMIC_RELEASE);
+      } else if (ptr) {
+	struct coroutine *co = ptr;
+	if (co->waiting) {
+	  co->waiting = 0;
+	  count_wakeup(sched, co->fd, &sched->stats.wakeups);
+	  coroutine_resume(co);
+	}
+      }
+    }
+    timer_wheel_advance(&sched->wheel, now_ms() / TIMER_TICK_MS);
+  }
+  return NULL;
+}
+
+/** Main function of the thread reporting the counters of the
+ *  schedulers, once every stats_seconds.
+ */
+static void *stats_main(void *arg) {
+
+  struct scheduler_stats *last = calloc(scheduler_count, sizeof(struct scheduler_stats));
+  int i;
+
+  while (1) {
+    sleep(stats_seconds);
+    for (i = 0; i < scheduler_count; i++) {
+      struct scheduler *sched = __atomic_load_n(&schedulers[i], __ATOMIC_ACQUIRE);
+      struct scheduler_stats now;
+      if (!sched)
+	continue;
+      now.sessions = __atomic_load_n(&sched->stats.sessions, __ATOMIC_RELAXED);
+      now.wakeups = __atomic_load_n(&sched->stats.wakeups, __ATOMIC_RELAXED);
+      now.cross_core = __atomic_load_n(&sched->stats.cross_core, __ATOMIC_RELAXED);
+      now.migrations = __atomic_load_n(&sched->stats.migrations, __ATOMIC_RELAXED);
+      unsigned long events = now.sessions + now.wakeups - last[i].sessions - last[i].wakeups;
+      unsigned long cross = now.cross_core - last[i].cross_core;
+      log_info("reactor: scheduler %d cpu %d: %.1f sessions/s %.1f wakeups/s "
+	       "%lu%% cross-core %lu migrations", i,
+	       sched->cpu >= 0 ? sched->cpu : sched->last_cpu,
+	       (double) (now.sessions - last[i].sessions) / stats_seconds,
+	       (double) (now.wakeups - last[i].wakeups) / stats_seconds,
+	       events ? cross * 100 / events : 0, now.migrations - last[i].migrations);
+      last[i] = now;
+    }
+  }
+  return NULL;
+}
+
+/** Sets up the reactor. Must be called before any other reactor
+ *  function, except those used by sessions outside the reactor.
+ *
+ *  Parameters: count: Number of scheduler threads; if zero or
+ *                     negative, one per processor allowed for the
+ *                     process.
+ *              pin: If non-zero, each scheduler is pinned to one of
+ *                   the processors allowed for the process, in order
+ *                   (see reactor_cpu).
+ *              stats_interval: If positive, the counters of each
+ *                              scheduler (sessions, wakeups, wakeups
+ *                              for packets received by another
+ *                              processor, migrations) are printed
+ *                              every stats_interval seconds.
+ *
+ *  Returns: the number of schedulers.
+ */
+int reactor_init(int count, int pin, int stats_interval) {
+
+  cpu_set_t set;
+  int cpus = 0, cpu, i;
+
+  // Processors allowed for the process, e.g., by taskset
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    cpus = CPU_COUNT(&set);
+  if (cpus <= 0) {
+    CPU_ZERO(&set);
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0 || cpus > CPU_SETSIZE)
+      cpus = cpus <= 0 ? 1 : CPU_SETSIZE;
+    for (i = 0; i < cpus; i++)
+      CPU_SET(i, &set);
+  }
+
+  if (count <= 0)
+    count = cpus;
+  scheduler_count = count;
+  schedulers = calloc(count, sizeof(struct scheduler *));
+  stats_seconds = stats_interval > 0 ? stats_interval : 0;
+
+  if (pin) {
+    // More schedulers than processors share them, round robin
+    scheduler_cpus = calloc(count, sizeof(int));
+    for (i = 0, cpu = 0; i < count; i++, cpu++) {
+      if (i % cpus == 0)
+	cpu = 0;
+      while (!CPU_ISSET(cpu, &set))
+	cpu++;
+      scheduler_cpus[i] = cpu;
+    }
+  }
+  return count;
+}
+
+/** Returns the processor a scheduler is pinned to, or -1 if the
+ *  schedulers are not pinned.
+ *
+ *  Parameters: scheduler: Index of the scheduler, from 0 to the number
+ *                         returned by reactor_init - 1.
+ */
+int reactor_cpu(int scheduler) {
+
+  return scheduler_cpus ? scheduler_cpus[scheduler] : -1;
+}
+
+/** Adds a listening socket, whose connections will be handled by the
+ *  reactor. Must be called after reactor_init and before run_reactor.
+ *
+ *  Parameters: listen_fd: Listening socket; will be made non-blocking.
+ *              scheduler: Index of the only scheduler accepting
+ *                         connections from the socket, or -1 for all
+ *                         schedulers.
+ *              handler: Function to be called for each new
+ *                       connection, with the connection socket and
+ *                       arg. The connection is closed when the
+ *                       function returns.
+ *              arg: Passed to the handler.
+ *
+ *  Returns: 0 on success, or -1 if there are too many listeners.
+ */
+int reactor_listen(int listen_fd, int scheduler,
+		   void (*handler)(int fd, void *arg), void *arg) {
+
+  if (listener_count == MAX_LISTENERS)
+    return -1;
+
+  // Blocking accept calls would stall schedulers that lost the race
+  // for a connection
+  int flags = fcntl(listen_fd, F_GETFL);
+  fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+  listeners[listener_count].fd = listen_fd;
+  listeners[listener_count].scheduler = scheduler;
+  listeners[listener_count].handler = handler;
+  listeners[listener_count].arg = arg;
+  listener_count++;
+  return 0;
+}
+
+/** Accepts connections from the listening sockets added with
+ *  reactor_listen and handles them in coroutines, using the scheduler
+ *  threads set up by reactor_init. Returns once the threads are
+ *  started.
+ */
+void run_reactor(void) {
+
+  int i;
+  pthread_t thread;
+
+  drain_fd = eventfd(0, EFD_CLOEXEC);
+  if (drain_fd < 0) {
+    perror("eventfd");
+    exit(1);
+  }
+
+  for (i = 0; i < scheduler_count; i++) {
+    if (pthread_create(&thread, NULL, scheduler_main, (void *) (intptr_t) i) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+
+  if (stats_seconds) {
+    if (pthread_create(&thread, NULL, stats_main, NULL) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+}
+
+/** Makes all schedulers stop accepting new connections, and waits
+ *  until all sessions already accepted are finished. Connections not
+ *  yet accepted are left in the listening sockets (e.g., for another
+ *  process sharing them).
+ */
+void reactor_drain(void) {
+
+  uint64_t one = 1;
+  if (drain_fd < 0)
+    return;
+  if (write(drain_fd, &one, sizeof(one)) < 0)
+    perror("write");
+  while (__atomic_load_n(&drained_schedulers, __ATOMIC_ACQUIRE) < scheduler_count)
+    poll(NULL, 0, 10);
+  while (__atomic_load_n(&live_sessions, __ATOMIC_RELAXED) > 0)
+    poll(NULL, 0, 100);
+}
+
+/** Waits until a socket is ready for reading or writing. Should be
+ *  called by I/O functions when an operation on a non-blocking socket
+ *  fails with EAGAIN. If called from a session running in the
+ *  reactor, switches to other sessions until the socket is ready;
+ *  otherwise, blocks the calling thread.
+ *
+ *  If a timeout set for the session expires before the socket is
+ *  ready, the timeout reply is sent and the connection is shut down.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              events: POLLIN to wait for data to be read, POLLOUT to
+ *                      wait for space to write.
+ *
+ *  Returns: 0 when the socket may be ready, or -1 on error (errno is
+ *           ETIMEDOUT if a timeout expired).
+ */
+int reactor_wait(int fd, int events) {
+
+  struct scheduler *sched = thread_sched;
+  struct coroutine *co = sched ? sched->current : NULL;
+  struct session_state *timeouts = find_session(fd);
+  long long deadline = timeouts ? next_deadline(timeouts) : 0;
+
+  if (timeouts && (timeouts->expired || (deadline && now_ms() >= deadline)))
+    return session_expired(timeouts);
+  // The client may be waiting for the replies held so far
+  if (events & POLLIN)
+    reactor_flush_output(fd);
+
+  if (!co || co->fd != fd) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int timeout = -1;
+    if (deadline)
+      timeout = deadline - now_ms() > 0 ? deadline - now_ms() : 0;
+    int rv = poll(&pfd, 1, timeout);
+    if (rv == 0)
+      return session_expired(timeouts);
+    return rv < 0 ? -1 : 0;
+  }
+
+  co->waiting = 1;
+  swapcontext(&co->ctx, &sched->main_ctx);
+  // Resumed either by an event or by the timer
+  if (deadline && now_ms() >= deadline)
+    return session_expired(timeouts);
+  return 0;
+}
+
+/** Sets the timeout for the whole session using a socket, and the
+ *  reply sent to the client when any of its timeouts expires. Should
+ *  be called when the session starts, before any other timeout is set;
+ *  it also clears the timeout of the current state.
+ *
+ *  Parameters: fd: Socket of the session.
+ *              seconds: Maximum duration of the session, starting
+ *                       now, or zero for no limit.
+ *              reply: Message sent to the client on a timeout (e.g.,
+ *                     "421 ...\r\n"), or NULL to close silently. The
+ *                     string must remain valid during the session.
+ */
+void reactor_set_session_timeout(int fd, int seconds, const char *reply) {
+
+  struct coroutine *co = thread_sched ? thread_sched->current : NULL;
+  struct session_state *timeouts =
+    co && co->fd == fd ? &co->timeouts : &thread_session;
+
+  timeouts->fd = fd;
+  timeouts->state_deadline = 0;
+  timeouts->session_deadline = seconds > 0 ? now_ms() + seconds * 1000LL : 0;
+  timeouts->reply = reply;
+  timeouts->expired = 0;
+  timeouts->input_pending = 0;
+  timeouts->output_held = 0;
+  if (timeouts != &thread_session)
+    coroutine_arm_timer(co);
+}
+
+/** Sets the timeout for the current state of a session (e.g., waiting
+ *  for a command), replacing the timeout of the previous state. The
+ *  time is counted from now, not from the last data received, so a
+ *  client sending data too slowly also times out.
+ *
+ *  Parameters: fd: Socket of the session.
+ *              seconds: Time allowed for the state, or zero for no
+ *                       limit other than the session timeout.
+ */
+void reactor_set_timeout(int fd, int seconds) {
+
+  struct session_state *timeouts = find_session(fd);
+  if (!timeouts)
+    return;
+  timeouts->state_deadline = seconds > 0 ? now_ms() + seconds * 1000LL : 0;
+  if (timeouts != &thread_session)
+    coroutine_arm_timer(thread_sched->current);
+}
+
+/** Pauses a session for some time (e.g., to slow down a client over
+ *  its rate limit). In the reactor, other sessions run meanwhile, and
+ *  events in the socket don't end the pause.
+ *
+ *  Parameters: fd: Socket of the session.
+ *              ms: Time to pause, in milliseconds.
+ */
+void reactor_sleep(int fd, long ms) {
+
+  struct coroutine *co = thread_sched ? thread_sched->current : NULL;
+
+  reactor_flush_output(fd);
+  if (!co || co->fd != fd) {
+    poll(NULL, 0, ms);
+    return;
+  }
+  timer_add(&co->sched->wheel, &co->sleep_timer,
+	    (now_ms() + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+  swapcontext(&co->ctx, &co->sched->main_ctx);
+}
+
+/** Records whether the next command of a session was already received
+ *  (e.g., pipelined by the client), so its reply will follow the
+ *  current one. Called by the functions reading from the socket.
+ *
+ *  Parameters: fd: Socket of the session.
+ *              pending: Non-zero if more input is buffered.
+ */
+void reactor_set_input_pending(int fd, int pending) {
+
+  struct session_state *session = find_session(fd);
+  if (session)
+    session->input_pending = pending;
+}
+
+/** Checks if a reply may be held in the socket (sent with MSG_MORE)
+ *  to be coalesced with the next one, which is the case when the next
+ *  command was already received. Held replies are sent with the next
+ *  reply that is not held, or by reactor_flush_output.
+ *
+ *  Parameters: fd: Socket of the session.
+ *
+ *  Returns: non-zero if the reply may be held.
+ */
+int reactor_hold_output(int fd) {
+
+  struct session_state *session = find_session(fd);
+  if (!session)
+    return 0;
+  session->output_held = session->input_pending;
+  return session->output_held;
+}
+
+/** Sends the replies held in the socket of a session, if any. Called
+ *  automatically before waiting for input.
+ *
+ *  Parameters: fd: Socket of the session.
+ */
+void reactor_flush_output(int fd) {
+
+  struct session_state *session = find_session(fd);
+  int one = 1;
+  if (!session || !session->output_held)
+    return;
+  // Setting TCP_NODELAY pushes the data held by MSG_MORE
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  session->output_held = 0;
+}
@@ -0,0 +1,22 @@
+/* reactor.h
+ * Runs client sessions as coroutines on event-driven schedulers.
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+int reactor_init(int schedulers, int pin, int stats_interval);
+int reactor_cpu(int scheduler);
+int reactor_listen(int listen_fd, int scheduler,
+		   void (*handler)(int fd, void *arg), void *arg);
+void run_reactor(void);
+void reactor_drain(void);
+int reactor_wait(int fd, int events);
+void reactor_set_session_timeout(int fd, int seconds, const char *reply);
+void reactor_set_timeout(int fd, int seconds);
+void reactor_sleep(int fd, long ms);
+void reactor_set_input_pending(int fd, int pending);
+int reactor_hold_output(int fd);
+void reactor_flush_output(int fd);
+
+#endif
@@ -0,0 +1,157 @@
+/* reply.c
+ * Replies sent to clients, built once with the name of the host when
+ * the server starts, and helpers to build the replies that change.
+ *
+ * Notes: The host name is read with uname once, in reply_init, and
+ * every fixed reply is formatted then, so sending one of them is a
+ * single send of bytes whose length is known. Replies that depend on
+ * the session (e.g., with a number of messages or the name sent by
+ * the client) are built with the reply_put functions, which copy
+ * their pieces one after the other and return the end of the reply,
+ * with no formatting. Replies are never changed after reply_init, so
+ * all threads can send them.
+ */
+
+#include "reply.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/utsname.h>
+
+// Space for each fixed reply, enough for the longest one
+#define REPLY_MAX_SIZE (REPLY_MAX_HOST + 128)
+
+// Fixed replies, where %s is the host name
+static const char *templates[REPLY_COUNT] = {
+  [REPLY_SMTP_GREETING] = "220 %s service ready\r\n",
+  [REPLY_SMTP_OK] = "250 %s OK\r\n",
+  [REPLY_SMTP_SENDER_OK] = "250 %s Sender OK\r\n",
+  [REPLY_SMTP_RCPT_OK] = "250 %s RCPT OK\r\n",
+  [REPLY_SMTP_SENT] = "250 %s message successfully sent\r\n",
+  [REPLY_SMTP_CLOSING] = "221 %s closing connection\r\n",
+  [REPLY_SMTP_START_DATA] = "354 accepting data, end with <CRLF>.<CRLF>\r\n",
+  [REPLY_SMTP_BUSY] = "421 %s too many connections, try again later\r\n",
+  [REPLY_SMTP_TIMEOUT] = "421 %s timeout exceeded, closing connection\r\n",
+  [REPLY_SMTP_INVALID_RCPTS] = "421 %s too many invalid recipients, closing connection\r\n",
+  [REPLY_SMTP_NOT_RECOGNIZED] = "500 command not recognized\r\n",
+  [REPLY_SMTP_SYNTAX] = "501 Syntax error\r\n",
+  [REPLY_SMTP_NOT_IMPLEMENTED] = "502 command not implemented\r\n",
+  [REPLY_SMTP_OUT_OF_ORDER] = "503 command out of order\r\n",
+  [REPLY_SMTP_NO_MAILBOX] = "550 mailbox not accepted\r\n",
+  [REPLY_POP3_GREETING] = "+OK POP3 Server Ready for %s! Now enter username\r\n",
+  [REPLY_POP3_QUIT] = "+OK POP3 Server quitting...\r\n",
+  [REPLY_POP3_TIMEOUT] = "-ERR autologout timer expired\r\n",
+};
+
+static char host[REPLY_MAX_HOST + 1];
+static size_t host_len;
+static char replies[REPLY_COUNT][REPLY_MAX_SIZE];
+static size_t reply_lens[REPLY_COUNT];
+static int initialized = 0;
+
+// Two digits of each number from 0 to 99, for reply_put_uint
+static const char digit_pairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/** Reads the name of the host, and builds the fixed replies. Must be
+ *  called before the server is started; later calls do nothing, so
+ *  each protocol calls it when it is set up.
+ */
+void reply_init(void) {
+
+  struct utsname uName;
+  int i;
+
+  if (initialized)
+    return;
+  initialized = 1;
+  if (uname(&uName) < 0)
+    strcpy(uName.nodename, "localhost");
+  snprintf(host, sizeof(host), "%s", uName.nodename);
+  host_len = strlen(host);
+
+  for (i = 0; i < REPLY_COUNT; i++) {
+    snprintf(replies[i], REPLY_MAX_SIZE, templates[i], host);
+    reply_lens[i] = strlen(replies[i]);
+  }
+}
+
+/** Returns a fixed reply, as a string (e.g., for a listener's
+ *  busy_reply).
+ *
+ *  Parameters: reply: One of the REPLY_* constants.
+ */
+const char *reply_string(int reply) {
+
+  return replies[reply];
+}
+
+/** Sends a fixed reply to a client.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              reply: One of the REPLY_* constants.
+ *
+ *  Returns: The number of bytes sent, or -1 on error.
+ */
+int send_reply(int fd, int reply) {
+
+  return send_all(fd, replies[reply], reply_lens[reply]);
+}
+
+/** Appends bytes to a reply being built.
+ *
+ *  Parameters: out: End of the reply so far.
+ *              data: Bytes to be appended.
+ *              len: Number of bytes.
+ *
+ *  Returns: The new end of the reply.
+ */
+char *reply_put(char *out, const char *data, size_t len) {
+
+  memcpy(out, data, len);
+  return out + len;
+}
+
+/** Appends the name of the host (at most REPLY_MAX_HOST bytes) to a
+ *  reply being built.
+ *
+ *  Parameters: out: End of the reply so far.
+ *
+ *  Returns: The new end of the reply.
+ */
+char *reply_put_host(char *out) {
+
+  return reply_put(out, host, host_len);
+}
+
+/** Appends a number, in decimal, to a reply being built. Digits are
+ *  produced two at a time, from the end.
+ *
+ *  Parameters: out: End of the reply so far.
+ *              value: Number to be appended.
+ *
+ *  Returns: The new end of the reply.
+ */
+char *reply_put_uint(char *out, unsigned long value) {
+
+  char digits[24];
+  char *start = digits + sizeof(digits);
+
+  while (value >= 100) {
+    const char *pair = digit_pairs + (value % 100) * 2;
+    value /= 100;
+    *--start = pair[1];
+    *--start = pair[0];
+  }
+  if (value >= 10) {
+    const char *pair = digit_pairs + value * 2;
+    *--start = pair[1];
+    *--start = pair[0];
+  } else {
+    *--start = '0' + value;
+  }
+  return reply_put(out, start, digits + sizeof(digits) - start);
+}
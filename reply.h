@@ -0,0 +1,48 @@
+/* reply.h
+ * Replies sent to clients, built once with the name of the host when
+ * the server starts, and helpers to build the replies that change.
+ */
+
+#ifndef _REPLY_H_
+#define _REPLY_H_
+
+#include <stddef.h>
+
+// Longest host name in replies (longer names are cut)
+#define REPLY_MAX_HOST 64
+
+// Replies built by reply_init, where <host> is the name of the host
+enum {
+  REPLY_SMTP_GREETING,        // 220 <host> service ready
+  REPLY_SMTP_OK,              // 250 <host> OK
+  REPLY_SMTP_SENDER_OK,       // 250 <host> Sender OK
+  REPLY_SMTP_RCPT_OK,         // 250 <host> RCPT OK
+  REPLY_SMTP_SENT,            // 250 <host> message successfully sent
+  REPLY_SMTP_CLOSING,         // 221 <host> closing connection
+  REPLY_SMTP_START_DATA,      // 354 accepting data, end with <CRLF>.<CRLF>
+  REPLY_SMTP_BUSY,            // 421 <host> too many connections, ...
+  REPLY_SMTP_TIMEOUT,         // 421 <host> timeout exceeded, ...
+  REPLY_SMTP_INVALID_RCPTS,   // 421 <host> too many invalid recipients, ...
+  REPLY_SMTP_NOT_RECOGNIZED,  // 500 command not recognized
+  REPLY_SMTP_SYNTAX,          // 501 Syntax error
+  REPLY_SMTP_NOT_IMPLEMENTED, // 502 command not implemented
+  REPLY_SMTP_OUT_OF_ORDER,    // 503 command out of order
+  REPLY_SMTP_NO_MAILBOX,      // 550 mailbox not accepted
+  REPLY_POP3_GREETING,        // +OK POP3 Server Ready for <host>! ...
+  REPLY_POP3_QUIT,            // +OK POP3 Server quitting...
+  REPLY_POP3_TIMEOUT,         // -ERR autologout timer expired
+  REPLY_COUNT
+};
+
+// Copies a string literal to a reply being built, returning its end
+#define REPLY_PUT_STRING(out, str) reply_put((out), (str), sizeof(str) - 1)
+
+void reply_init(void);
+const char *reply_string(int reply);
+int send_reply(int fd, int reply);
+
+char *reply_put(char *out, const char *data, size_t len);
+char *reply_put_host(char *out);
+char *reply_put_uint(char *out, unsigned long value);
+
+#endif
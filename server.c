@@ -9,23 +9,96 @@
  * send_all.
  */
 
+#define _GNU_SOURCE // for accept4, pipe2, ppoll and execvpe
+
 #include "server.h"
+#include "netbuffer.h"
+#include "reactor.h"
+#include "admission.h"
+#include "log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "transport.h"
+#include "capture.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <poll.h>
+#include <linux/filter.h>
+
+#define SEND_STRING_BUFFER_SIZE 1024
+#define QUEUE_SIZE 1024 // accepted connections waiting for a thread (power of two)
+// Environment variables used to hand the listening socket to a new
+// server process on restart
+#define LISTEN_FD_ENV "SERVER_LISTEN_FD"
+#define READY_FD_ENV  "SERVER_READY_FD"
+#define MAX_LISTEN_SOCKETS 1024
+
+// Set by SIGHUP to start a new server process
+static volatile sig_atomic_t restart_requested = 0;
+// Command line of the server, used to start the new process
+static char **server_argv = NULL;
+// Sessions handled by threads in the pool, including queued ones
+static int pool_sessions = 0;
+// Counters taken by forked sessions, released by this process when the
+// child is reaped, so a child that crashes or is killed doesn't keep
+// them. Only changed with SIGCHLD blocked.
+static struct child_ticket {
+  pid_t pid;
+  struct admission_ticket ticket;
+} *child_tickets = NULL;
+static int child_ticket_count = 0, child_ticket_size = 0;
 
-#define BACKLOG 10     // how many pending connections queue will hold
+// A listening socket, bound to one of the addresses of a listener
+struct listen_socket {
+  int fd;
+  int scheduler;        // reactor scheduler accepting from it, or -1
+  const struct server_listener *listener;
+};
+static struct listen_socket sockets[MAX_LISTEN_SOCKETS];
+static int socket_count = 0;
+// Microseconds to busy poll client sockets, or 0
+static int busy_poll_usecs = 0;
+
+/** Signal handler used to request a restart.
+ */
+static void sighup_handler(int s) {
+  restart_requested = 1;
+}
+
+/** Internal function that releases the counters taken by the session
+ *  of a forked child, once the child is reaped. Must be called with
+ *  SIGCHLD blocked, or from its handler.
+ */
+static void release_child(pid_t pid) {
+
+  int i;
+  for (i = 0; i < child_ticket_count; i++) {
+    if (child_tickets[i].pid == pid) {
+      admission_leave(&child_tickets[i].ticket);
+      child_tickets[i] = child_tickets[--child_ticket_count];
+      return;
+    }
+  }
+}
 
 /** Signal handler used to destroy zombie children (forked) processes
  *  once they finish executing.
@@ -34,7 +107,9 @@ static void sigchld_handler(int s) {
 
   // waitpid() might overwrite errno, so we save and restore it:
   int saved_errno = errno;
-  while(waitpid(-1, NULL, WNOHANG) > 0);
+  pid_t pid;
+  while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    release_child(pid);
   errno = saved_errno;
 }
 
@@ -48,6 +123,309 @@ static void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+/** Lock-free bounded queue of accepted connections, shared by the
+ *  accepting thread and the threads in the pool (multiple producers,
+ *  multiple consumers). Each slot has a sequence number telling if it
+ *  is ready to be written or read in the current round, as described
+ *  by Dmitry Vyukov. A semaphore counts the connections in the queue,
+ *  so that idle threads sleep instead of spinning.
+ */
+static struct {
+  struct {
+    unsigned long seq;
+    int fd;
+    unsigned int session;       // log session ID
+    const struct server_listener *listener;
+    struct admission_ticket ticket;
+  } slots[QUEUE_SIZE];
+  // Positions are updated by different threads, so they are kept in
+  // separate cache lines
+  unsigned long tail __attribute__ ((aligned(64)));
+  unsigned long head __attribute__ ((aligned(64)));
+  sem_t items;
+} conn_queue;
+
+/** Internal function that sets the options of an accepted client
+ *  socket. Replies are sent as soon as they are ready; pipelined
+ *  replies are coalesced with MSG_MORE instead (see send_all).
+ */
+static void configure_client(int fd) {
+  
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (busy_poll_usecs) {
+    // Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usecs, sizeof(busy_poll_usecs)) == -1 ||
+	setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) == -1) {
+      log_error("setsockopt SO_BUSY_POLL: %s", strerror(errno));
+      busy_poll_usecs = 0;
+    }
+  }
+}
+
+/** Internal function that tells a client the server is over capacity,
+ *  with the reply of the listener where it connected. The reply is
+ *  only sent if it fits in the socket buffer, so the caller never
+ *  blocks.
+ */
+static void send_busy_reply(int fd, const struct server_listener *listener) {
+  
+  metrics_add(COUNTER_REFUSED, 1);
+  if (listener->busy_reply)
+    send(fd, listener->busy_reply, strlen(listener->busy_reply),
+	 MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/** Adds a connection to the queue.
+ *
+ *  Returns: 0 on success, or -1 if the queue is full.
+ */
+static int queue_push(int fd, const struct server_listener *listener,
+		      const struct admission_ticket *ticket) {
+  
+  unsigned long pos = __atomic_load_n(&conn_queue.tail, __ATOMIC_RELAXED);
+  while (1) {
+    unsigned long seq = __atomic_load_n(&conn_queue.slots[pos % QUEUE_SIZE].seq, __ATOMIC_ACQUIRE);
+    long diff = (long) (seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&conn_queue.tail, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&conn_queue.tail, __ATOMIC_RELAXED);
+    }
+  }
+  
+  conn_queue.slots[pos % QUEUE_SIZE].fd = fd;
+  conn_queue.slots[pos % QUEUE_SIZE].session = log_session;
+  conn_queue.slots[pos % QUEUE_SIZE].listener = listener;
+  conn_queue.slots[pos % QUEUE_SIZE].ticket = *ticket;
+  __atomic_store_n(&conn_queue.slots[pos % QUEUE_SIZE].seq, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&conn_queue.items);
+  return 0;
+}
+
+/** Removes a connection from the queue.
+ *
+ *  Returns: 0 on success, or -1 if the queue is empty.
+ */
+static int queue_pop(int *fd, const struct server_listener **listener,
+		     struct admission_ticket *ticket) {
+  
+  unsigned long pos = __atomic_load_n(&conn_queue.head, __ATOMIC_RELAXED);
+  while (1) {
+    unsigned long seq = __atomic_load_n(&conn_queue.slots[pos % QUEUE_SIZE].seq, __ATOMIC_ACQUIRE);
+    long diff = (long) (seq - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&conn_queue.head, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&conn_queue.head, __ATOMIC_RELAXED);
+    }
+  }
+  
+  *fd = conn_queue.slots[pos % QUEUE_SIZE].fd;
+  log_session = conn_queue.slots[pos % QUEUE_SIZE].session;
+  *listener = conn_queue.slots[pos % QUEUE_SIZE].listener;
+  *ticket = conn_queue.slots[pos % QUEUE_SIZE].ticket;
+  __atomic_store_n(&conn_queue.slots[pos % QUEUE_SIZE].seq, pos + QUEUE_SIZE, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/** Internal function that runs the handler of an admitted session,
+ *  recording it if sessions are captured, and traces its end.
+ */
+static void run_session(int fd, const struct server_listener *listener) {
+  
+  uint64_t start = PROBES_ENABLED ? metrics_now() : 0;
+  capture_begin(fd);
+  listener->handler(fd);
+  capture_end(fd);
+  PROBE3(session_close, log_session, fd, metrics_now() - start);
+}
+
+/** Main function of each thread in the pool: waits for connections in
+ *  the queue and calls the handler for each of them.
+ */
+static void *pool_worker(void *arg) {
+  
+  int fd;
+  const struct server_listener *listener;
+  struct admission_ticket ticket;
+  while (1) {
+    if (sem_wait(&conn_queue.items) < 0)
+      continue;
+    // The semaphore is posted after the connection is in the queue,
+    // but another slot may still be in the middle of an update
+    while (queue_pop(&fd, &listener, &ticket) < 0)
+      sched_yield();
+    run_session(fd, listener);
+    close(fd);
+    admission_leave(&ticket);
+    log_session = 0;
+    __atomic_sub_fetch(&pool_sessions, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/** Creates the queue and the threads in the pool.
+ */
+static void start_pool(int threads) {
+  
+  unsigned long i;
+  pthread_t thread;
+  
+  for (i = 0; i < QUEUE_SIZE; i++)
+    conn_queue.slots[i].seq = i;
+  conn_queue.head = conn_queue.tail = 0;
+  sem_init(&conn_queue.items, 0, 0);
+  
+  while (threads-- > 0) {
+    if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+}
+
+/** Internal function that runs a session in the reactor. Sessions are
+ *  admitted here, since the reactor accepts connections by itself;
+ *  refusing a client still costs much less than a forked process.
+ */
+static void reactor_session(int fd, void *arg) {
+  
+  const struct listen_socket *sock = arg;
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  struct admission_ticket ticket;
+  
+  char s[INET6_ADDRSTRLEN];
+  
+  if (getpeername(fd, (struct sockaddr *) &addr, &len) < 0)
+    return;
+  log_session_begin();
+  PROBE2(session_accept, log_session, fd);
+  inet_ntop(addr.ss_family, get_in_addr((struct sockaddr *) &addr), s, sizeof(s));
+  log_info("server: got connection from %s", s);
+  if (admission_enter((struct sockaddr *) &addr, &ticket) < 0) {
+    log_info("server: too many connections, refused");
+    send_busy_reply(fd, sock->listener);
+    return;
+  }
+  configure_client(fd);
+  run_session(fd, sock->listener);
+  admission_leave(&ticket);
+}
+
+/** Sets all options to their default values: a new process is forked
+ *  for each client, with no limit on the number of clients and no
+ *  rate limits.
+ *
+ *  Parameters: opts: Options to be initialized.
+ */
+void default_server_options(struct server_options *opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->backlog = SOMAXCONN;
+  opts->log_level = LOG_LEVEL_INFO;
+}
+
+/** Reads server options from the command line (see SERVER_USAGE in
+ *  server.h). Options not informed keep their default values.
+ *
+ *  Parameters: argc, argv: Arguments received by main.
+ *              opts: Options to be filled.
+ *
+ *  Returns: Index of the first argument after the options, or -1 if
+ *           an option is invalid.
+ */
+int parse_server_options(int argc, char *argv[], struct server_options *opts) {
+  
+  int opt;
+  default_server_options(opts);
+  server_argv = argv; // to start a new server on restart
+  while ((opt = getopt(argc, argv, "t:e:ps:S:l:b:L:vm:C:c:a:r:d:D:R")) != -1) {
+    switch (opt) {
+    case 't':
+      opts->threads = atoi(optarg);
+      if (opts->threads < 1)
+	return -1;
+      break;
+    case 'e':
+      opts->reactor = 1;
+      opts->schedulers = atoi(optarg);
+      break;
+    case 'p':
+      opts->pin = 1;
+      break;
+    case 's':
+      if (!strcmp(optarg, "cpu"))
+	opts->steer = STEER_CPU;
+      else if (!strcmp(optarg, "bpf"))
+	opts->steer = STEER_BPF;
+      else
+	return -1;
+      break;
+    case 'S':
+      opts->stats_interval = atoi(optarg);
+      if (opts->stats_interval < 1)
+	return -1;
+      break;
+    case 'l':
+      opts->busy_poll = atoi(optarg);
+      if (opts->busy_poll < 1)
+	return -1;
+      break;
+    case 'b':
+      opts->backlog = atoi(optarg);
+      if (opts->backlog < 1)
+	return -1;
+      break;
+    case 'L':
+      opts->log_file = optarg;
+      break;
+    case 'v':
+      opts->log_level = LOG_LEVEL_DEBUG;
+      break;
+    case 'm':
+      opts->admin = optarg;
+      break;
+    case 'C':
+      opts->capture = optarg;
+      break;
+    case 'c':
+      opts->max_clients = atoi(optarg);
+      break;
+    case 'a':
+      opts->max_per_addr = atoi(optarg);
+      break;
+    case 'r':
+      opts->conn_rate = atoi(optarg);
+      break;
+    case 'd':
+      opts->rcpt_rate = atoi(optarg);
+      break;
+    case 'D':
+      opts->data_rate = atoi(optarg);
+      break;
+    case 'R':
+      opts->no_rate_limits = 1;
+      break;
+    default:
+      return -1;
+    }
+  }
+  // Placement of threads only applies to the reactor
+  if (!opts->reactor && (opts->pin || opts->steer || opts->stats_interval))
+    return -1;
+  return optind;
+}
+
 /** Creates a server socket at the specified port number, listens for
  *  new connections and accepts them. A new forked process is created
  *  for each new client, calling the provided handler function for
@@ -63,65 +441,500 @@ static void *get_in_addr(struct sockaddr *sa) {
  */
 void run_server(const char *port, void (*handler)(int)) {
   
-  int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
-  struct addrinfo hints, *servinfo, *p;
-  struct sockaddr_storage their_addr; // connector's address information
-  socklen_t sin_size;
-  struct sigaction sa;
+  struct server_options opts;
+  default_server_options(&opts);
+  run_server_with_options(port, handler, &opts);
+}
+
+/** Internal function that checks if a socket is bound to an address.
+ */
+static int bound_to(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  
+  struct sockaddr_storage bound;
+  socklen_t len = sizeof(bound);
+  if (getsockname(fd, (struct sockaddr *) &bound, &len) < 0)
+    return 0;
+  return len == addrlen && !memcmp(&bound, addr, len);
+}
+
+/** Internal function that makes the kernel send each connection to
+ *  the socket, in a SO_REUSEPORT group, of the scheduler pinned to the
+ *  processor that received it. The BPF program compares the processor
+ *  with that of each scheduler, and returns the index of the socket in
+ *  the group (sockets are indexed in the order they were bound).
+ *  Processors without a scheduler are spread over all sockets.
+ */
+static void attach_steering_program(int sockfd, int schedulers) {
+  
+  struct sock_filter code[2 * MAX_LISTEN_SOCKETS + 3];
+  struct sock_fprog prog = { .filter = code };
+  int i, n = 0;
+  
+  // A = processor handling the packet
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+  for (i = 0; i < schedulers; i++) {
+    // if (A == cpu) return i
+    code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, reactor_cpu(i), 0, 1);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+  }
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, schedulers);
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+  prog.len = n;
+  
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+    perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+}
+
+/** Internal function that binds a listening socket to an address.
+ *  A socket handed over by a previous server process is used instead
+ *  of a new one if it is bound to the same address; it is removed from
+ *  the inherited list.
+ *
+ *  Returns: the socket, or -1 if it could not be bound.
+ */
+static int bind_socket(const struct addrinfo *p, int reuseport,
+		       int inherited[], int inherited_count) {
+  
+  int sockfd, i;
   int yes = 1;
-  char s[INET6_ADDRSTRLEN];
+  
+  for (i = 0; i < inherited_count; i++)
+    if (inherited[i] >= 0 && bound_to(inherited[i], p->ai_addr, p->ai_addrlen)) {
+      sockfd = inherited[i];
+      inherited[i] = -1;
+      return sockfd;
+    }
+  
+  // create socket object
+  if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+    perror("server: socket");
+    return -1;
+  }
+  
+  // specify that, once the program finishes, the port can be reused by other processes
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+    perror("setsockopt");
+    exit(1);
+  }
+  
+  // several sockets of this process share the address, one per scheduler
+  if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+    perror("setsockopt");
+    exit(1);
+  }
+  
+  // IPv6 sockets would also take IPv4 connections, so the IPv4
+  // address could not be bound separately
+  if (p->ai_family == AF_INET6 &&
+      setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(int)) == -1) {
+    perror("setsockopt");
+    exit(1);
+  }
+  
+  // bind to the specified port number
+  if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+    close(sockfd);
+    perror("server: bind");
+    return -1;
+  }
+  return sockfd;
+}
+
+/** Internal function that creates the listening sockets for a
+ *  listener, one for each address it resolves to (e.g., both IPv4 and
+ *  IPv6 when no address is given).
+ *
+ *  If connections are steered to reactor schedulers, each address gets
+ *  a SO_REUSEPORT socket per scheduler instead, marked with the
+ *  processor of the scheduler.
+ */
+static void open_listener(const struct server_listener *listener,
+			  int inherited[], int inherited_count,
+			  const struct server_options *opts, int schedulers) {
+  
+  int sockfd, k, opened = 0;
+  int copies = opts->steer ? schedulers : 1;
+  struct addrinfo hints, *servinfo, *p;
   int rv;
   
   memset(&hints, 0, sizeof hints);
-  hints.ai_family   = AF_UNSPEC;   // use IPv4 or IPv6, whichever is available
+  hints.ai_family   = AF_UNSPEC;   // use IPv4 and IPv6, whichever is available
   hints.ai_socktype = SOCK_STREAM; // create a stream (TCP) socket server
   hints.ai_flags    = AI_PASSIVE;  // use any available connection
   
   // Gets information about available socket types and protocols
-  if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+  if ((rv = getaddrinfo(listener->address, listener->port, &hints, &servinfo)) != 0) {
     fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
     exit(1);
   }
   
-  // loop through all the results and bind to the first we can
+  // loop through all the results and bind to all we can
   for(p = servinfo; p != NULL; p = p->ai_next) {
+    int first = socket_count;
     
-    // create socket object
-    if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-      perror("server: socket");
-      continue;
+    for (k = 0; k < copies; k++) {
+      if (socket_count == MAX_LISTEN_SOCKETS) {
+	fprintf(stderr, "server: too many listening sockets\n");
+	exit(1);
+      }
+      if ((sockfd = bind_socket(p, opts->steer, inherited, inherited_count)) < 0)
+	break;
+      if (opts->steer) {
+	int cpu = reactor_cpu(k);
+	if (setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+	  perror("setsockopt SO_INCOMING_CPU");
+      }
+      sockets[socket_count].fd = sockfd;
+      sockets[socket_count].scheduler = opts->steer ? k : -1;
+      sockets[socket_count].listener = listener;
+      socket_count++;
+      opened++;
     }
     
-    // specify that, once the program finishes, the port can be reused by other processes
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-      perror("setsockopt");
-      exit(1);
-    }
-    
-    // bind to the specified port number
-    if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-      close(sockfd);
-      perror("server: bind");
-      continue;
-    }
-    
-    // if the code reaches this point, the socket was properly created and bound
-    break;
+    if (opts->steer == STEER_BPF && socket_count > first)
+      attach_steering_program(sockets[first].fd, schedulers);
   }
   
   // all done with this structure
   freeaddrinfo(servinfo);
   
-  // if p is null, the loop above could create a socket for any given address
-  if (p == NULL)  {
-    fprintf(stderr, "server: failed to bind\n");
+  // if nothing was opened, the loop above could not create a socket
+  // for any given address
+  if (!opened)  {
+    fprintf(stderr, "server: failed to bind %s port %s\n",
+	    listener->address ? listener->address : "*", listener->port);
     exit(1);
   }
+}
+
+/** Internal function that reads the listening sockets handed over by
+ *  a previous server process on restart.
+ *
+ *  Returns: the number of sockets stored in fds.
+ */
+static int inherited_listeners(int fds[], int max) {
   
-  // sets up a queue of incoming connections to be received by the server
-  if (listen(sockfd, BACKLOG) == -1) {
-    perror("listen");
+  char *env = getenv(LISTEN_FD_ENV);
+  int count = 0;
+  if (!env)
+    return 0;
+  while (*env && count < max) {
+    char *end;
+    int fd = strtol(env, &end, 10);
+    if (end == env)
+      break;
+    if (fcntl(fd, F_GETFD) >= 0)
+      fds[count++] = fd;
+    env = *end == ',' ? end + 1 : end;
+  }
+  unsetenv(LISTEN_FD_ENV);
+  return count;
+}
+
+/** Internal function that tells the previous server process, if this
+ *  process was started by a restart, that it can stop accepting
+ *  connections.
+ */
+static void notify_ready(void) {
+  
+  char *env = getenv(READY_FD_ENV);
+  if (!env)
+    return;
+  unsetenv(READY_FD_ENV);
+  int fd = atoi(env);
+  if (write(fd, "", 1) < 0)
+    perror("server: notify ready");
+  close(fd);
+}
+
+/** Internal function that starts a new server process (e.g., a new
+ *  version of the binary) with the same command line, handing it the
+ *  listening sockets. The new process is not a child of this one, so
+ *  draining the sessions in this process doesn't wait for it.
+ *
+ *  Returns: a file descriptor that becomes readable when the new
+ *           process is accepting connections (one byte is available)
+ *           or failed to start (end of file), or -1 on error.
+ */
+static int start_new_server(void) {
+  
+  extern char **environ;
+  int ready[2], n = 0, i, j;
+  char listen_env[sizeof(LISTEN_FD_ENV) + MAX_LISTEN_SOCKETS * 12], ready_env[32];
+  
+  if (!server_argv) {
+    fprintf(stderr, "server: restart needs parse_server_options\n");
+    return -1;
+  }
+  if (pipe2(ready, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  
+  // The environment is prepared before forking, since only a few
+  // functions are safe in the child of a multithreaded process
+  n = snprintf(listen_env, sizeof(listen_env), LISTEN_FD_ENV "=");
+  for (i = 0; i < socket_count; i++)
+    n += snprintf(listen_env + n, sizeof(listen_env) - n, i ? ",%d" : "%d", sockets[i].fd);
+  n = 0;
+  snprintf(ready_env, sizeof(ready_env), READY_FD_ENV "=%d", ready[1]);
+  while (environ[n])
+    n++;
+  char **envp = malloc((n + 3) * sizeof(char *));
+  for (i = n = 0; environ[i]; i++)
+    if (strncmp(environ[i], LISTEN_FD_ENV "=", sizeof(LISTEN_FD_ENV)) &&
+	strncmp(environ[i], READY_FD_ENV "=", sizeof(READY_FD_ENV)))
+      envp[n++] = environ[i];
+  envp[n++] = listen_env;
+  envp[n++] = ready_env;
+  envp[n] = NULL;
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (fork() == 0) {
+      // Client connections and files must not leak into the new server
+      for (i = 3; i < max_fd; i++) {
+	int keep = i == ready[1];
+	for (j = 0; j < socket_count; j++)
+	  keep |= i == sockets[j].fd;
+	if (!keep)
+	  close(i);
+	else
+	  fcntl(i, F_SETFD, 0);
+      }
+      execvpe(server_argv[0], server_argv, envp);
+      _exit(127);
+    }
+    _exit(0);
+  }
+  free(envp);
+  close(ready[1]);
+  if (pid < 0) {
+    perror("fork");
+    close(ready[0]);
+    return -1;
+  }
+  waitpid(pid, NULL, 0);
+  return ready[0];
+}
+
+/** Internal function that accepts a connection and starts a session
+ *  for it, in a forked process or in the thread pool.
+ */
+static void accept_client(const struct listen_socket *sock,
+			  const struct server_options *opts) {
+  
+  int new_fd;
+  struct sockaddr_storage their_addr; // connector's address information
+  socklen_t sin_size;
+  char s[INET6_ADDRSTRLEN];
+  
+  // wait for new client to connect; the listening socket is shared
+  // with a new server during a restart, so it may have been taken
+  sin_size = sizeof(their_addr);
+  new_fd = accept4(sock->fd, (struct sockaddr *)&their_addr, &sin_size, SOCK_CLOEXEC);
+  if (new_fd == -1) {
+    if (errno != EAGAIN && errno != EINTR)
+      log_error("accept: %s", strerror(errno));
+    return;
+  }
+  
+  log_session_begin();
+  PROBE2(session_accept, log_session, new_fd);
+  inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
+	    s, sizeof(s));
+  log_info("server: got connection from %s", s);
+  
+  struct admission_ticket ticket;
+  if (admission_enter((struct sockaddr *) &their_addr, &ticket) < 0) {
+    log_info("server: too many connections, refused");
+    send_busy_reply(new_fd, sock->listener);
+    close(new_fd);
+    log_session = 0;
+    return;
+  }
+  
+  // Sessions wait for the socket in reactor_wait, which enforces
+  // their timeouts
+  fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+  configure_client(new_fd);
+  
+  // Hand the client to a thread in the pool
+  if (opts->threads > 0) {
+    __atomic_add_fetch(&pool_sessions, 1, __ATOMIC_RELAXED);
+    if (queue_push(new_fd, sock->listener, &ticket) < 0) {
+      log_warning("server: connection queue full");
+      send_busy_reply(new_fd, sock->listener);
+      close(new_fd);
+      admission_leave(&ticket);
+      __atomic_sub_fetch(&pool_sessions, 1, __ATOMIC_RELAXED);
+    }
+    log_session = 0;
+    return;
+  }
+  
+  // The ticket is kept by the parent, which releases it when the
+  // child is reaped; SIGCHLD is blocked until it is stored, so a child
+  // that exits at once is not reaped before
+  sigset_t chld_mask, old_mask;
+  sigemptyset(&chld_mask);
+  sigaddset(&chld_mask, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &chld_mask, &old_mask);
+  if (ticket.admitted && child_ticket_count == child_ticket_size) {
+    int size = child_ticket_size ? child_ticket_size * 2 : 64;
+    struct child_ticket *tickets = realloc(child_tickets, size * sizeof(*tickets));
+    if (!tickets) {
+      pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+      log_warning("server: no memory for a new session");
+      send_busy_reply(new_fd, sock->listener);
+      close(new_fd);
+      admission_leave(&ticket);
+      log_session = 0;
+      return;
+    }
+    child_tickets = tickets;
+    child_ticket_size = size;
+  }
+
+  // Create a new process to handle the new client; parent process
+  // will wait for another client
+  pid_t pid = fork();
+  if (!pid) {
+    // this is the child process; it doesn't need the listeners
+    int i;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    for (i = 0; i < socket_count; i++)
+      close(sockets[i].fd);
+    run_session(new_fd, sock->listener);
+    close(new_fd);
+    // Buffered output belongs to the parent (e.g., its log writer), so
+    // it must not be written again by the child
+    _exit(0);
+  }
+  
+  // Parent proceeds from here. In parent, client socket is not needed.
+  if (pid < 0) {
+    log_error("fork: %s", strerror(errno));
+    admission_leave(&ticket);
+  } else if (ticket.admitted) {
+    child_tickets[child_ticket_count].pid = pid;
+    child_tickets[child_ticket_count].ticket = ticket;
+    child_ticket_count++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  log_session = 0;
+  close(new_fd);
+}
+
+/** Internal function that stops accepting connections, once a new
+ *  server process is accepting them, and waits until all sessions in
+ *  this process are finished.
+ */
+static void drain_sessions(const struct server_options *opts) {
+  
+  int i;
+  if (opts->reactor) {
+    reactor_drain();
+    return;
+  }
+  for (i = 0; i < socket_count; i++)
+    close(sockets[i].fd);
+  if (opts->threads > 0) {
+    while (__atomic_load_n(&pool_sessions, __ATOMIC_RELAXED) > 0)
+      poll(NULL, 0, 100);
+  } else {
+    // Forked children are reaped here or in sigchld_handler
+    sigset_t chld_mask, old_mask;
+    pid_t pid;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld_mask, &old_mask);
+    while ((pid = waitpid(-1, NULL, 0)) > 0 || errno == EINTR)
+      if (pid > 0)
+        release_child(pid);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  }
+}
+
+/** Same as run_server, but with options for how clients are
+ *  handled. If opts->threads is set, a pool with that number of
+ *  threads is created, and accepted connections are handed to the
+ *  threads through a queue instead of forking. If opts->reactor is
+ *  set, each connection is handled in a coroutine by one of
+ *  opts->schedulers event-driven threads (see reactor.c). In both
+ *  cases, the handler must be thread-safe.
+ *
+ *  Clients over the limits in opts->max_clients, opts->max_per_addr
+ *  and opts->conn_rate are sent opts->busy_reply and closed right
+ *  away, without creating a process or using a thread. Clients over
+ *  opts->rcpt_rate or opts->data_rate are slowed down by the protocol.
+ *
+ *  On SIGHUP, the server is restarted without refusing connections:
+ *  the program is started again (if options were read with
+ *  parse_server_options) and receives the listening sockets. Once the
+ *  new process is accepting connections, this process stops accepting
+ *  them, waits for its sessions to finish, and exits.
+ *
+ *  Parameters: port, handler: Same as in run_server.
+ *              opts: Server options.
+ */
+void run_server_with_options(const char *port, void (*handler)(int),
+			     const struct server_options *opts) {
+  
+  struct server_listener listener = { NULL, port, handler, opts->busy_reply };
+  run_servers(&listener, 1, opts);
+}
+
+/** Same as run_server_with_options, but accepting connections on
+ *  several listeners, each with its own address, port and handler
+ *  (e.g., SMTP and POP3 served by the same process). The limits in
+ *  opts apply to all listeners together; opts->busy_reply is not
+ *  used, since each listener has its own. Does not return.
+ *
+ *  Parameters: listeners: Listeners to be opened. The array must
+ *                         remain valid while the server runs.
+ *              count: Number of listeners.
+ *              opts: Server options.
+ */
+void run_servers(const struct server_listener *listeners, int count,
+		 const struct server_options *opts) {
+  
+  struct sigaction sa;
+  int ready_fd = -1; // new server process being started, if any
+  int inherited[MAX_LISTEN_SOCKETS];
+  int inherited_count = inherited_listeners(inherited, MAX_LISTEN_SOCKETS);
+  int i, schedulers = 0;
+  
+  // The log is shared by all sessions, so it is set up before any
+  // process or thread is created
+  if (log_init(opts->log_file, opts->log_level) < 0)
     exit(1);
+  
+  // The sockets opened depend on the schedulers, when connections are
+  // steered to them
+  if (opts->reactor)
+    schedulers = reactor_init(opts->schedulers, opts->pin || opts->steer,
+			      opts->stats_interval);
+  for (i = 0; i < count; i++)
+    open_listener(&listeners[i], inherited, inherited_count, opts, schedulers);
+  // Sockets inherited for listeners removed from the configuration
+  for (i = 0; i < inherited_count; i++)
+    if (inherited[i] >= 0)
+      close(inherited[i]);
+  
+  for (i = 0; i < socket_count; i++) {
+    // sets up a queue of incoming connections to be received by the
+    // server (for an inherited socket, only updates its size)
+    if (listen(sockets[i].fd, opts->backlog) == -1) {
+      perror("listen");
+      exit(1);
+    }
+    // The listening sockets may be shared with another server during
+    // a restart, so a connection may be gone by the time accept is
+    // called
+    fcntl(sockets[i].fd, F_SETFL, fcntl(sockets[i].fd, F_GETFL) | O_NONBLOCK);
   }
   
   // set up a signal handler to kill zombie forked processes when they exit
@@ -133,35 +946,106 @@ void run_server(const char *port, void (*handler)(int)) {
     exit(1);
   }
   
-  printf("server: waiting for connections...\n");
+  // SIGHUP is only handled while the main thread waits for events, so
+  // it is blocked before any thread is created
+  sigset_t hup_mask, wait_mask;
+  sigemptyset(&hup_mask);
+  sigaddset(&hup_mask, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &hup_mask, &wait_mask);
+  sigdelset(&wait_mask, SIGHUP);
+  sa.sa_handler = sighup_handler;
+  sa.sa_flags = 0;
+  if (sigaction(SIGHUP, &sa, NULL) == -1) {
+    perror("sigaction");
+    exit(1);
+  }
+  
+  // a client closing the connection while a file is being sent
+  // should not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  
+  busy_poll_usecs = opts->busy_poll;
+  nb_set_busy_poll(opts->busy_poll);
+  // After a quiet period, an address may use a minute of each rate at
+  // once
+  if (opts->conn_rate > 0)
+    rate_limit_set(RATE_CONNECTIONS, opts->conn_rate / 60.0, opts->conn_rate);
+  if (opts->rcpt_rate > 0)
+    rate_limit_set(RATE_RECIPIENTS, opts->rcpt_rate / 60.0, opts->rcpt_rate);
+  if (opts->data_rate > 0) {
+    double bytes = opts->data_rate * 1024.0;
+    rate_limit_set(RATE_DATA_BYTES, bytes, bytes * 60 < UINT_MAX ? bytes * 60 : UINT_MAX);
+  }
+  if (opts->no_rate_limits)
+    for (i = 0; i < RATE_KINDS; i++)
+      rate_limit_set(i, 0, 0);
+  if (admission_init(opts->max_clients, opts->max_per_addr) < 0)
+    exit(1);
+  if (opts->admin && metrics_init() < 0)
+    exit(1);
+  if (opts->capture && capture_open(opts->capture) < 0)
+    exit(1);
+  if (opts->threads > 0)
+    start_pool(opts->threads);
+  
+  if (opts->reactor) {
+    for (i = 0; i < socket_count; i++)
+      reactor_listen(sockets[i].fd, sockets[i].scheduler, reactor_session, &sockets[i]);
+    run_reactor();
+  }
+  
+  log_info("server: waiting for connections...");
+  if (opts->admin)
+    metrics_serve(opts->admin);
+  notify_ready();
   
   while(1) {
-    // wait for new client to connect
-    sin_size = sizeof(their_addr);
-    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-    if (new_fd == -1) {
-      perror("accept");
-      continue;
+    struct pollfd fds[MAX_LISTEN_SOCKETS + 1];
+    int nfds = 0;
+    
+    if (restart_requested && ready_fd < 0) {
+      ready_fd = start_new_server();
+      log_info("server: restarting");
     }
+    restart_requested = 0;
     
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-	      s, sizeof(s));
-    printf("server: got connection from %s\n", s);
+    // In the reactor, connections are accepted by the schedulers
+    if (!opts->reactor) {
+      for (i = 0; i < socket_count; i++) {
+	fds[nfds].fd = sockets[i].fd;
+	fds[nfds++].events = POLLIN;
+      }
+    }
+    if (ready_fd >= 0) {
+      fds[nfds].fd = ready_fd;
+      fds[nfds++].events = POLLIN;
+    }
+    if (ppoll(fds, nfds, NULL, &wait_mask) < 0)
+      continue;
     
-    // Create a new process to handle the new client; parent process
-    // will wait for another client.
-    if (!fork()) {
-      // this is the child process
-      close(sockfd); // child doesn't need the listener
-      handler(new_fd);
-      close(new_fd);
-      exit(0);
+    if (ready_fd >= 0 && fds[nfds - 1].revents) {
+      char c;
+      int started = read(ready_fd, &c, 1) == 1;
+      close(ready_fd);
+      ready_fd = -1;
+      if (started)
+	break;
+      log_error("server: new server failed to start");
     }
     
-    // Parent proceeds from here. In parent, client socket is not needed.
-    close(new_fd);
+    if (!opts->reactor)
+      for (i = 0; i < socket_count; i++)
+	if (fds[i].revents & POLLIN)
+	  accept_client(&sockets[i], opts);
   }
-
+  
+  // The new server takes over the admin socket
+  metrics_stop_serving();
+  log_info("server: new server started, finishing sessions");
+  drain_sessions(opts);
+  log_info("server: sessions finished, exiting");
+  log_flush();
+  exit(0);
 }
 
 /** Sends a buffer of data, until all data is sent or an error is
@@ -175,6 +1059,10 @@ void run_server(const char *port, void (*handler)(int)) {
  *  the program, this function will be able to return an error that
  *  can be handled by the caller.
  *
+ *  If the client already sent its next command, the data is sent with
+ *  MSG_MORE, to be coalesced with the next reply (see
+ *  reactor_hold_output in reactor.c).
+ *
  *  Parameters: fd: Socket file descriptor.
  *              buf: Buffer where data to be sent is stored.
  *              size: Number of bytes to be used in the buffer.
@@ -185,8 +1073,17 @@ void run_server(const char *port, void (*handler)(int)) {
 int send_all(int fd, char buf[], size_t size) {
   
   size_t rem = size;
+  // Replies to pipelined commands are held until the last one, so they
+  // are sent together
+  int flags = MSG_NOSIGNAL | (reactor_hold_output(fd) ? MSG_MORE : 0);
   while (rem > 0) {
-    int rv = send(fd, buf, rem, MSG_NOSIGNAL);
+    int rv = transport_send(fd, buf, rem, flags);
+    // Non-blocking socket with a full send buffer: wait for space
+    if (rv < 0 && errno == EAGAIN) {
+      if (reactor_wait(fd, POLLOUT) < 0)
+	return -1;
+      continue;
+    }
     // If there was an error, interrupt sending and returns an error
     if (rv <= 0)
       return rv;
@@ -196,6 +1093,37 @@ int send_all(int fd, char buf[], size_t size) {
   return size;
 }
 
+/** Sends a range of bytes from a file, until all data is sent or an
+ *  error is received. The data is copied by the kernel directly from
+ *  the file into the socket, without passing through user space.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              file_fd: File descriptor of the file to be sent.
+ *              offset: Position in the file of the first byte to send.
+ *              size: Number of bytes to be sent.
+ *
+ *  Returns: If the range was successfully sent, returns
+ *           size. Otherwise, returns -1.
+ */
+int send_file(int fd, int file_fd, off_t offset, size_t size) {
+  
+  size_t rem = size;
+  while (rem > 0) {
+    ssize_t rv = transport_sendfile(fd, file_fd, &offset, rem);
+    if (rv < 0 && errno == EAGAIN) {
+      if (reactor_wait(fd, POLLOUT) < 0)
+	return -1;
+      continue;
+    }
+    // If there was an error (or the file is shorter than expected),
+    // interrupt sending and returns an error
+    if (rv <= 0)
+      return -1;
+    rem -= rv;
+  }
+  return size;
+}
+
 /** Sends a potentially-formatted string to a socket descriptor. The
  *  string can contain format directives (e.g., %d, %s, %u), which
  *  will be translated using a printf-like behaviour. For example, you
@@ -214,33 +1142,34 @@ int send_all(int fd, char buf[], size_t size) {
  */
 int send_string(int fd, const char *str, ...) {
   
-  static char *buf = NULL;
-  static int bufsize = 0;
+  // Most replies fit in a buffer on the stack; longer ones are
+  // formatted in a buffer allocated for this call only, so that the
+  // function can be used by multiple threads at once
+  char stack_buf[SEND_STRING_BUFFER_SIZE];
+  char *buf = stack_buf;
   va_list args;
-  int strsize;
+  int strsize, rv;
   
-  // Start with string length, increase later if needed
-  if (bufsize < strlen(str) + 1) {
-    bufsize = strlen(str) + 1;
-    buf = realloc(buf, bufsize);
-  }
+  // Strings with no directives are sent as they are
+  if (!strchr(str, '%'))
+    return send_all(fd, (char *) str, strlen(str));
   
-  while (1) {
-    
+  va_start(args, str);
+  strsize = vsnprintf(buf, sizeof(stack_buf), str, args);
+  va_end(args);
+  
+  if (strsize < 0)
+    return -1;
+  
+  if (strsize >= sizeof(stack_buf)) {
+    buf = malloc(strsize + 1);
     va_start(args, str);
-    strsize = vsnprintf(buf, bufsize, str, args);
+    vsnprintf(buf, strsize + 1, str, args);
     va_end(args);
-    
-    if (strsize < 0)
-      return -1;
-    
-    // If buffer was enough to fit entire string, send it
-    if (strsize < bufsize)
-      return send_all(fd, buf, strsize);
-    
-    // Try again with more space
-    bufsize = strsize + 1;
-    buf = realloc(buf, bufsize);
   }
+  
+  rv = send_all(fd, buf, strsize);
+  if (buf != stack_buf)
+    free(buf);
+  return rv;
 }
-
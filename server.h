@@ -8,10 +8,75 @@
 #define _SERVER_H_
 
 #include <stdio.h>
+#include <sys/types.h>
+
+// Command line syntax accepted by parse_server_options
+#define SERVER_OPTIONS_USAGE "[-t threads | " \
+  "-e schedulers [-p] [-s cpu|bpf] [-S seconds]] [-l busy poll usecs] " \
+  "[-b backlog] [-L log file] [-v] [-m admin socket path or port] " \
+  "[-C capture file] " \
+  "[-c max clients] [-a max clients per address] " \
+  "[-r connections per minute per address] " \
+  "[-d recipients per minute per address] " \
+  "[-D message kilobytes per second per address] [-R]"
+#define SERVER_USAGE SERVER_OPTIONS_USAGE " <port>"
+
+// How connections are steered to the schedulers of the reactor
+#define STEER_NONE 0 // a listening socket shared by all schedulers
+#define STEER_CPU  1 // a socket per scheduler, selected by SO_INCOMING_CPU
+#define STEER_BPF  2 // a socket per scheduler, selected by a BPF program
+
+struct server_options {
+  int threads;    // number of threads in the pool, or 0 to fork for each client
+  int reactor;    // handle clients in coroutines (see reactor.h)
+  int schedulers; // reactor threads, or 0 for one per processor
+  int pin;        // pin each reactor thread to a processor
+  int steer;      // STEER_*: send connections to the reactor thread
+                  // on the processor receiving them (implies pin)
+  int stats_interval; // seconds between reports of reactor thread
+                      // counters, or 0
+  int backlog;    // connections waiting to be accepted
+  int busy_poll;  // microseconds to busy poll sockets for commands
+                  // (SO_BUSY_POLL and spinning in nb_read_line), or 0
+  int max_clients;  // concurrent clients, or 0 for no limit
+  int max_per_addr; // concurrent clients per address (IPv6: per /64),
+                    // or 0 for no limit
+  int conn_rate;    // new connections per minute per address, or 0
+  int rcpt_rate;    // SMTP recipients per minute per address, or 0
+  int data_rate;    // SMTP message kilobytes per second per address,
+                    // or 0
+  int no_rate_limits; // ignore all rate limits per address, including
+                      // those set above
+  const char *busy_reply; // sent to clients over the limits, or NULL
+  const char *log_file;   // file the log is appended to, or NULL for
+                          // the standard output
+  int log_level;          // most verbose level logged (see log.h)
+  const char *admin;      // Unix socket path or local TCP port where
+                          // metrics are served (see metrics.h), or NULL
+  const char *capture;    // file where sessions are recorded, to be
+                          // replayed (see capture.h), or NULL
+};
+
+// A socket where connections are accepted, and how they are handled
+struct server_listener {
+  const char *address;    // host or address to bind, or NULL for all
+                          // addresses (IPv4 and IPv6)
+  const char *port;       // port number or service name
+  void (*handler)(int);   // called for each accepted connection
+  const char *busy_reply; // sent to clients over the limits, or NULL
+};
+
+void default_server_options(struct server_options *opts);
+int parse_server_options(int argc, char *argv[], struct server_options *opts);
 
 void run_server(const char *port, void (*handler)(int));
+void run_server_with_options(const char *port, void (*handler)(int),
+			     const struct server_options *opts);
+void run_servers(const struct server_listener *listeners, int count,
+		 const struct server_options *opts);
 
 int send_all(int fd, char buf[], size_t size);
+int send_file(int fd, int file_fd, off_t offset, size_t size);
 
 // The attribute in this function allows gcc to provided useful
 // warnings when compiling the code.
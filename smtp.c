@@ -0,0 +1,888 @@
+#include "smtp.h"
+#include "netbuffer.h"
+#include "arena.h"
+#include "reply.h"
+#include "mailuser.h"
+#include "server.h"
+#include "mailpath.h"
+#include "reactor.h"
+#include "admission.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define MAX_LINE_LENGTH 1024
+// largest message accepted, announced through the SIZE extension (RFC 1870)
+#define MAX_MESSAGE_SIZE 10485760
+// size of the block used to write message data to the spool file
+#define WRITE_BLOCK_SIZE 65536
+// size of the blocks of the session arena, enough for the recipients of
+// most transactions
+#define SESSION_ARENA_SIZE 4096
+// unknown recipients accepted in a session before it is dropped
+#define MAX_REJECTED_RCPTS 20
+// timeouts in seconds, based on RFC 5321 section 4.5.3.2
+#define GREETING_TIMEOUT 300    // to send HELO/EHLO after connecting
+#define COMMAND_TIMEOUT 300     // to send each command
+#define DATA_BLOCK_TIMEOUT 180  // to send each block of message data
+#define SESSION_TIMEOUT 1800    // for the whole session
+
+struct user_list {
+  char *user;
+  struct user_list *next;
+};
+
+// parameters sent with MAIL FROM
+struct mail_params {
+  unsigned long size;   // SIZE=n (RFC 1870), 0 if not sent
+  int binary;           // 1 if BODY=BINARYMIME (RFC 3030)
+};
+
+// message being received in BDAT chunks (RFC 3030)
+struct chunked_mail {
+  int fd;               // temporary file, -1 before the first chunk
+  char file[16];        // name of the temporary file
+  size_t size;          // bytes received so far
+};
+
+static void handle_client(int fd);
+int receive_helo(int fd, net_buffer_t nb, struct metrics_timer* timer);
+void send_ehlo(int fd, char* name);
+void handle_mail(int fd, net_buffer_t nb, arena_t arena, int esmtp,
+                 const struct client_key* client, struct metrics_timer* timer);
+int check_address(int fd, char* rest, int flags, struct mail_path* path,
+                  struct mail_params* params);
+int discard_line(net_buffer_t nb, char* buf);
+int save_file(int fd, net_buffer_t nb, arena_t arena, user_list_t rcpts,
+              const struct client_key* client);
+int save_chunk(int fd, net_buffer_t nb, char* rest, int in_order,
+               struct chunked_mail* mail, user_list_t rcpts,
+               const struct client_key* client);
+int stuff_chunked_mail(struct chunked_mail* mail);
+void throttle_data(int fd, const struct client_key* client, size_t size);
+
+// Sets up a listener to serve SMTP: its handler and the reply for
+// clients over the connection limits. Recipients and message data are
+// throttled per client address only if the server options set their
+// rates. Must be called before the server is started.
+void smtp_setup(struct server_listener* listener) {
+
+  // replies with the host name are built once, for all sessions
+  reply_init();
+  // clients over the connection limits are refused with 421
+  listener->handler = handle_client;
+  listener->busy_reply = reply_string(REPLY_SMTP_BUSY);
+}
+
+void handle_client(int fd) {
+
+  // each command is timed until the next one is read
+  struct metrics_timer timer = {-1, 0};
+  metrics_start(&timer, METRIC_SMTP_GREETING);
+
+  // sessions that time out are told so before being closed
+  reactor_set_session_timeout(fd, SESSION_TIMEOUT, reply_string(REPLY_SMTP_TIMEOUT));
+  reactor_set_timeout(fd, GREETING_TIMEOUT);
+
+  // a single buffer for the whole session, so that pipelined
+  // commands and data are not lost between reads
+  net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+  // recipients and message data are allocated from the session arena,
+  // which is reset after each transaction and freed at once at the end
+  arena_t arena = arena_create(SESSION_ARENA_SIZE);
+  if (!arena) {
+  	send_string(fd, "421 not enough memory, closing connection\r\n");
+  	metrics_stop(&timer);
+  	nb_destroy(nb);
+  	return;
+  }
+  send_reply(fd, REPLY_SMTP_GREETING);
+  int quit = receive_helo(fd, nb, &timer);
+  if (quit != 1) {
+  	// rate limits are kept per client address
+  	struct client_key client;
+  	client_key_from_socket(fd, &client);
+  	handle_mail(fd, nb, arena, quit == 2, &client, &timer);
+  }
+  metrics_stop(&timer);
+  arena_destroy(arena);
+  nb_destroy(nb);
+}
+
+// receives the initial HELO or EHLO message
+// also handles NOOP and QUIT
+// Returns 0 if HELO was sent, 1 if QUIT was sent, 2 if EHLO was sent
+int receive_helo(int fd, net_buffer_t nb, struct metrics_timer* timer) {
+  // commands before HELO are handled in a loop, so that a client
+  // sending many of them doesn't grow the stack
+  while (1) {
+    char buf[MAX_LINE_LENGTH + 1];
+    metrics_stop(timer);
+    int result = nb_read_line(nb, buf);
+
+    // connection was closed
+    if (result <= 0) {
+    	return 1;
+    }
+    log_debug("smtp: received %s", buf);
+
+    // line too long
+    if (buf[result - 1] != '\n') {
+    	if (discard_line(nb, buf) <= 0) {
+    	  return 1;
+    	}
+    	send_string(fd, "552 line exceeded max size\r\n");
+    	continue;
+    }
+
+    // grab the command by cutting off at spacebar
+    char code[MAX_LINE_LENGTH + 1];
+    strcpy(code, buf);
+    int empty = 0;
+    char* space = strchr(code, ' ');
+    char* rest = NULL;
+
+    // command is under 4 letters long
+    if (strlen(code) < 6) {
+    	send_reply(fd, REPLY_SMTP_NOT_RECOGNIZED);
+      continue;
+    }
+
+    if(space == NULL) {
+    	// no spaces, strip the CRLF
+    	code[strlen(code) - 2] = '\0';
+    } else {
+    	// is there text after the space?
+    	if(strlen(code) > 7) {
+    		empty = 1;
+    		rest = code + 5;
+    	}
+    	*space = '\0';
+    }
+    metrics_start(timer, metrics_command(METRICS_SMTP, code));
+
+    int is_helo = strcasecmp(code, "HELO");
+    int is_ehlo = strcasecmp(code, "EHLO");
+    int is_noop = strcasecmp(code, "NOOP");
+    int is_quit = strcasecmp(code, "QUIT");
+    int is_mail = strcasecmp(code, "MAIL");
+    int is_rcpt = strcasecmp(code, "RCPT");
+    int is_rset = strcasecmp(code, "RSET");
+    int is_vrfy = strcasecmp(code, "VRFY");
+    int is_expn = strcasecmp(code, "EXPN");
+    int is_help = strcasecmp(code, "HELP");
+    int is_data = strcasecmp(code, "DATA");
+    int is_bdat = strcasecmp(code, "BDAT");
+
+    // unimplemented commands
+    if((is_rset == 0) || (is_vrfy == 0) || (is_expn == 0) || (is_help == 0)) {
+    	send_reply(fd, REPLY_SMTP_NOT_IMPLEMENTED);
+    	continue;
+    }
+
+    // out of order commands
+    if((is_mail == 0) || (is_rcpt == 0) || (is_data == 0) || (is_bdat == 0)) {
+    	send_string(fd, "503 please send HELO before engaging in mail transactions\r\n");
+    	continue;
+    }
+
+    if((is_helo == 0) || (is_ehlo == 0)) {
+    	if (empty == 0) {
+    	  send_string(fd, "501 HELO requires name\r\n");
+    	  continue;
+    	} else {
+    	  // truncate leading space and CRLF
+    	  while(*rest == ' ') {
+    	  	rest = rest + 1;
+    	  }
+    	  rest[strlen(rest) - 2] = '\0';
+    	  // only spaces?
+    	  if (strlen(rest) == 0) {
+    	  	send_string(fd, "501 HELO requires name\r\n");
+    	  	continue;
+    	  }
+    	  // send EHLO response with the list of extensions
+    	  if (is_ehlo == 0) {
+    	  	send_ehlo(fd, rest);
+    	  	return 2;
+    	  }
+    	  // send HELO response
+    	  char reply[MAX_LINE_LENGTH + REPLY_MAX_HOST + 16];
+    	  char* end = REPLY_PUT_STRING(reply, "250 ");
+    	  end = reply_put_host(end);
+    	  end = REPLY_PUT_STRING(end, " Hello ");
+    	  end = reply_put(end, rest, strlen(rest));
+    	  end = REPLY_PUT_STRING(end, "\r\n");
+    	  send_all(fd, reply, end - reply);
+    	  return 0;
+    	}
+    }
+
+    if(is_noop == 0) {
+    	send_reply(fd, REPLY_SMTP_OK);
+    	continue;
+    }
+
+    if(is_quit == 0) {
+    	if (empty == 1) {
+    		send_string(fd, "501 no parameters accepted for QUIT\r\n");
+    		continue;
+    	}
+    	send_reply(fd, REPLY_SMTP_CLOSING);
+    	return 1;
+    }
+
+    send_reply(fd, REPLY_SMTP_NOT_RECOGNIZED);
+  }
+}
+
+// sends the multiline EHLO response, announcing supported extensions
+// Parameters:
+//    fd: socket file descriptor
+//    name: the name the client sent in EHLO
+void send_ehlo(int fd, char* name) {
+  char reply[MAX_LINE_LENGTH + REPLY_MAX_HOST + 128];
+  char* end = REPLY_PUT_STRING(reply, "250-");
+  end = reply_put_host(end);
+  end = REPLY_PUT_STRING(end, " Hello ");
+  end = reply_put(end, name, strlen(name));
+  end = REPLY_PUT_STRING(end, "\r\n250-SIZE ");
+  end = reply_put_uint(end, MAX_MESSAGE_SIZE);
+  end = REPLY_PUT_STRING(end, "\r\n"
+                              "250-8BITMIME\r\n"
+                              "250-CHUNKING\r\n"
+                              "250 BINARYMIME\r\n");
+  send_all(fd, reply, end - reply);
+}
+
+// handles all server processing after HELO is completed
+// Parameters:
+//    fd: socket file descriptor
+//    nb: buffer for reading from the socket
+//    arena: arena of the session, reset after each transaction
+//    esmtp: 1 if the client used EHLO, 0 otherwise
+//    client: rate limit counters of the client address
+void handle_mail(int fd, net_buffer_t nb, arena_t arena, int esmtp,
+                 const struct client_key* client, struct metrics_timer* timer) {
+  // state and other variables
+  int is_mail_state = 1;
+  int is_rcpt_state = 0;
+  int is_data_state = 0;
+  user_list_t rcpts = create_user_list();
+  struct mail_params params = {0, 0};
+  struct chunked_mail chunked = {-1, "", 0};
+  // unknown recipients sent in this session
+  int rejected_rcpts = 0;
+
+  while(1) {
+    char buf[MAX_LINE_LENGTH + 1];
+    reactor_set_timeout(fd, COMMAND_TIMEOUT);
+    metrics_stop(timer);
+    int result = nb_read_line(nb, buf);
+    
+    // connection was closed
+    if (result <= 0) {
+  	  break;
+    }
+    // only commands are logged, never message data
+    log_debug("smtp: received %s", buf);
+
+    // line too long
+    if (buf[result - 1] != '\n') {
+    	if (discard_line(nb, buf) <= 0) {
+    	  break;
+    	}
+    	send_string(fd, "552 line exceeded max size\r\n");
+    	continue;
+    }
+
+    char code[MAX_LINE_LENGTH + 1];
+    strcpy(code, buf);
+    // text entered after the command
+    char* rest = NULL;
+    // was anything entered after the command?
+    int empty = 0;
+
+    // command is under 4 letters long
+    if (strlen(code) < 6) {
+  	  send_reply(fd, REPLY_SMTP_NOT_RECOGNIZED);
+      continue;
+    }
+
+    // grab the command by cutting off at first whitespace
+    char* space = strchr(code, ' ');
+    if(space == NULL) {
+  	  // no spaces, strip the CRLF
+  	  code[strlen(code) - 2] = '\0';
+    } else {
+  	  // is there text after the space and \n?
+  	  if(strlen(code) > 7) {
+  	  	empty = 1;
+  	  	rest = code + 5;
+  	  }
+  	  *space = '\0';
+    }
+    metrics_start(timer, metrics_command(METRICS_SMTP, code));
+
+    int is_helo = strcasecmp(code, "HELO");
+    int is_ehlo = strcasecmp(code, "EHLO");
+    int is_noop = strcasecmp(code, "NOOP");
+    int is_quit = strcasecmp(code, "QUIT");
+    int is_mail = strcasecmp(code, "MAIL");
+    int is_rcpt = strcasecmp(code, "RCPT");
+    int is_rset = strcasecmp(code, "RSET");
+    int is_vrfy = strcasecmp(code, "VRFY");
+    int is_expn = strcasecmp(code, "EXPN");
+    int is_help = strcasecmp(code, "HELP");
+    int is_data = strcasecmp(code, "DATA");
+    int is_bdat = strcasecmp(code, "BDAT");
+
+    // BDAT handling; done before anything else, since the chunk has
+    // to be consumed even if the command is out of order
+    if(is_bdat == 0) {
+      int in_order = esmtp && (is_data_state == 1);
+      int saved = save_chunk(fd, nb, rest, in_order, &chunked, rcpts, client);
+      if (saved == 1) {
+      	break;
+      }
+      if (saved == 2) {
+      	// transaction is over, start a new one
+      	arena_reset(arena);
+      	rcpts = create_user_list();
+      	is_mail_state = 1;
+      	is_rcpt_state = 0;
+      	is_data_state = 0;
+      	params.size = 0;
+      	params.binary = 0;
+      } else if (chunked.fd >= 0) {
+      	// no more recipients once message data was received
+      	is_rcpt_state = 0;
+      }
+      continue;
+    }
+
+    // unimplemented commands
+    if((is_rset == 0) || (is_vrfy == 0) || (is_expn == 0) || (is_help == 0)) {
+  	  send_reply(fd, REPLY_SMTP_NOT_IMPLEMENTED);
+  	  continue;
+    }
+
+    // out of order commands
+    if((is_helo == 0) || (is_ehlo == 0) || 
+      ((is_rcpt == 0) && (is_rcpt_state != 1)) ||
+      ((is_mail == 0) && (is_mail_state != 1)) ||
+      ((is_data == 0) && ((is_data_state != 1) || (chunked.fd >= 0)))) {
+
+      send_reply(fd, REPLY_SMTP_OUT_OF_ORDER);
+      continue;
+    }
+
+    // NOOP
+    if(is_noop == 0) {
+      send_reply(fd, REPLY_SMTP_OK);
+      continue;
+    }
+
+    // QUIT
+    if(is_quit == 0) {
+      if(empty == 1) {
+      	send_string(fd, "501 parameters not accepted for QUIT\r\n");
+      	continue;
+      }
+      send_reply(fd, REPLY_SMTP_CLOSING);
+      break;
+    }
+
+    // MAIL handling
+    if(is_mail == 0) {
+      // was there anything after the MAIL?
+      if (empty == 0) {
+      	send_reply(fd, REPLY_SMTP_SYNTAX);
+      	continue;
+      }
+
+      // is there enough for MAIL FROM:?
+      int rest_len = strlen(rest);
+      if (rest_len < 8) {
+      	send_reply(fd, REPLY_SMTP_SYNTAX);
+      	continue;
+      }
+
+      // did the user actually send MAIL FROM:?
+      if (strncasecmp(rest, "FROM:", 5) != 0) {
+      	send_reply(fd, REPLY_SMTP_SYNTAX);
+      	continue;
+      }
+
+      // truncate leading spaces
+      rest = rest + 5;
+      while(*rest == ' ') {
+   	    rest = rest + 1;
+      }
+
+	  // parameters are only accepted from ESMTP clients
+	  params.size = 0;
+	  params.binary = 0;
+	  struct mail_path path;
+	  int valid = check_address(fd, rest, MAIL_PATH_NULL, &path, esmtp ? &params : NULL);
+	  if (valid == 1) {
+	  	// invalid
+        continue;
+	  }
+	  // reject oversized messages before any data is transferred
+	  if (params.size > MAX_MESSAGE_SIZE) {
+	  	send_string(fd, "552 message size exceeds fixed maximum message size\r\n");
+	  	continue;
+	  }
+      // update state
+      is_mail_state = 0;
+      is_rcpt_state = 1;
+      send_reply(fd, REPLY_SMTP_SENDER_OK);
+      continue;  
+    }
+
+    // RCPT handling
+    if(is_rcpt == 0) {
+      // was there anything after the RCPT?
+      if (empty == 0) {
+      	send_reply(fd, REPLY_SMTP_SYNTAX);
+      	continue;
+      }
+
+      // did the client send enough for RCPT TO:?
+      int rest_len = strlen(rest);
+      if (rest_len < 6) {
+      	send_reply(fd, REPLY_SMTP_SYNTAX);
+      	continue;
+      }
+
+      // did the user actually send RCPT TO:?
+      if (strncasecmp(rest, "TO:", 3) != 0) {
+      	send_reply(fd, REPLY_SMTP_SYNTAX);
+      	continue;
+      }
+
+	  // truncate leading spaces
+      rest = rest + 3;
+      while(*rest == ' ') {
+      	rest = rest + 1;
+      }
+
+      // senders over their rate are told to retry later
+      if (rate_limit_take(client, RATE_RECIPIENTS, 1) != 0) {
+      	send_string(fd, "450 too many recipients, try again later\r\n");
+      	continue;
+      }
+
+      struct mail_path path;
+      int valid = check_address(fd, rest, 0, &path, NULL);
+      if (valid == 1) {
+      	// invalid address
+      	continue;
+      }
+      // users are looked up by the whole mailbox (local part and domain)
+      char user[MAX_USERNAME_SIZE + 1];
+      if (path.mailbox.len > MAX_USERNAME_SIZE) {
+      	send_reply(fd, REPLY_SMTP_NO_MAILBOX);
+      	continue;
+      }
+      memcpy(user, path.mailbox.start, path.mailbox.len);
+      user[path.mailbox.len] = '\0';
+      if (is_valid_user(user, NULL) == 0) {
+      	// drop sessions that look like a dictionary attack
+      	if (++rejected_rcpts >= MAX_REJECTED_RCPTS) {
+      	  send_reply(fd, REPLY_SMTP_INVALID_RCPTS);
+      	  break;
+      	}
+      	send_reply(fd, REPLY_SMTP_NO_MAILBOX);
+      	continue;
+      }
+      // update state
+      if (add_user_to_arena_list(&rcpts, user, arena) < 0) {
+      	send_string(fd, "452 insufficient system storage\r\n");
+      	continue;
+      }
+      is_data_state = 1;
+      send_reply(fd, REPLY_SMTP_RCPT_OK);
+      continue;
+    }
+
+    // DATA handling
+    if(is_data == 0) {
+      if (empty == 1) {
+      	send_string(fd, "501 parameters not accepted for DATA\r\n");
+      	continue;
+      }
+      // binary content can't be sent with DATA
+      if (params.binary == 1) {
+      	send_string(fd, "503 BODY=BINARYMIME requires BDAT\r\n");
+      	continue;
+      }
+      send_reply(fd, REPLY_SMTP_START_DATA);
+      if (save_file(fd, nb, arena, rcpts, client) != 0) {
+      	continue;
+      }
+      // transaction is over, start a new one
+      arena_reset(arena);
+      rcpts = create_user_list();
+      is_mail_state = 1;
+      is_rcpt_state = 0;
+      is_data_state = 0;
+      continue;
+    }
+
+    send_reply(fd, REPLY_SMTP_NOT_RECOGNIZED);
+  }
+
+  // discard message left incomplete by the client
+  if (chunked.fd >= 0) {
+    close(chunked.fd);
+    remove(chunked.file);
+  }
+  
+}
+
+// validates the email address and its parameters
+// Parameters:
+//    fd: socket file descriptor
+//    rest: pointer to email address
+//    flags: MAIL_PATH_NULL if the null path <> is accepted
+//    path: where the parts of the address are stored
+//    params: where to store the values of SIZE and BODY parameters,
+//            or NULL if no parameters are accepted
+// Returns 1 if email is formatted badly
+// Returns 0 if it is well-formed
+int check_address(int fd, char* rest, int flags, struct mail_path* path,
+                  struct mail_params* params) {
+  // mailboxes without a domain are accepted, since users may be
+  // listed without one
+  int result = parse_mail_path(rest, strlen(rest), flags | MAIL_PATH_LOCAL, path);
+  if (result == MAIL_PATH_BAD_PARAM) {
+  	send_string(fd, "501 Syntax error in parameters\r\n");
+  	return 1;
+  }
+  if ((result == MAIL_PATH_SYNTAX) || (result == MAIL_PATH_TOO_LONG)) {
+  	send_string(fd, "501 Syntax error in address\r\n");
+  	return 1;
+  }
+
+  unsigned int i;
+  for (i = 0; (result == MAIL_PATH_OK) && (i < path->param_count); i++) {
+  	struct span key = path->params[i].key;
+  	struct span value = path->params[i].value;
+  	if (params == 0) {
+  	  result = MAIL_PATH_BAD_PARAM;
+  	} else if (span_equals(key, "SIZE") && (value.len > 0) &&
+  	           (strspn(value.start, "0123456789") >= value.len)) {
+  	  // SIZE=n, where n is the message size in bytes (RFC 1870)
+  	  params->size = strtoul(value.start, NULL, 10);
+  	} else if (span_equals(key, "BODY") &&
+  	           (span_equals(value, "7BIT") || span_equals(value, "8BITMIME"))) {
+  	  params->binary = 0;
+  	} else if (span_equals(key, "BODY") && span_equals(value, "BINARYMIME")) {
+  	  params->binary = 1;
+  	} else {
+  	  result = MAIL_PATH_BAD_PARAM;
+  	}
+  }
+  if (result != MAIL_PATH_OK) {
+  	send_string(fd, "555 mail parameters not recognized or not implemented\r\n");
+  	return 1;
+  }
+  return 0;
+}
+
+// reads and discards the rest of a command line that was too long
+// Parameters:
+//    nb: buffer for reading from the socket
+//    buf: space for reading, at least MAX_LINE_LENGTH + 1 bytes
+// Returns the result of the last read (0 or less if connection closed)
+int discard_line(net_buffer_t nb, char* buf) {
+  int result;
+  do {
+    result = nb_read_line(nb, buf);
+  } while ((result > 0) && (buf[result - 1] != '\n'));
+  return result;
+}
+
+// receives and saves the email message
+// data is handled as a stream: lines longer than MAX_LINE_LENGTH are
+// written in pieces, and only a complete ".\r\n" line ends the message
+// messages larger than MAX_MESSAGE_SIZE are read to the end but discarded
+// returns 0 when the transaction is over (message saved or rejected),
+// 1 if an error occurred
+// Parameters:
+//    fd: socket file descriptor
+//    nb: buffer for reading from the socket
+//    arena: arena of the session, where the block is allocated
+//    rcpts: user_list_t with all recipients
+//    client: rate limit counters of the client address
+int save_file(int fd, net_buffer_t nb, arena_t arena, user_list_t rcpts,
+              const struct client_key* client) {
+  // get a temporary file
+  char template[] = "fileXXXXXX";
+  int file_fd = mkstemp(template);
+  char buf[MAX_LINE_LENGTH + 1];
+  // data is collected in blocks before being written to the file; the
+  // block is freed with the transaction. Without it, the message is
+  // still read to the end, but discarded
+  char* block = arena_alloc(arena, WRITE_BLOCK_SIZE);
+  size_t block_len = 0;
+  // offsets of headers and first body lines, used by POP3 TOP
+  struct mail_index index;
+  mail_index_init(&index);
+  // total bytes received, to enforce MAX_MESSAGE_SIZE
+  size_t size = 0;
+  // is the next piece of data the start of a new line?
+  int line_start = 1;
+  // the time limit applies to each block, so a slow client can't hold
+  // the session with a trickle of data
+  reactor_set_timeout(fd, DATA_BLOCK_TIMEOUT);
+
+  while(1) {
+    int result = nb_read_line(nb, buf);
+    // connection was closed
+    if (result <= 0) {
+      close(file_fd);
+      remove(template);
+  	  return 1;
+    }
+
+    // no need to write the last line
+    if (line_start && (strcmp(buf, ".\r\n") == 0)) {
+      break;
+    }
+    // a piece of a long line doesn't end with a line feed
+    line_start = (buf[result - 1] == '\n');
+
+    size += result;
+    if ((size > MAX_MESSAGE_SIZE) || !block) {
+      continue;
+    }
+    if (block_len + result > WRITE_BLOCK_SIZE) {
+      write(file_fd, block, block_len);
+      throttle_data(fd, client, block_len);
+      block_len = 0;
+      reactor_set_timeout(fd, DATA_BLOCK_TIMEOUT);
+    }
+    memcpy(block + block_len, buf, result);
+    block_len += result;
+    mail_index_append(&index, buf, result);
+  }
+
+  if ((size <= MAX_MESSAGE_SIZE) && block) {
+    write(file_fd, block, block_len);
+    throttle_data(fd, client, block_len);
+  }
+  close(file_fd);
+  if (!block) {
+    remove(template);
+    send_string(fd, "451 not enough memory for the message\r\n");
+    return 0;
+  }
+  if (size > MAX_MESSAGE_SIZE) {
+    remove(template);
+    send_string(fd, "552 message size exceeds fixed maximum message size\r\n");
+    return 0;
+  }
+  mail_index_finish(&index);
+  save_user_mail(template, rcpts, &index);
+  remove(template);
+
+  send_reply(fd, REPLY_SMTP_SENT);
+  return 0;
+}
+
+// receives a chunk of the email message sent with BDAT (RFC 3030)
+// the chunk is moved to the temporary file as is, without looking
+// for line endings; the message is dot-stuffed and saved after the
+// LAST chunk
+// returns 0 if more chunks are expected, 1 if an error occurred,
+// 2 when the transaction is over (message saved or rejected)
+// Parameters:
+//    fd: socket file descriptor
+//    nb: buffer for reading from the socket
+//    rest: arguments of the BDAT command (size and optional LAST)
+//    in_order: 0 if BDAT is not allowed at this point of the session
+//    mail: message received so far
+//    rcpts: user_list_t with all recipients
+//    client: rate limit counters of the client address
+int save_chunk(int fd, net_buffer_t nb, char* rest, int in_order,
+               struct chunked_mail* mail, user_list_t rcpts,
+               const struct client_key* client) {
+  if (rest == NULL) {
+  	send_string(fd, "501 Syntax: BDAT <size> [LAST]\r\n");
+  	return 0;
+  }
+  char* end = rest;
+  unsigned long chunk = 0;
+  errno = 0;
+  if (isdigit(*rest)) {
+  	chunk = strtoul(rest, &end, 10);
+  }
+  while (*end == ' ') {
+  	end = end + 1;
+  }
+  int last = (strncasecmp(end, "LAST", 4) == 0);
+  if (last) {
+  	end = end + 4;
+  }
+  // without a valid size, the chunk can't be skipped
+  if ((end == rest) || (errno == ERANGE) ||
+      ((strcmp(end, "\r\n") != 0) && (strcmp(end, "\n") != 0))) {
+  	send_string(fd, "501 Syntax: BDAT <size> [LAST]\r\n");
+  	return 0;
+  }
+  reactor_set_timeout(fd, DATA_BLOCK_TIMEOUT);
+
+  // a chunk that can never fit is not consumed, since it could be of
+  // any size; the session is closed instead
+  if (chunk > MAX_MESSAGE_SIZE) {
+  	send_string(fd, "552 message size exceeds fixed maximum message size\r\n");
+  	return 1;
+  }
+
+  if (!in_order) {
+  	if (nb_read_to_fd(nb, -1, chunk) != chunk) {
+  	  return 1;
+  	}
+  	send_reply(fd, REPLY_SMTP_OUT_OF_ORDER);
+  	return 0;
+  }
+
+  // message is rejected, but the chunk is still consumed (written so
+  // that the sum can't overflow)
+  if (chunk > MAX_MESSAGE_SIZE - mail->size) {
+  	if (mail->fd >= 0) {
+  	  close(mail->fd);
+  	  remove(mail->file);
+  	}
+  	mail->fd = -1;
+  	mail->size = 0;
+  	if (nb_read_to_fd(nb, -1, chunk) != chunk) {
+  	  return 1;
+  	}
+  	send_string(fd, "552 message size exceeds fixed maximum message size\r\n");
+  	return 2;
+  }
+
+  throttle_data(fd, client, chunk);
+
+  // get a temporary file on the first chunk
+  if (mail->fd < 0) {
+  	strcpy(mail->file, "fileXXXXXX");
+  	mail->fd = mkstemp(mail->file);
+  	mail->size = 0;
+  }
+  if (nb_read_to_fd(nb, mail->fd, chunk) != chunk) {
+  	return 1;
+  }
+  mail->size += chunk;
+
+  if (!last) {
+  	char reply[64];
+  	char* end = REPLY_PUT_STRING(reply, "250 ");
+  	end = reply_put_uint(end, chunk);
+  	end = REPLY_PUT_STRING(end, " octets received\r\n");
+  	send_all(fd, reply, end - reply);
+  	return 0;
+  }
+
+  // stored messages are dot-stuffed, as with DATA
+  if (stuff_chunked_mail(mail) < 0) {
+  	close(mail->fd);
+  	remove(mail->file);
+  	mail->fd = -1;
+  	mail->size = 0;
+  	send_string(fd, "451 message could not be stored\r\n");
+  	return 2;
+  }
+
+  // no index is built for chunks; POP3 TOP will scan these messages
+  close(mail->fd);
+  save_user_mail(mail->file, rcpts, NULL);
+  remove(mail->file);
+  mail->fd = -1;
+  mail->size = 0;
+  send_reply(fd, REPLY_SMTP_SENT);
+  return 2;
+}
+
+// dot-stuffs a message received with BDAT, so it is stored the same
+// way as one received with DATA: POP3 sends stored messages as they
+// are, and an unstuffed line starting with a dot would end them early
+// the temporary file is scanned first, and only copied if a line
+// starts with a dot
+// returns 0 on success, -1 on error
+// Parameters:
+//    mail: message received, with its temporary file still open
+int stuff_chunked_mail(struct chunked_mail* mail) {
+  char in[4096];
+  char out[2 * sizeof(in)];
+  off_t offset = 0;
+  ssize_t len, i;
+  int line_start = 1, found = 0;
+
+  while (!found && ((len = pread(mail->fd, in, sizeof(in), offset)) > 0)) {
+    for (i = 0; (i < len) && !found; i++) {
+      found = line_start && (in[i] == '.');
+      line_start = (in[i] == '\n');
+    }
+    offset += len;
+  }
+  if (!found) {
+    return (len < 0) ? -1 : 0;
+  }
+
+  char template[] = "fileXXXXXX";
+  int stuffed_fd = mkstemp(template);
+  if (stuffed_fd < 0) {
+    return -1;
+  }
+  offset = 0;
+  line_start = 1;
+  while ((len = pread(mail->fd, in, sizeof(in), offset)) > 0) {
+    ssize_t out_len = 0;
+    for (i = 0; i < len; i++) {
+      if (line_start && (in[i] == '.')) {
+        out[out_len++] = '.';
+      }
+      out[out_len++] = in[i];
+      line_start = (in[i] == '\n');
+    }
+    if (write(stuffed_fd, out, out_len) != out_len) {
+      len = -1;
+      break;
+    }
+    offset += len;
+  }
+  if (len < 0) {
+    close(stuffed_fd);
+    remove(template);
+    return -1;
+  }
+
+  close(mail->fd);
+  remove(mail->file);
+  mail->fd = stuffed_fd;
+  strcpy(mail->file, template);
+  return 0;
+}
+
+// slows down a client sending message data faster than its rate
+// limit, by waiting before reading more data from it
+// Parameters:
+//    fd: socket file descriptor
+//    client: rate limit counters of the client address
+//    size: bytes received from the client
+void throttle_data(int fd, const struct client_key* client, size_t size) {
+  long wait;
+  while ((wait = rate_limit_take(client, RATE_DATA_BYTES, size)) > 0) {
+  	reactor_sleep(fd, wait);
+  }
+}
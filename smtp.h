@@ -0,0 +1,12 @@
+/* smtp.h
+ * Serves SMTP sessions, delivering received mail to local users.
+ */
+
+#ifndef _SMTP_H_
+#define _SMTP_H_
+
+#include "server.h"
+
+void smtp_setup(struct server_listener *listener);
+
+#endif
@@ -0,0 +1,262 @@
+/* prototest.c
+ * Runs SMTP and POP3 sessions through the protocol handlers, over an
+ * in-memory transport, and checks their replies and the mail stored,
+ * for cases where clients send malformed or hostile input.
+ *
+ * Usage: prototest [-v]
+ *
+ * Notes: Each case sends its input at once, as a pipelining client,
+ * and the session ends when the input is consumed. Cases run in a
+ * scratch directory (in $TMPDIR or /tmp) with user "bench" (password
+ * "password"), whose mailbox has one message. The replies of failed
+ * cases (or of every case, with -v) are printed. Returns 0 if all
+ * cases pass.
+ */
+
+#define _GNU_SOURCE // for mkdtemp, memmem and nftw
+
+#include "../transport.h"
+#include "../mailuser.h"
+#include "../smtp.h"
+#include "../pop3.h"
+#include "../log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#define MAILBOX "mail.store/bench"
+
+struct test_case {
+  const char *name;
+  int smtp;                 // 1 for SMTP, 0 for POP3
+  const char *input;        // sent by the client, followed by
+  size_t filler;            // this many bytes of 'x' (e.g., a chunk),
+  const char *tail;         // and this, or NULL
+  const char *expected[4];  // replies that must be sent, in order
+  const char *unexpected;   // reply that must not be sent, or NULL
+  int stored;               // messages added to the mailbox
+};
+
+static const char message[] =
+  "From: sender@example.org\r\n"
+  "Subject: Protocol test\r\n"
+  "\r\n"
+  "Hello.\r\n";
+
+static const struct test_case cases[] = {
+  { "smtp: BDAT size that overflows the message size", 1,
+    "EHLO client\r\nMAIL FROM:<a@example.org>\r\nRCPT TO:<bench>\r\n"
+    "BDAT 1\r\nxBDAT 18446744073709551615 LAST\r\nxxxx", 0, NULL,
+    { "250 1 octets received", "552 " }, "message successfully sent", 0 },
+  { "smtp: BDAT size out of range", 1,
+    "EHLO client\r\nMAIL FROM:<a@example.org>\r\nRCPT TO:<bench>\r\n"
+    "BDAT 99999999999999999999999 LAST\r\nQUIT\r\n", 0, NULL,
+    { "501 Syntax: BDAT", "221 " }, "message successfully sent", 0 },
+  { "smtp: BDAT over the message size, still consumed", 1,
+    "EHLO client\r\nMAIL FROM:<a@example.org>\r\nRCPT TO:<bench>\r\n"
+    "BDAT 10485760\r\n", 10485760, "BDAT 1 LAST\r\nxQUIT\r\n",
+    { "250 10485760 octets received", "552 ", "221 " }, "message successfully sent", 0 },
+  { "pop3: USER name longer than any user", 0,
+    "USER ", 600, "\r\nUSER bench\r\nPASS password\r\nQUIT\r\n",
+    { "-ERR No such user", "+OK User matched", "+OK Password matched", "+OK POP3 Server quitting" },
+    NULL, 0 },
+  { "pop3: PASS password longer than any password", 0,
+    "USER bench\r\nPASS ", 600, "\r\nUSER bench\r\nPASS password\r\nQUIT\r\n",
+    { "-ERR Invalid password", "+OK User matched", "+OK Password matched", "+OK POP3 Server quitting" },
+    NULL, 0 },
+  { "pop3: RETR sends the mail with one terminating dot", 0,
+    "USER bench\r\nPASS password\r\nRETR 1\r\nRETR 2\r\nQUIT\r\n", 0, NULL,
+    { "+OK Password matched", " octets\r\nFrom: sender@example.org\r\n", "\r\nHello.\r\n.\r\n-ERR ",
+      "+OK POP3 Server quitting" },
+    NULL, 0 },
+  { "pop3: TOP with a negative line count", 0,
+    "USER bench\r\nPASS password\r\nTOP 1 -5\r\nTOP 1 0\r\nQUIT\r\n", 0, NULL,
+    { "+OK Password matched", "-ERR Syntax: TOP msg n", "+OK Top of message follows",
+      "+OK POP3 Server quitting" },
+    "Hello.", 0 },
+  { "pop3: tail of an overlong line not run as a command", 0,
+    "NOOP ", 2000, "QUIT\r\nUSER bench\r\nPASS password\r\nQUIT\r\n",
+    { "-ERR Command is too long", "+OK User matched", "+OK Password matched", "+OK POP3 Server quitting" },
+    NULL, 0 },
+  // The message stored here is retrieved by the next case
+  { "smtp: BDAT message with lines starting with a dot", 1,
+    "EHLO client\r\nMAIL FROM:<a@example.org>\r\nRCPT TO:<bench>\r\n"
+    "BDAT 21\r\nSubject: t\r\n\r\nline1\r\nBDAT 15 LAST\r\n.\r\n..x\r\nafter\r\nQUIT\r\n", 0, NULL,
+    { "250 21 octets received", "message successfully sent", "221 " }, NULL, 1 },
+  { "pop3: RETR of a BDAT message is dot-stuffed", 0,
+    "USER bench\r\nPASS password\r\nRETR 1\r\nRETR 2\r\nQUIT\r\n", 0, NULL,
+    { "+OK Password matched", "\r\nline1\r\n..\r\n...x\r\nafter\r\n.\r\n", "+OK POP3 Server quitting" },
+    "line1\r\n.\r\n", 0 },
+};
+
+/** Internal function that counts the messages in the mailbox (files
+ *  named with the ".mail" suffix, not their ".mail.idx" indexes).
+ */
+static int count_messages(void) {
+
+  DIR *dir = opendir(MAILBOX);
+  struct dirent *entry;
+  int count = 0;
+  if (!dir)
+    return 0;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    if (len > 5 && !strcmp(entry->d_name + len - 5, ".mail"))
+      count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+/** Internal function that counts the temporary files left by SMTP. */
+static int count_temporary_files(void) {
+
+  DIR *dir = opendir(".");
+  struct dirent *entry;
+  int count = 0;
+  while ((entry = readdir(dir)) != NULL)
+    if (!strncmp(entry->d_name, "file", 4))
+      count++;
+  closedir(dir);
+  return count;
+}
+
+/** Internal function that builds the input of a case.
+ *
+ *  Returns: the input (allocated), with its size in size.
+ */
+static char *build_input(const struct test_case *test, size_t *size) {
+
+  size_t len = strlen(test->input), tail = test->tail ? strlen(test->tail) : 0;
+  char *input = malloc(len + test->filler + tail);
+  memcpy(input, test->input, len);
+  memset(input + len, 'x', test->filler);
+  memcpy(input + len + test->filler, test->tail ? test->tail : "", tail);
+  *size = len + test->filler + tail;
+  return input;
+}
+
+/** Internal function that runs a case.
+ *
+ *  Returns: 1 if the case passed, 0 otherwise.
+ */
+static int run_case(const struct test_case *test, memory_transport_t mt, int verbose) {
+
+  struct server_listener listener = { NULL, NULL, NULL, NULL };
+  if (test->smtp)
+    smtp_setup(&listener);
+  else
+    pop3_setup(&listener);
+
+  size_t input_size, output_size;
+  char *input = build_input(test, &input_size);
+  int messages = count_messages();
+  memory_transport_set_input(mt, input, input_size, 0);
+  listener.handler(memory_transport_fd(mt));
+  free(input);
+  const char *output = memory_transport_output(mt, &output_size);
+
+  const char *rest = output;
+  size_t left = output_size;
+  int i, passed = 1;
+  for (i = 0; i < 4 && test->expected[i] && passed; i++) {
+    const char *found = memmem(rest, left, test->expected[i], strlen(test->expected[i]));
+    if (!found) {
+      printf("FAIL %s: no reply \"%s\"\n", test->name, test->expected[i]);
+      passed = 0;
+    } else {
+      left -= found - rest;
+      rest = found;
+    }
+  }
+  if (passed && test->unexpected &&
+      memmem(output, output_size, test->unexpected, strlen(test->unexpected))) {
+    printf("FAIL %s: unexpected reply \"%s\"\n", test->name, test->unexpected);
+    passed = 0;
+  }
+  if (passed && count_messages() != messages + test->stored) {
+    printf("FAIL %s: %d messages stored\n", test->name, count_messages() - messages);
+    passed = 0;
+  }
+  if (passed && count_temporary_files()) {
+    printf("FAIL %s: temporary files left\n", test->name);
+    passed = 0;
+  }
+  if (passed)
+    printf("ok   %s\n", test->name);
+
+  if (!passed || verbose)
+    fwrite(output, 1, output_size, stdout);
+  return passed;
+}
+
+/** Internal function that creates the users file and the mailbox of
+ *  the scratch directory.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int setup_storage(void) {
+
+  FILE *file = fopen("users.txt", "w");
+  if (!file)
+    return -1;
+  fprintf(file, "bench password\n");
+  if (fclose(file) < 0)
+    return -1;
+
+  file = fopen("message", "w");
+  if (!file || fwrite(message, 1, sizeof(message) - 1, file) != sizeof(message) - 1 ||
+      fclose(file) < 0)
+    return -1;
+
+  user_list_t users = create_user_list();
+  add_user_to_list(&users, "bench");
+  save_user_mail("message", users, NULL);
+  destroy_user_list(users);
+  remove("message");
+  return refresh_user_filter() == 1 ? 0 : -1;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+
+  int verbose = argc > 1 && !strcmp(argv[1], "-v"), failed = 0;
+  size_t i;
+
+  // Storage calls use the current directory
+  const char *tmp = getenv("TMPDIR");
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/prototest.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir) || chdir(dir) < 0) {
+    perror(dir);
+    return 1;
+  }
+  if (setup_storage() < 0) {
+    perror("setup");
+    return 1;
+  }
+  log_level = LOG_LEVEL_ERROR;
+
+  memory_transport_t mt = memory_transport_create(1);
+  if (!mt) {
+    perror("memory transport");
+    return 1;
+  }
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    failed += !run_case(&cases[i], mt, verbose);
+  memory_transport_destroy(mt);
+
+  if (chdir("/") == 0)
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  printf("%zu cases, %d failed\n", sizeof(cases) / sizeof(cases[0]), failed);
+  return failed ? 1 : 0;
+}
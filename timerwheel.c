@@ -0,0 +1,177 @@
+/* timerwheel.c
+ * Hierarchical hashed timer wheel, for session timeouts.
+ *
+ * Notes: Timers are kept in doubly-linked lists, one per slot, so
+ * arming and cancelling a timer take constant time regardless of the
+ * number of timers. Level 0 has one slot per tick; timers further in
+ * the future are kept in coarser slots of the upper levels, and are
+ * moved down (cascaded) when the lower level completes a turn. The
+ * wheel does no locking: each wheel is used by a single thread.
+ */
+
+#include "timerwheel.h"
+
+#include <stddef.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+// Timers can't be armed further in the future than the wheel covers
+#define MAX_DELTA ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/** Internal function that inserts an armed timer in the slot matching
+ *  its expiration.
+ */
+static void timer_link(struct timer_wheel *wheel, struct timer *timer) {
+
+  unsigned long long delta = timer->expires - wheel->now;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (TIMER_WHEEL_BITS * (level + 1)))
+    level++;
+
+  struct timer *head =
+    &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+  timer->prev = head;
+  timer->next = head->next;
+  head->next->prev = timer;
+  head->next = timer;
+}
+
+/** Internal function that removes a timer from its slot.
+ */
+static void timer_unlink(struct timer *timer) {
+
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+/** Internal function that moves all timers in a slot of an upper level
+ *  to the slots of the lower levels, once the wheel reaches the ticks
+ *  covered by the slot.
+ */
+static void cascade(struct timer_wheel *wheel, int level) {
+
+  struct timer *head =
+    &wheel->slots[level][(wheel->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+  while (head->next != head) {
+    struct timer *timer = head->next;
+    timer_unlink(timer);
+    timer_link(wheel, timer);
+  }
+}
+
+/** Initializes an empty timer wheel.
+ *
+ *  Parameters: wheel: Wheel to be initialized.
+ *              now: Current tick.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now) {
+
+  int level, slot;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+      wheel->slots[level][slot].next = wheel->slots[level][slot].prev =
+	&wheel->slots[level][slot];
+  wheel->now = now;
+  wheel->count = 0;
+}
+
+/** Arms a timer, so that its callback is called once the wheel reaches
+ *  a given tick. If the timer was already armed, its previous
+ *  expiration is replaced. The callback field must be set by the
+ *  caller; the other fields must be zero before the timer is first
+ *  armed.
+ *
+ *  Parameters: wheel: Wheel where the timer is armed.
+ *              timer: Timer to be armed.
+ *              expires: Tick when the timer expires. Ticks already
+ *                       processed expire in the next tick; ticks too
+ *                       far in the future are limited to what the
+ *                       wheel covers.
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, unsigned long long expires) {
+
+  if (timer->next)
+    timer_unlink(timer);
+  else
+    wheel->count++;
+
+  if (expires <= wheel->now)
+    expires = wheel->now + 1;
+  else if (expires - wheel->now > MAX_DELTA)
+    expires = wheel->now + MAX_DELTA;
+  timer->expires = expires;
+  timer_link(wheel, timer);
+}
+
+/** Disarms a timer. Does nothing if the timer is not armed.
+ *
+ *  Parameters: wheel: Wheel where the timer was armed.
+ *              timer: Timer to be disarmed.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+
+  if (!timer->next)
+    return;
+  timer_unlink(timer);
+  wheel->count--;
+}
+
+/** Processes all ticks up to the current one, calling the callback of
+ *  every timer that expired. The timer is disarmed before its callback
+ *  is called; callbacks may arm or cancel any timer.
+ *
+ *  Parameters: wheel: Wheel to be processed.
+ *              now: Current tick.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now) {
+
+  while (wheel->now < now) {
+
+    // Nothing to expire, skip straight to the current tick
+    if (!wheel->count) {
+      wheel->now = now;
+      break;
+    }
+
+    wheel->now++;
+    int level;
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+      if (wheel->now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1))
+	break;
+    // Upper levels first, so their timers can reach the current slot
+    while (--level > 0)
+      cascade(wheel, level);
+
+    struct timer *head = &wheel->slots[0][wheel->now & SLOT_MASK];
+    while (head->next != head) {
+      struct timer *timer = head->next;
+      timer_unlink(timer);
+      wheel->count--;
+      timer->callback(timer);
+    }
+  }
+}
+
+/** Computes how long the caller may wait before the wheel has to be
+ *  advanced again.
+ *
+ *  Parameters: wheel: Wheel to be checked.
+ *
+ *  Returns: Number of ticks after the last tick processed until a
+ *           timer may expire, or -1 if no timer is armed.
+ */
+long timer_wheel_next(struct timer_wheel *wheel) {
+
+  long i;
+  if (!wheel->count)
+    return -1;
+  for (i = 1; i < TIMER_WHEEL_SLOTS; i++) {
+    unsigned long long tick = wheel->now + i;
+    // End of a turn: timers in upper levels have to be cascaded
+    if (!(tick & SLOT_MASK))
+      return i;
+    if (wheel->slots[0][tick & SLOT_MASK].next != &wheel->slots[0][tick & SLOT_MASK])
+      return i;
+  }
+  return TIMER_WHEEL_SLOTS;
+}
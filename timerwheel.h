@@ -0,0 +1,32 @@
+/* timerwheel.h
+ * Hierarchical hashed timer wheel, for session timeouts.
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+// Each level has 2^TIMER_WHEEL_BITS slots; a slot in a level covers
+// as many ticks as a full turn of the level below
+#define TIMER_WHEEL_BITS   8
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+
+struct timer {
+  struct timer *next, *prev;         // links in a slot, NULL if not armed
+  unsigned long long expires;        // tick when the timer expires
+  void (*callback)(struct timer *timer);
+};
+
+struct timer_wheel {
+  unsigned long long now;            // last tick processed
+  unsigned long count;               // number of armed timers
+  struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now);
+void timer_add(struct timer_wheel *wheel, struct timer *timer, unsigned long long expires);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now);
+long timer_wheel_next(struct timer_wheel *wheel);
+
+#endif
@@ -0,0 +1,373 @@
+/* transport.c
+ * Moves the bytes of a session, through its socket or through another
+ * transport attached to its descriptor (e.g., an in-memory pipe).
+ *
+ * Notes: Handlers identify sessions by their descriptor, so a
+ * transport is attached to a descriptor, and netbuffer and the send
+ * functions of the server look it up on each call. Descriptors with
+ * nothing attached (all of them in the servers) use the socket system
+ * calls, after checking that there is no table of attached
+ * transports. The in-memory pipe replays a fixed client input and
+ * collects the replies, so sessions can be run through the protocol
+ * handlers without the network stack (see bench/protobench.c). Its
+ * descriptor is /dev/null, only reserved so that it can't be taken by
+ * a socket.
+ */
+
+#define _GNU_SOURCE // for MSG_MORE
+
+#include "transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#define TRANSPORT_MAX_FDS 65536
+#define MEMORY_SENDFILE_CHUNK 65536
+
+struct transport {
+  const struct transport_ops *ops;
+  void *ctx;
+};
+
+// Transports attached, indexed by descriptor; allocated on the first
+// attach, so servers never look further than the NULL pointer
+static struct transport *transports = NULL;
+static pthread_mutex_t transports_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ssize_t socket_recv(int fd, void *ctx, void *buf, size_t size) {
+  return recv(fd, buf, size, 0);
+}
+
+static ssize_t socket_send(int fd, void *ctx, const void *buf, size_t size, int flags) {
+  return send(fd, buf, size, flags);
+}
+
+static ssize_t socket_writev(int fd, void *ctx, const struct iovec *iov, int count, int flags) {
+
+  // Unlike writev, sendmsg takes flags (e.g., MSG_NOSIGNAL)
+  struct msghdr msg = { .msg_iov = (struct iovec *) iov, .msg_iovlen = count };
+  return sendmsg(fd, &msg, flags);
+}
+
+static ssize_t socket_sendfile(int fd, void *ctx, int file_fd, off_t *offset, size_t size) {
+  return sendfile(fd, file_fd, offset, size);
+}
+
+static const struct transport_ops socket_ops = {
+  socket_recv, socket_send, socket_writev, socket_sendfile
+};
+
+/** Internal function that finds the transport of a descriptor.
+ *
+ *  Returns: the transport attached, or the socket transport.
+ */
+static inline struct transport find_transport(int fd) {
+
+  struct transport *table = __atomic_load_n(&transports, __ATOMIC_ACQUIRE);
+  struct transport transport = { &socket_ops, NULL };
+  const struct transport_ops *ops;
+  if (table && fd >= 0 && fd < TRANSPORT_MAX_FDS &&
+      (ops = __atomic_load_n(&table[fd].ops, __ATOMIC_ACQUIRE)) != NULL) {
+    transport.ops = ops;
+    transport.ctx = table[fd].ctx;
+  }
+  return transport;
+}
+
+/** Attaches a transport to a descriptor, so that all data of the
+ *  session using the descriptor goes through it. The descriptor must
+ *  be kept open (e.g., as a descriptor of /dev/null) until the
+ *  transport is detached, so it is not reused.
+ *
+ *  Parameters: fd: Descriptor identifying the session.
+ *              ops: Operations of the transport.
+ *              ctx: Passed to each operation.
+ *
+ *  Returns: 0 on success, or -1 if the descriptor is out of range or
+ *           memory is exhausted.
+ */
+int transport_attach(int fd, const struct transport_ops *ops, void *ctx) {
+
+  if (fd < 0 || fd >= TRANSPORT_MAX_FDS) {
+    errno = EMFILE;
+    return -1;
+  }
+  pthread_mutex_lock(&transports_lock);
+  if (!transports) {
+    struct transport *table = calloc(TRANSPORT_MAX_FDS, sizeof(struct transport));
+    if (!table) {
+      pthread_mutex_unlock(&transports_lock);
+      return -1;
+    }
+    __atomic_store_n(&transports, table, __ATOMIC_RELEASE);
+  }
+  transports[fd].ctx = ctx;
+  __atomic_store_n(&transports[fd].ops, ops, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&transports_lock);
+  return 0;
+}
+
+/** Detaches the transport of a descriptor, which goes back to being
+ *  used as a socket.
+ *
+ *  Parameters: fd: Descriptor passed to transport_attach.
+ *
+ *  Returns: the context passed to transport_attach, or NULL if no
+ *           transport was attached.
+ */
+void *transport_detach(int fd) {
+
+  struct transport transport = find_transport(fd);
+  if (transport.ops == &socket_ops)
+    return NULL;
+  __atomic_store_n(&transports[fd].ops, NULL, __ATOMIC_RELEASE);
+  return transport.ctx;
+}
+
+/** Checks if a descriptor is used as a socket, i.e., has no transport
+ *  attached. Operations other than those of the transport (e.g.,
+ *  splice) can only be used on sockets.
+ *
+ *  Parameters: fd: Descriptor of the session.
+ *
+ *  Returns: non-zero if the descriptor is a socket.
+ */
+int transport_is_socket(int fd) {
+  return find_transport(fd).ops == &socket_ops;
+}
+
+/** Receives data from a session, like recv with no flags.
+ *
+ *  Parameters: fd: Descriptor of the session.
+ *              buf: Where data is stored.
+ *              size: Maximum number of bytes received.
+ *
+ *  Returns: number of bytes received, 0 if the connection was closed,
+ *           or -1 on error (EAGAIN if no data is available yet).
+ */
+ssize_t transport_recv(int fd, void *buf, size_t size) {
+
+  struct transport transport = find_transport(fd);
+  return transport.ops->recv(fd, transport.ctx, buf, size);
+}
+
+/** Sends data to a session, like send.
+ *
+ *  Parameters: fd: Descriptor of the session.
+ *              buf: Data to be sent.
+ *              size: Number of bytes in buf.
+ *              flags: Flags of send (e.g., MSG_NOSIGNAL, MSG_MORE).
+ *
+ *  Returns: number of bytes sent, which may be less than size, or -1
+ *           on error (EAGAIN if there is no space yet).
+ */
+ssize_t transport_send(int fd, const void *buf, size_t size, int flags) {
+
+  struct transport transport = find_transport(fd);
+  return transport.ops->send(fd, transport.ctx, buf, size, flags);
+}
+
+/** Sends data from several buffers to a session, like writev, but
+ *  with the flags of send.
+ *
+ *  Parameters: fd: Descriptor of the session.
+ *              iov: Buffers to be sent, in order.
+ *              count: Number of buffers in iov.
+ *              flags: Flags of send (e.g., MSG_NOSIGNAL, MSG_MORE).
+ *
+ *  Returns: number of bytes sent, which may be less than the total,
+ *           or -1 on error (EAGAIN if there is no space yet).
+ */
+ssize_t transport_writev(int fd, const struct iovec *iov, int count, int flags) {
+
+  struct transport transport = find_transport(fd);
+  return transport.ops->writev(fd, transport.ctx, iov, count, flags);
+}
+
+/** Sends data from a file to a session, like sendfile.
+ *
+ *  Parameters: fd: Descriptor of the session.
+ *              file_fd: Descriptor of the file.
+ *              offset: Position of the first byte to send, updated
+ *                      past the last byte sent.
+ *              size: Maximum number of bytes sent.
+ *
+ *  Returns: number of bytes sent, 0 at the end of the file, or -1 on
+ *           error (EAGAIN if there is no space yet).
+ */
+ssize_t transport_sendfile(int fd, int file_fd, off_t *offset, size_t size) {
+
+  struct transport transport = find_transport(fd);
+  return transport.ops->sendfile(fd, transport.ctx, file_fd, offset, size);
+}
+
+/* In-memory pipe */
+
+struct memory_transport {
+  int fd;
+  const char *input;    // client data, not copied
+  size_t input_size;
+  size_t input_pos;
+  size_t segment;       // most bytes returned by each recv, or 0
+  int keep_output;
+  char *output;         // replies, if kept
+  size_t output_size;   // bytes sent so far, kept or not
+  size_t output_capacity;
+};
+
+static ssize_t memory_recv(int fd, void *ctx, void *buf, size_t size) {
+
+  struct memory_transport *mt = ctx;
+  size_t rem = mt->input_size - mt->input_pos;
+  if (size > rem)
+    size = rem;
+  if (mt->segment && size > mt->segment)
+    size = mt->segment;
+  memcpy(buf, mt->input + mt->input_pos, size);
+  mt->input_pos += size;
+  // The end of the input is the client closing the connection
+  return size;
+}
+
+/** Internal function that appends data to the output of an in-memory
+ *  pipe, or only counts it if the output is not kept.
+ *
+ *  Returns: 0 on success, -1 if memory is exhausted.
+ */
+static int memory_append(struct memory_transport *mt, const void *buf, size_t size) {
+
+  if (mt->keep_output) {
+    if (mt->output_size + size > mt->output_capacity) {
+      size_t capacity = mt->output_capacity ? mt->output_capacity : 4096;
+      while (capacity < mt->output_size + size)
+	capacity *= 2;
+      char *output = realloc(mt->output, capacity);
+      if (!output)
+	return -1;
+      mt->output = output;
+      mt->output_capacity = capacity;
+    }
+    memcpy(mt->output + mt->output_size, buf, size);
+  }
+  mt->output_size += size;
+  return 0;
+}
+
+static ssize_t memory_send(int fd, void *ctx, const void *buf, size_t size, int flags) {
+  return memory_append(ctx, buf, size) < 0 ? -1 : (ssize_t) size;
+}
+
+static ssize_t memory_writev(int fd, void *ctx, const struct iovec *iov, int count, int flags) {
+
+  ssize_t total = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    if (memory_append(ctx, iov[i].iov_base, iov[i].iov_len) < 0)
+      return -1;
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+static ssize_t memory_sendfile(int fd, void *ctx, int file_fd, off_t *offset, size_t size) {
+
+  char buf[MEMORY_SENDFILE_CHUNK];
+  ssize_t rv = pread(file_fd, buf, size < sizeof(buf) ? size : sizeof(buf), *offset);
+  if (rv <= 0)
+    return rv;
+  if (memory_append(ctx, buf, rv) < 0)
+    return -1;
+  *offset += rv;
+  return rv;
+}
+
+static const struct transport_ops memory_ops = {
+  memory_recv, memory_send, memory_writev, memory_sendfile
+};
+
+/** Creates an in-memory pipe, with a descriptor that can be passed to
+ *  a protocol handler instead of a socket. The client input is set
+ *  with memory_transport_set_input; once it is all received, the
+ *  connection appears closed by the client.
+ *
+ *  Parameters: keep_output: If non-zero, data sent is kept, to be
+ *                           retrieved by memory_transport_output;
+ *                           otherwise it is only counted.
+ *
+ *  Returns: the pipe, or NULL on error.
+ */
+memory_transport_t memory_transport_create(int keep_output) {
+
+  struct memory_transport *mt = calloc(1, sizeof(struct memory_transport));
+  if (!mt)
+    return NULL;
+  mt->keep_output = keep_output;
+  mt->fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (mt->fd < 0 || transport_attach(mt->fd, &memory_ops, mt) < 0) {
+    if (mt->fd >= 0)
+      close(mt->fd);
+    free(mt);
+    return NULL;
+  }
+  return mt;
+}
+
+/** Frees an in-memory pipe and closes its descriptor.
+ *
+ *  Parameters: mt: Pipe to be freed.
+ */
+void memory_transport_destroy(memory_transport_t mt) {
+
+  transport_detach(mt->fd);
+  close(mt->fd);
+  free(mt->output);
+  free(mt);
+}
+
+/** Returns the descriptor of an in-memory pipe, to be passed to a
+ *  protocol handler.
+ */
+int memory_transport_fd(memory_transport_t mt) {
+  return mt->fd;
+}
+
+/** Starts a new session in an in-memory pipe: sets the data the
+ *  client sends, and discards the output of the previous session.
+ *
+ *  Parameters: mt: Pipe of the session.
+ *              input: Data sent by the client. It is not copied, so
+ *                     it must be kept until the session ends.
+ *              size: Number of bytes in input.
+ *              segment: Most bytes returned by each receive (e.g., to
+ *                       mimic clients sending small segments), or 0
+ *                       for no limit.
+ */
+void memory_transport_set_input(memory_transport_t mt, const char *input,
+				size_t size, size_t segment) {
+
+  mt->input = input;
+  mt->input_size = size;
+  mt->input_pos = 0;
+  mt->segment = segment;
+  mt->output_size = 0;
+}
+
+/** Returns the data sent in the current session of an in-memory pipe.
+ *
+ *  Parameters: mt: Pipe of the session.
+ *              size: Receives the number of bytes sent.
+ *
+ *  Returns: the data sent, or NULL if the output is not kept (or
+ *           nothing was sent).
+ */
+const char *memory_transport_output(memory_transport_t mt, size_t *size) {
+
+  *size = mt->output_size;
+  return mt->keep_output ? mt->output : NULL;
+}
@@ -0,0 +1,39 @@
+/* transport.h
+ * Moves the bytes of a session, through its socket or through another
+ * transport attached to its descriptor (e.g., an in-memory pipe).
+ */
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Operations of a transport, with the same results as the system
+// calls they replace. flags are those of send (e.g., MSG_MORE).
+struct transport_ops {
+  ssize_t (*recv)(int fd, void *ctx, void *buf, size_t size);
+  ssize_t (*send)(int fd, void *ctx, const void *buf, size_t size, int flags);
+  ssize_t (*writev)(int fd, void *ctx, const struct iovec *iov, int count, int flags);
+  ssize_t (*sendfile)(int fd, void *ctx, int file_fd, off_t *offset, size_t size);
+};
+
+int transport_attach(int fd, const struct transport_ops *ops, void *ctx);
+void *transport_detach(int fd);
+int transport_is_socket(int fd);
+
+ssize_t transport_recv(int fd, void *buf, size_t size);
+ssize_t transport_send(int fd, const void *buf, size_t size, int flags);
+ssize_t transport_writev(int fd, const struct iovec *iov, int count, int flags);
+ssize_t transport_sendfile(int fd, int file_fd, off_t *offset, size_t size);
+
+typedef struct memory_transport *memory_transport_t;
+
+memory_transport_t memory_transport_create(int keep_output);
+void memory_transport_destroy(memory_transport_t mt);
+int memory_transport_fd(memory_transport_t mt);
+void memory_transport_set_input(memory_transport_t mt, const char *input,
+				size_t size, size_t segment);
+const char *memory_transport_output(memory_transport_t mt, size_t *size);
+
+#endif